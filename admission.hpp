@@ -0,0 +1,172 @@
+/*
+   Admission control for the write routes.
+   Every limited route gets a Limiter: a request is admitted while fewer than `limit` requests of
+   that route are in flight (running or queued on greenhouseLock), otherwise it is shed with a 503.
+   The limit adapts to the latency the route observes, the gradient way: while the recent latency
+   stays within `tolerance` times the baseline (the fastest request seen in the last window, i.e.
+   the latency without queueing) the limit grows by about sqrt(limit), once it goes above that the
+   limit shrinks in proportion. Writes then cannot pile up behind the lock and the reads that need
+   the same lock keep a bounded wait.
+*/
+
+#ifndef GREENHOUSE_ADMISSION_HPP
+#define GREENHOUSE_ADMISSION_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "./json.hpp"
+#include "./metrics.hpp"
+
+namespace Admission
+{
+    struct Config
+    {
+        bool enabled = true;
+        // Routes (as named in GreenhouseEndpoint::setupRoutes) that get a limiter.
+        std::vector<std::string> routes = {"POST /settings/:settingName/:value", "POST /preconfigurations/select/:value",
+                                           "POST /preconfigurations", "POST /soilHistory"};
+        int initialLimit = 8;
+        int minLimit = 1;
+        int maxLimit = 64;
+        // How much the recent latency may exceed the baseline before the limit shrinks.
+        double tolerance = 2.0;
+        // When above 0, the baseline never goes over this latency (seconds).
+        double targetLatency = 0;
+        // Length of the window over which the fastest request is taken as the baseline (seconds).
+        double baselineWindow = 10;
+        // Weight of a new estimate in the limit, between 0 and 1.
+        double smoothing = 0.2;
+        // Seconds sent in the Retry-After header of a shed request.
+        int retryAfter = 1;
+    };
+
+    inline void from_json(const nlohmann::json &j, Config &c)
+    {
+        c.enabled = j.value("enabled", c.enabled);
+        c.routes = j.value("routes", c.routes);
+        c.initialLimit = j.value("initialLimit", c.initialLimit);
+        c.minLimit = j.value("minLimit", c.minLimit);
+        c.maxLimit = j.value("maxLimit", c.maxLimit);
+        c.tolerance = j.value("tolerance", c.tolerance);
+        c.targetLatency = j.value("targetLatency", c.targetLatency);
+        c.baselineWindow = j.value("baselineWindow", c.baselineWindow);
+        c.smoothing = j.value("smoothing", c.smoothing);
+        c.retryAfter = j.value("retryAfter", c.retryAfter);
+    }
+
+    inline void to_json(nlohmann::json &j, const Config &c)
+    {
+        j = nlohmann::json{
+            {"enabled", c.enabled},
+            {"routes", c.routes},
+            {"initialLimit", c.initialLimit},
+            {"minLimit", c.minLimit},
+            {"maxLimit", c.maxLimit},
+            {"tolerance", c.tolerance},
+            {"targetLatency", c.targetLatency},
+            {"baselineWindow", c.baselineWindow},
+            {"smoothing", c.smoothing},
+            {"retryAfter", c.retryAfter}};
+    }
+
+    class Limiter
+    {
+    public:
+        Limiter(const Config &config, Metrics::Counter &rejected, Metrics::Gauge &limitGauge)
+            : config(config), rejected(rejected), limitGauge(limitGauge),
+              estimate(std::min(std::max(config.initialLimit, config.minLimit), config.maxLimit)),
+              limit(static_cast<int>(estimate))
+        {
+            limitGauge.set(limit.load());
+        }
+
+        // Admits the request if the route is under its limit. Every admitted request must call release.
+        bool tryAcquire()
+        {
+            int current = inFlight.fetch_add(1, std::memory_order_acq_rel) + 1;
+            if (current > limit.load(std::memory_order_relaxed))
+            {
+                inFlight.fetch_sub(1, std::memory_order_acq_rel);
+                rejected.increment();
+                return false;
+            }
+            return true;
+        }
+
+        // Ends an admitted request that took latencyNs and feeds its latency to the limit.
+        void release(uint64_t latencyNs)
+        {
+            int current = inFlight.fetch_sub(1, std::memory_order_acq_rel);
+            update(static_cast<double>(latencyNs), current);
+        }
+
+        int getLimit() const
+        {
+            return limit.load(std::memory_order_relaxed);
+        }
+
+        int getRetryAfter() const
+        {
+            return config.retryAfter;
+        }
+
+    private:
+        // Only one thread updates the estimate at a time; a sample that finds the update busy
+        // is dropped rather than making the write routes contend on one more lock.
+        void update(double latency, int inFlightAtEnd)
+        {
+            std::unique_lock<std::mutex> guard(updateLock, std::try_to_lock);
+            if (!guard.owns_lock())
+                return;
+
+            // Recent latency over the last ~10 requests.
+            shortLatency = shortLatency == 0 ? latency : shortLatency * 0.9 + latency * 0.1;
+
+            // Fastest request of the current and of the previous window. Keeping the previous one
+            // means the baseline never starts from nothing, and it still follows the route when
+            // its cost really changes.
+            uint64_t now = Metrics::nowNs();
+            if (now - windowStart > static_cast<uint64_t>(config.baselineWindow * 1e9))
+            {
+                previousMin = currentMin;
+                currentMin = latency;
+                windowStart = now;
+            }
+            currentMin = std::min(currentMin, latency);
+            double baseline = previousMin > 0 ? std::min(previousMin, currentMin) : currentMin;
+            if (config.targetLatency > 0)
+                baseline = std::min(baseline, config.targetLatency * 1e9);
+
+            double gradient = std::max(0.5, std::min(1.0, config.tolerance * baseline / shortLatency));
+            double next = estimate * gradient + std::sqrt(estimate);
+            // A route that does not use its limit gives no evidence that a higher one would be fine.
+            if (gradient >= 1.0 && inFlightAtEnd * 2 < estimate)
+                next = estimate;
+
+            estimate = estimate * (1 - config.smoothing) + next * config.smoothing;
+            estimate = std::max<double>(config.minLimit, std::min<double>(config.maxLimit, estimate));
+            limit.store(static_cast<int>(estimate), std::memory_order_relaxed);
+            limitGauge.set(static_cast<int>(estimate));
+        }
+
+        const Config config;
+        Metrics::Counter &rejected;
+        Metrics::Gauge &limitGauge;
+
+        std::atomic<int> inFlight{0};
+        std::mutex updateLock;
+        double shortLatency = 0;
+        double currentMin = 0;
+        double previousMin = 0;
+        uint64_t windowStart = 0;
+        double estimate;
+        std::atomic<int> limit;
+    };
+}
+
+#endif
@@ -0,0 +1,761 @@
+/*
+   Alerts on telemetry.
+   Rules are read from a JSON file (alert_rules.json by default):
+     {"rules": [{"name": "too hot", "severity": "critical",
+                 "when": "temperature > 35", "clear": "temperature < 33"}, ...]}
+   An expression may use the readings (temperature, humidity, luminosity, carbonDioxide), the
+   setpoints of the active configuration (setpoint.temperature, ...), numbers, + - * /,
+   comparisons, and / or / not and abs, min, max.
+   All rules are compiled into one flat stack program, so checking a reading runs a short loop
+   over an instruction array without allocating. An alert is raised for a zone when `when`
+   becomes true and cleared when `clear` does (or, without `clear`, when `when` turns false):
+   the gap between the two is the hysteresis. Only these transitions are reported, once each,
+   however many readings or request threads see them. A rule is not checked while one of the
+   values it uses is unknown.
+*/
+
+#ifndef GREENHOUSE_ALERTS_HPP
+#define GREENHOUSE_ALERTS_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "./json.hpp"
+#include "./metrics.hpp"
+#include "./response_builder.hpp"
+#include "./climate_control.hpp"
+
+namespace Alerts
+{
+    struct Config
+    {
+        bool enabled = true;
+        // File with the rules. A missing file means no rules.
+        std::string rulesFile = "alert_rules.json";
+        // MQTT topic of the alerts.
+        std::string topic = "greenhouse/alerts";
+    };
+
+    inline void from_json(const nlohmann::json &j, Config &c)
+    {
+        c.enabled = j.value("enabled", c.enabled);
+        c.rulesFile = j.value("rulesFile", c.rulesFile);
+        c.topic = j.value("topic", c.topic);
+    }
+
+    inline void to_json(nlohmann::json &j, const Config &c)
+    {
+        j = nlohmann::json{
+            {"enabled", c.enabled},
+            {"rulesFile", c.rulesFile},
+            {"topic", c.topic}};
+    }
+
+    struct Rule
+    {
+        std::string name;
+        std::string severity = "warning";
+        std::string when;
+        std::string clear;
+    };
+
+    inline void from_json(const nlohmann::json &j, Rule &r)
+    {
+        j.at("name").get_to(r.name);
+        j.at("when").get_to(r.when);
+        r.severity = j.value("severity", r.severity);
+        r.clear = j.value("clear", r.clear);
+    }
+
+    using Values = Climate::Controller::Values;
+
+    enum class Op : uint8_t
+    {
+        Number,
+        Reading,
+        Setpoint,
+        Add,
+        Sub,
+        Mul,
+        Div,
+        Min,
+        Max,
+        Less,
+        LessEqual,
+        Greater,
+        GreaterEqual,
+        Equal,
+        NotEqual,
+        And,
+        Or,
+        Neg,
+        Abs,
+        Not,
+        // Ends the code of every expression.
+        End,
+        // The binary operations with a constant right operand (in value), from Add to NotEqual.
+        AddK,
+        SubK,
+        MulK,
+        DivK,
+        MinK,
+        MaxK,
+        LessK,
+        LessEqualK,
+        GreaterK,
+        GreaterEqualK,
+        EqualK,
+        NotEqualK
+    };
+
+    // The result of a binary (or, with b unused, unary) operation, for constant folding.
+    inline double apply(Op op, double a, double b)
+    {
+        switch (op)
+        {
+        case Op::Add:
+            return a + b;
+        case Op::Sub:
+            return a - b;
+        case Op::Mul:
+            return a * b;
+        case Op::Div:
+            return a / b;
+        case Op::Min:
+            return std::min(a, b);
+        case Op::Max:
+            return std::max(a, b);
+        case Op::Less:
+            return a < b;
+        case Op::LessEqual:
+            return a <= b;
+        case Op::Greater:
+            return a > b;
+        case Op::GreaterEqual:
+            return a >= b;
+        case Op::Equal:
+            return a == b;
+        case Op::NotEqual:
+            return a != b;
+        case Op::And:
+            return a != 0 && b != 0;
+        case Op::Or:
+            return a != 0 || b != 0;
+        case Op::Neg:
+            return -a;
+        case Op::Abs:
+            return std::fabs(a);
+        case Op::Not:
+            return a == 0;
+        default:
+            return NAN;
+        }
+    }
+
+    struct Instruction
+    {
+        Op op;
+        uint8_t index;
+        double value;
+    };
+
+    // All rules, compiled. Booleans are 0 and 1 on the stack.
+    class Program
+    {
+    public:
+        static constexpr size_t kMaxStack = 32;
+
+        // Compiles the rules; throws std::invalid_argument naming the rule with an error.
+        explicit Program(const std::vector<Rule> &rules = {})
+        {
+            for (const Rule &rule : rules)
+            {
+                Compiled compiled;
+                compiled.name = rule.name;
+                compiled.severity = rule.severity;
+                try
+                {
+                    compiled.when = compile(rule.when, compiled.uses);
+                    if (!rule.clear.empty())
+                        compiled.clear = compile(rule.clear, compiled.uses);
+                }
+                catch (const std::invalid_argument &e)
+                {
+                    throw std::invalid_argument("alert rule \"" + rule.name + "\": " + e.what());
+                }
+                compiled.hasClear = !rule.clear.empty();
+                this->rules.push_back(compiled);
+            }
+        }
+
+        size_t size() const
+        {
+            return rules.size();
+        }
+
+        const std::string &name(size_t rule) const
+        {
+            return rules[rule].name;
+        }
+
+        const std::string &severity(size_t rule) const
+        {
+            return rules[rule].severity;
+        }
+
+        // Whether any rule needs the setpoints.
+        bool usesSetpoints() const
+        {
+            for (const Compiled &rule : rules)
+                if (rule.uses >> Climate::kSettings)
+                    return true;
+            return false;
+        }
+
+        // Bits of the unknown values, in the layout of the rules' uses: reading i is bit i,
+        // setpoint i bit kSettings + i.
+        static uint32_t unknown(const Values &readings, const Values &setpoints)
+        {
+            uint32_t bits = 0;
+            for (size_t i = 0; i < Climate::kSettings; i++)
+                bits |= (std::isnan(readings[i]) ? 1u : 0u) << i | (std::isnan(setpoints[i]) ? 1u : 0u) << (i + Climate::kSettings);
+            return bits;
+        }
+
+        // Whether every value the rule uses is known, given unknown() of the values.
+        bool known(size_t rule, uint32_t unknownBits) const
+        {
+            return (rules[rule].uses & unknownBits) == 0;
+        }
+
+        // The next state of an alert: raised when `when` holds, kept until `clear` holds.
+        bool active(size_t rule, bool wasActive, const Values &readings, const Values &setpoints) const
+        {
+            const Compiled &compiled = rules[rule];
+            if (!wasActive)
+                return run(compiled.when, readings, setpoints) != 0;
+            if (compiled.hasClear)
+                return run(compiled.clear, readings, setpoints) == 0;
+            return run(compiled.when, readings, setpoints) != 0;
+        }
+
+    private:
+        struct Compiled
+        {
+            std::string name;
+            std::string severity;
+            // Start of the code of when and clear.
+            uint32_t when = 0;
+            uint32_t clear = 0;
+            bool hasClear = false;
+            // Bit i: reading i, bit kSettings + i: setpoint i.
+            uint32_t uses = 0;
+        };
+
+        // Direct threaded: every handler jumps straight to the next one (GCC's labels as values),
+        // so each has its own indirect branch to predict instead of all sharing one switch.
+        double run(uint32_t start, const Values &readings, const Values &setpoints) const
+        {
+            static void *const handlers[] = {&&number, &&reading, &&setpoint, &&add, &&sub, &&mul, &&div, &&min, &&max, &&less, &&lessEqual,
+                                             &&greater, &&greaterEqual, &&equal, &&notEqual, &&and_, &&or_, &&neg, &&abs, &&not_, &&end,
+                                             &&addK, &&subK, &&mulK, &&divK, &&minK, &&maxK, &&lessK, &&lessEqualK, &&greaterK, &&greaterEqualK, &&equalK, &&notEqualK};
+            double stack[kMaxStack];
+            double *top = stack;
+            const Instruction *in = &code[start];
+#define NEXT goto *handlers[static_cast<int>((++in)->op)]
+            goto *handlers[static_cast<int>(in->op)];
+        number:
+            *top++ = in->value;
+            NEXT;
+        reading:
+            *top++ = readings[in->index];
+            NEXT;
+        setpoint:
+            *top++ = setpoints[in->index];
+            NEXT;
+        neg:
+            top[-1] = -top[-1];
+            NEXT;
+        abs:
+            top[-1] = std::fabs(top[-1]);
+            NEXT;
+        not_:
+            top[-1] = top[-1] == 0;
+            NEXT;
+        add:
+            top[-2] = top[-2] + top[-1];
+            top--;
+            NEXT;
+        sub:
+            top[-2] = top[-2] - top[-1];
+            top--;
+            NEXT;
+        mul:
+            top[-2] = top[-2] * top[-1];
+            top--;
+            NEXT;
+        div:
+            top[-2] = top[-2] / top[-1];
+            top--;
+            NEXT;
+        min:
+            top[-2] = std::min(top[-2], top[-1]);
+            top--;
+            NEXT;
+        max:
+            top[-2] = std::max(top[-2], top[-1]);
+            top--;
+            NEXT;
+        less:
+            top[-2] = top[-2] < top[-1];
+            top--;
+            NEXT;
+        lessEqual:
+            top[-2] = top[-2] <= top[-1];
+            top--;
+            NEXT;
+        greater:
+            top[-2] = top[-2] > top[-1];
+            top--;
+            NEXT;
+        greaterEqual:
+            top[-2] = top[-2] >= top[-1];
+            top--;
+            NEXT;
+        equal:
+            top[-2] = top[-2] == top[-1];
+            top--;
+            NEXT;
+        notEqual:
+            top[-2] = top[-2] != top[-1];
+            top--;
+            NEXT;
+        and_:
+            top[-2] = top[-2] != 0 && top[-1] != 0;
+            top--;
+            NEXT;
+        or_:
+            top[-2] = top[-2] != 0 || top[-1] != 0;
+            top--;
+            NEXT;
+        addK:
+            top[-1] = top[-1] + in->value;
+            NEXT;
+        subK:
+            top[-1] = top[-1] - in->value;
+            NEXT;
+        mulK:
+            top[-1] = top[-1] * in->value;
+            NEXT;
+        divK:
+            top[-1] = top[-1] / in->value;
+            NEXT;
+        minK:
+            top[-1] = std::min(top[-1], in->value);
+            NEXT;
+        maxK:
+            top[-1] = std::max(top[-1], in->value);
+            NEXT;
+        lessK:
+            top[-1] = top[-1] < in->value;
+            NEXT;
+        lessEqualK:
+            top[-1] = top[-1] <= in->value;
+            NEXT;
+        greaterK:
+            top[-1] = top[-1] > in->value;
+            NEXT;
+        greaterEqualK:
+            top[-1] = top[-1] >= in->value;
+            NEXT;
+        equalK:
+            top[-1] = top[-1] == in->value;
+            NEXT;
+        notEqualK:
+            top[-1] = top[-1] != in->value;
+            NEXT;
+        end:
+#undef NEXT
+            return stack[0];
+        }
+
+        // Recursive descent over the expression, emitting postfix code:
+        //   or := and ("or" and)*        and := not ("and" not)*      not := "not" not | compare
+        //   compare := sum (op sum)?     sum := product (("+"|"-") product)*
+        //   product := unary (("*"|"/") unary)*   unary := "-" unary | atom
+        //   atom := number | name | function "(" or ("," or)? ")" | "(" or ")"
+        class Compiler
+        {
+        public:
+            Compiler(const std::string &text, std::vector<Instruction> &code, uint32_t &uses)
+                : text(text), code(code), uses(uses), start(code.size())
+            {
+            }
+
+            void compile()
+            {
+                parseOr();
+                skipSpaces();
+                if (at < text.size())
+                    fail("unexpected \"" + text.substr(at) + "\"");
+                if (maxDepth > kMaxStack)
+                    fail("expression too deep");
+            }
+
+        private:
+            void fail(const std::string &message)
+            {
+                throw std::invalid_argument(message + " in \"" + text + "\"");
+            }
+
+            void skipSpaces()
+            {
+                while (at < text.size() && isspace(static_cast<unsigned char>(text[at])))
+                    at++;
+            }
+
+            bool accept(const char *token)
+            {
+                skipSpaces();
+                size_t length = strlen(token);
+                if (text.compare(at, length, token) != 0)
+                    return false;
+                // Words must end where the token ends.
+                if (isalpha(static_cast<unsigned char>(token[0])) && at + length < text.size() &&
+                    (isalnum(static_cast<unsigned char>(text[at + length])) || text[at + length] == '_'))
+                    return false;
+                at += length;
+                return true;
+            }
+
+            void expect(const char *token)
+            {
+                if (!accept(token))
+                    fail(std::string("expected \"") + token + "\"");
+            }
+
+            // Appends an instruction, folding operations on constants and turning a binary
+            // operation on a constant into its K form, so the code has fewer instructions to run.
+            // An operand that ends with a Number is that Number, as every longer one ends with an operation.
+            void emit(Op op, uint8_t index = 0, double value = 0)
+            {
+                if (op == Op::Number || op == Op::Reading || op == Op::Setpoint)
+                {
+                    maxDepth = std::max(maxDepth, ++depth);
+                    code.push_back(Instruction{op, index, value});
+                    return;
+                }
+                bool unary = op == Op::Neg || op == Op::Abs || op == Op::Not;
+                if (!unary)
+                    depth--;
+                size_t n = code.size() - start;
+                if (unary && n >= 1 && code.back().op == Op::Number)
+                    code.back().value = apply(op, code.back().value, 0);
+                else if (!unary && n >= 2 && code.back().op == Op::Number && code[code.size() - 2].op == Op::Number)
+                {
+                    double b = code.back().value;
+                    code.pop_back();
+                    code.back().value = apply(op, code.back().value, b);
+                }
+                else if (!unary && n >= 1 && code.back().op == Op::Number && op >= Op::Add && op <= Op::NotEqual)
+                    code.back() = Instruction{static_cast<Op>(static_cast<int>(Op::AddK) + static_cast<int>(op) - static_cast<int>(Op::Add)), 0, code.back().value};
+                else
+                    code.push_back(Instruction{op, index, value});
+            }
+
+            void parseOr()
+            {
+                parseAnd();
+                while (accept("or") || accept("||"))
+                {
+                    parseAnd();
+                    emit(Op::Or);
+                }
+            }
+
+            void parseAnd()
+            {
+                parseNot();
+                while (accept("and") || accept("&&"))
+                {
+                    parseNot();
+                    emit(Op::And);
+                }
+            }
+
+            void parseNot()
+            {
+                skipSpaces();
+                if (text.compare(at, 2, "!=") != 0 && (accept("not") || accept("!")))
+                {
+                    parseNot();
+                    emit(Op::Not);
+                    return;
+                }
+                parseCompare();
+            }
+
+            void parseCompare()
+            {
+                parseSum();
+                static const std::pair<const char *, Op> comparisons[] = {
+                    {"<=", Op::LessEqual}, {">=", Op::GreaterEqual}, {"==", Op::Equal}, {"!=", Op::NotEqual}, {"<", Op::Less}, {">", Op::Greater}};
+                for (const auto &comparison : comparisons)
+                    if (accept(comparison.first))
+                    {
+                        parseSum();
+                        emit(comparison.second);
+                        return;
+                    }
+            }
+
+            void parseSum()
+            {
+                parseProduct();
+                for (;;)
+                {
+                    if (accept("+"))
+                    {
+                        parseProduct();
+                        emit(Op::Add);
+                    }
+                    else if (accept("-"))
+                    {
+                        parseProduct();
+                        emit(Op::Sub);
+                    }
+                    else
+                        return;
+                }
+            }
+
+            void parseProduct()
+            {
+                parseUnary();
+                for (;;)
+                {
+                    if (accept("*"))
+                    {
+                        parseUnary();
+                        emit(Op::Mul);
+                    }
+                    else if (accept("/"))
+                    {
+                        parseUnary();
+                        emit(Op::Div);
+                    }
+                    else
+                        return;
+                }
+            }
+
+            void parseUnary()
+            {
+                if (accept("-"))
+                {
+                    parseUnary();
+                    emit(Op::Neg);
+                    return;
+                }
+                parseAtom();
+            }
+
+            void parseAtom()
+            {
+                skipSpaces();
+                if (accept("("))
+                {
+                    parseOr();
+                    expect(")");
+                    return;
+                }
+                if (at < text.size() && (isdigit(static_cast<unsigned char>(text[at])) || text[at] == '.'))
+                {
+                    char *end;
+                    double value = strtod(text.c_str() + at, &end);
+                    at = end - text.c_str();
+                    emit(Op::Number, 0, value);
+                    return;
+                }
+
+                size_t start = at;
+                while (at < text.size() && (isalnum(static_cast<unsigned char>(text[at])) || text[at] == '_' || text[at] == '.'))
+                    at++;
+                std::string name = text.substr(start, at - start);
+                if (name.empty())
+                    fail("expected a value at \"" + text.substr(start) + "\"");
+
+                if (name == "abs" || name == "min" || name == "max")
+                {
+                    expect("(");
+                    parseOr();
+                    if (name != "abs")
+                    {
+                        expect(",");
+                        parseOr();
+                    }
+                    expect(")");
+                    emit(name == "abs" ? Op::Abs : name == "min" ? Op::Min
+                                                                 : Op::Max);
+                    return;
+                }
+
+                bool setpoint = name.compare(0, 9, "setpoint.") == 0;
+                size_t index = Climate::settingIndex(setpoint ? name.substr(9) : name);
+                if (index == Climate::kSettings)
+                    fail("unknown value \"" + name + "\"");
+                uses |= 1u << (index + (setpoint ? Climate::kSettings : 0));
+                emit(setpoint ? Op::Setpoint : Op::Reading, static_cast<uint8_t>(index));
+            }
+
+            const std::string &text;
+            std::vector<Instruction> &code;
+            uint32_t &uses;
+            // Where the code of this expression starts; nothing before it may be folded.
+            size_t start;
+            size_t at = 0;
+            size_t depth = 0;
+            size_t maxDepth = 0;
+        };
+
+        // Appends the code of an expression, ended by Op::End, and returns where it starts.
+        uint32_t compile(const std::string &expression, uint32_t &uses)
+        {
+            uint32_t start = static_cast<uint32_t>(code.size());
+            Compiler(expression, code, uses).compile();
+            code.push_back(Instruction{Op::End, 0, 0});
+            return start;
+        }
+
+        std::vector<Compiled> rules;
+        std::vector<Instruction> code;
+    };
+
+    // Reads the rules file. A missing file gives no rules, a malformed one throws.
+    inline std::vector<Rule> loadRules(const std::string &file)
+    {
+        std::ifstream in(file);
+        if (!in)
+            return {};
+        return nlohmann::json::parse(in).at("rules").get<std::vector<Rule>>();
+    }
+
+    // A change of an alert, to be published.
+    struct Event
+    {
+        size_t rule;
+        size_t zone;
+        bool raised;
+    };
+
+    // The compiled rules and the state of every (rule, zone) alert.
+    class Engine
+    {
+    public:
+        Engine(Metrics::Registry &metrics)
+            : raisedCount(metrics.counter("greenhouse_alerts_total", "state=\"raised\"", "Alerts raised and cleared.")),
+              clearedCount(metrics.counter("greenhouse_alerts_total", "state=\"cleared\"", "Alerts raised and cleared.")),
+              activeCount(metrics.gauge("greenhouse_alerts_active", "", "Alerts currently raised."))
+        {
+        }
+
+        // Compiles the rules for zones zones. Call it before any check.
+        void configure(const std::vector<Rule> &rules, size_t zones)
+        {
+            program = Program(rules);
+            this->zones = zones;
+            states.reset(new std::atomic<uint8_t>[program.size() * zones]());
+            active = 0;
+            activeCount.set(0);
+        }
+
+        bool usesSetpoints() const
+        {
+            return program.usesSetpoints();
+        }
+
+        // Checks the latest readings of a zone against every rule, appending the alerts that
+        // changed to events. The change is claimed with a compare-and-swap, so two threads
+        // checking the same zone never report it twice.
+        void check(size_t zone, const Values &readings, const Values &setpoints, std::vector<Event> &events)
+        {
+            if (zone >= zones)
+                return;
+            uint32_t unknown = Program::unknown(readings, setpoints);
+            for (size_t rule = 0; rule < program.size(); rule++)
+            {
+                if (!program.known(rule, unknown))
+                    continue;
+                std::atomic<uint8_t> &state = states[zone * program.size() + rule];
+                uint8_t was = state.load(std::memory_order_relaxed);
+                uint8_t now = program.active(rule, was != 0, readings, setpoints) ? 1 : 0;
+                if (now == was || !state.compare_exchange_strong(was, now, std::memory_order_relaxed))
+                    continue;
+                events.push_back(Event{rule, zone, now != 0});
+                (now ? raisedCount : clearedCount).increment();
+                activeCount.set(active.fetch_add(now ? 1 : -1, std::memory_order_relaxed) + (now ? 1 : -1));
+            }
+        }
+
+        // {"raised":true,"rule":..,"severity":..,"zone":..,"readings":{..}}
+        void writeEvent(const Event &event, const Values &readings, Reply::Builder &out) const
+        {
+            out.append('{').appendKey("raised", true).append(event.raised ? "true" : "false");
+            out.appendKey("readings").append('{');
+            for (size_t i = 0; i < Climate::kSettings; i++)
+            {
+                out.appendKey(Climate::kSettingNames[i], i == 0);
+                if (std::isnan(readings[i]))
+                    out.append("null");
+                else
+                    out.appendJSON(readings[i]);
+            }
+            out.append('}');
+            out.appendKey("rule").appendJSON(program.name(event.rule));
+            out.appendKey("severity").appendJSON(program.severity(event.rule));
+            out.appendKey("zone").append(static_cast<long long>(event.zone)).append('}');
+        }
+
+        // The raised alerts, as [{"rule":..,"severity":..,"zone":..},...].
+        void writeActive(Reply::Builder &out) const
+        {
+            out.append('[');
+            bool first = true;
+            for (size_t rule = 0; rule < program.size(); rule++)
+                for (size_t zone = 0; zone < zones; zone++)
+                {
+                    if (states[zone * program.size() + rule].load(std::memory_order_relaxed) == 0)
+                        continue;
+                    if (!first)
+                        out.append(',');
+                    first = false;
+                    out.append('{').appendKey("rule", true).appendJSON(program.name(rule));
+                    out.appendKey("severity").appendJSON(program.severity(rule));
+                    out.appendKey("zone").append(static_cast<long long>(zone)).append('}');
+                }
+            out.append(']');
+        }
+
+    private:
+        Program program;
+        size_t zones = 0;
+        std::unique_ptr<std::atomic<uint8_t>[]> states;
+        std::atomic<int64_t> active{0};
+
+        Metrics::Counter &raisedCount;
+        Metrics::Counter &clearedCount;
+        Metrics::Gauge &activeCount;
+    };
+}
+
+#endif
@@ -0,0 +1,934 @@
+/*
+   Audit log of the changes made to the greenhouse: who changed which setting, preconfiguration or
+   soil history entry, and when. A request thread only appends the event to a bounded lock-free
+   ring (a few atomic operations, no lock and no I/O); a flusher thread drains the ring every
+   flushInterval and appends its events to a binary file as one batch, with one write. GET /audit
+   reads them back; the batches are indexed in memory, so a query only decodes the ones in range.
+   Every checkpointEvery events a checkpoint of all the settings is logged too, so the settings at
+   any time are rebuilt (GET /settings/getAll?at=) from the checkpoint before it and at most
+   checkpointEvery events after it, however long the log is.
+   A request that must not be answered before its change is on disk waits with whenFlushed(),
+   which wakes the flusher up: the changes waited for at the same time share one write.
+
+   File format (native byte order), a sequence of batches:
+       uint32 magic, uint32 size of the events, uint32 number of events, uint32 number of checkpoints,
+       uint64 sequence of the first event, int64 earliest and latest time (microseconds since the epoch)
+   then the events: kind (1 byte), time after the earliest (varint), actor, and the fields of the kind.
+   Strings are a varint length and the bytes, integers (zigzag) varints, amounts 8 byte doubles.
+*/
+
+#ifndef GREENHOUSE_AUDIT_LOG_HPP
+#define GREENHOUSE_AUDIT_LOG_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include "./json.hpp"
+#include "./metrics.hpp"
+#include "./response_builder.hpp"
+#include "./greenhouse.hpp"
+
+namespace Audit
+{
+    struct Config
+    {
+        bool enabled = true;
+        std::string file = "audit.log";
+        // Events the ring holds between two flushes (rounded up to a power of two). When it is
+        // full, events are dropped and counted rather than making a request wait.
+        size_t capacity = 16384;
+        // Seconds between two flushes.
+        double flushInterval = 0.1;
+        // Events between two checkpoints of the settings.
+        size_t checkpointEvery = 256;
+    };
+
+    inline void from_json(const nlohmann::json &j, Config &c)
+    {
+        c.enabled = j.value("enabled", c.enabled);
+        c.file = j.value("file", c.file);
+        c.capacity = j.value("capacity", c.capacity);
+        c.flushInterval = j.value("flushInterval", c.flushInterval);
+        c.checkpointEvery = j.value("checkpointEvery", c.checkpointEvery);
+    }
+
+    inline void to_json(nlohmann::json &j, const Config &c)
+    {
+        j = nlohmann::json{
+            {"enabled", c.enabled},
+            {"file", c.file},
+            {"capacity", c.capacity},
+            {"flushInterval", c.flushInterval},
+            {"checkpointEvery", c.checkpointEvery}};
+    }
+
+    enum class Kind : uint8_t
+    {
+        Set = 1,
+        SelectPreconfiguration,
+        AddPreconfiguration,
+        AddPlant,
+        Checkpoint
+    };
+
+    // Microseconds since the epoch.
+    inline int64_t nowUs()
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    using Settings = SettingsSnapshot;
+
+    struct Event
+    {
+        // Position in the log, given when the event is flushed.
+        uint64_t sequence = 0;
+        int64_t time = 0;
+        Kind kind = Kind::Set;
+        std::string actor;
+        // Set: the setting and its new value.
+        std::string setting;
+        std::string value;
+        // SelectPreconfiguration: its number and the values it applied. AddPreconfiguration: the new one.
+        int64_t number = 0;
+        Preconfiguration preconfiguration = {};
+        // AddPlant: the new season.
+        Season season;
+        // Checkpoint: all the settings.
+        Settings settings;
+    };
+
+    inline Event settingChanged(const std::string &actor, const std::string &setting, const std::string &value)
+    {
+        Event event;
+        event.time = nowUs();
+        event.kind = Kind::Set;
+        event.actor = actor;
+        event.setting = setting;
+        event.value = value;
+        return event;
+    }
+
+    inline Event preconfigurationSelected(const std::string &actor, int number, const Preconfiguration &applied)
+    {
+        Event event;
+        event.time = nowUs();
+        event.kind = Kind::SelectPreconfiguration;
+        event.actor = actor;
+        event.number = number;
+        event.preconfiguration = applied;
+        return event;
+    }
+
+    inline Event preconfigurationAdded(const std::string &actor, const Preconfiguration &added)
+    {
+        Event event;
+        event.time = nowUs();
+        event.kind = Kind::AddPreconfiguration;
+        event.actor = actor;
+        event.preconfiguration = added;
+        return event;
+    }
+
+    inline Event plantAdded(const std::string &actor, const Season &season)
+    {
+        Event event;
+        event.time = nowUs();
+        event.kind = Kind::AddPlant;
+        event.actor = actor;
+        event.season = season;
+        return event;
+    }
+
+    inline Event checkpoint(const Settings &settings)
+    {
+        Event event;
+        event.time = nowUs();
+        event.kind = Kind::Checkpoint;
+        event.settings = settings;
+        return event;
+    }
+
+    // Applies a logged change to the settings.
+    inline void replay(const Event &event, Settings &settings)
+    {
+        if (event.kind == Kind::Checkpoint)
+            settings = event.settings;
+        else if (event.kind == Kind::SelectPreconfiguration)
+        {
+            settings.luminosity = event.preconfiguration.luminosity;
+            settings.humidity = event.preconfiguration.humidity;
+            settings.temperature = event.preconfiguration.temperature;
+            settings.carbonDioxide = event.preconfiguration.carbonDioxide;
+            settings.plantType = event.preconfiguration.plantType;
+        }
+        else if (event.kind == Kind::Set)
+        {
+            // Only changes the greenhouse accepted are logged, so the values parse.
+            const std::pair<const char *, double *> numbers[] = {{"area", &settings.area}, {"carbonDioxide", &settings.carbonDioxide},
+                                                                 {"humidity", &settings.humidity}, {"luminosity", &settings.luminosity},
+                                                                 {"temperature", &settings.temperature}, {"waterAmount", &settings.waterAmount}};
+            for (const auto &number : numbers)
+                if (event.setting == number.first)
+                    *number.second = std::strtod(event.value.c_str(), nullptr);
+            if (event.setting == "plantType")
+                settings.plantType = event.value;
+            else if (event.setting == "irigationTime")
+                settings.irigationTime = event.value;
+        }
+    }
+
+    // Encoding of the events, see the format above.
+    namespace Codec
+    {
+        inline void putVarint(std::string &out, uint64_t value)
+        {
+            while (value >= 0x80)
+            {
+                out.push_back(static_cast<char>(value | 0x80));
+                value >>= 7;
+            }
+            out.push_back(static_cast<char>(value));
+        }
+
+        inline void putSigned(std::string &out, int64_t value)
+        {
+            putVarint(out, (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63));
+        }
+
+        inline void putString(std::string &out, const std::string &text)
+        {
+            putVarint(out, text.size());
+            out.append(text);
+        }
+
+        template <typename T>
+        void putRaw(std::string &out, T value)
+        {
+            out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+        }
+
+        // Reads from [at, end); every get returns false on truncated input.
+        struct Reader
+        {
+            const char *at;
+            const char *end;
+
+            bool getVarint(uint64_t &value)
+            {
+                value = 0;
+                for (int shift = 0; shift < 64 && at < end; shift += 7)
+                {
+                    uint8_t byte = static_cast<uint8_t>(*at++);
+                    value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+                    if (byte < 0x80)
+                        return true;
+                }
+                return false;
+            }
+
+            bool getSigned(int64_t &value)
+            {
+                uint64_t zigzag;
+                if (!getVarint(zigzag))
+                    return false;
+                value = static_cast<int64_t>(zigzag >> 1) ^ -static_cast<int64_t>(zigzag & 1);
+                return true;
+            }
+
+            bool getString(std::string &text)
+            {
+                uint64_t size;
+                if (!getVarint(size) || size > static_cast<uint64_t>(end - at))
+                    return false;
+                text.assign(at, static_cast<size_t>(size));
+                at += size;
+                return true;
+            }
+
+            template <typename T>
+            bool getRaw(T &value)
+            {
+                if (static_cast<size_t>(end - at) < sizeof(value))
+                    return false;
+                std::memcpy(&value, at, sizeof(value));
+                at += sizeof(value);
+                return true;
+            }
+        };
+
+        inline void putPreconfiguration(std::string &out, const Preconfiguration &p)
+        {
+            putRaw(out, p.luminosity);
+            putRaw(out, p.humidity);
+            putRaw(out, p.temperature);
+            putRaw(out, p.carbonDioxide);
+            putString(out, p.plantType);
+        }
+
+        inline bool getPreconfiguration(Reader &in, Preconfiguration &p)
+        {
+            return in.getRaw(p.luminosity) && in.getRaw(p.humidity) && in.getRaw(p.temperature) &&
+                   in.getRaw(p.carbonDioxide) && in.getString(p.plantType);
+        }
+
+        inline void putEvent(std::string &out, const Event &event, int64_t baseTime)
+        {
+            out.push_back(static_cast<char>(event.kind));
+            putVarint(out, static_cast<uint64_t>(event.time - baseTime));
+            putString(out, event.actor);
+            switch (event.kind)
+            {
+            case Kind::Set:
+                putString(out, event.setting);
+                putString(out, event.value);
+                break;
+            case Kind::SelectPreconfiguration:
+                putSigned(out, event.number);
+                putPreconfiguration(out, event.preconfiguration);
+                break;
+            case Kind::AddPreconfiguration:
+                putPreconfiguration(out, event.preconfiguration);
+                break;
+            case Kind::AddPlant:
+                putString(out, event.season.plantType);
+                putSigned(out, event.season.year);
+                putVarint(out, event.season.zone);
+                putSigned(out, event.season.seasonStart);
+                putSigned(out, event.season.seasonEnd);
+                putRaw(out, event.season.yield);
+                break;
+            case Kind::Checkpoint:
+                for (double value : {event.settings.area, event.settings.carbonDioxide, event.settings.humidity,
+                                     event.settings.luminosity, event.settings.temperature, event.settings.waterAmount})
+                    putRaw(out, value);
+                putString(out, event.settings.irigationTime);
+                putString(out, event.settings.plantType);
+                break;
+            }
+        }
+
+        inline bool getEvent(Reader &in, int64_t baseTime, Event &event)
+        {
+            if (in.at == in.end)
+                return false;
+            event.kind = static_cast<Kind>(*in.at++);
+            uint64_t offset, zone;
+            int64_t year, start, end;
+            if (!in.getVarint(offset) || !in.getString(event.actor))
+                return false;
+            event.time = baseTime + static_cast<int64_t>(offset);
+            switch (event.kind)
+            {
+            case Kind::Set:
+                return in.getString(event.setting) && in.getString(event.value);
+            case Kind::SelectPreconfiguration:
+                return in.getSigned(event.number) && getPreconfiguration(in, event.preconfiguration);
+            case Kind::AddPreconfiguration:
+                return getPreconfiguration(in, event.preconfiguration);
+            case Kind::AddPlant:
+                if (!in.getString(event.season.plantType) || !in.getSigned(year) || !in.getVarint(zone) ||
+                    !in.getSigned(start) || !in.getSigned(end) || !in.getRaw(event.season.yield))
+                    return false;
+                event.season.year = static_cast<int>(year);
+                event.season.zone = static_cast<uint16_t>(zone);
+                event.season.seasonStart = static_cast<int32_t>(start);
+                event.season.seasonEnd = static_cast<int32_t>(end);
+                return true;
+            case Kind::Checkpoint:
+                return in.getRaw(event.settings.area) && in.getRaw(event.settings.carbonDioxide) && in.getRaw(event.settings.humidity) &&
+                       in.getRaw(event.settings.luminosity) && in.getRaw(event.settings.temperature) && in.getRaw(event.settings.waterAmount) &&
+                       in.getString(event.settings.irigationTime) && in.getString(event.settings.plantType);
+            }
+            return false;
+        }
+    }
+
+    // Time in microseconds since the epoch as "YYYY-MM-DDTHH:MM:SS.uuuuuuZ".
+    inline void writeTime(int64_t time, Reply::Builder &out)
+    {
+        time_t seconds = static_cast<time_t>(time / 1000000);
+        struct tm utc;
+        gmtime_r(&seconds, &utc);
+        char text[40];
+        int length = snprintf(text, sizeof(text), "\"%04d-%02d-%02dT%02d:%02d:%02d.%06dZ\"", utc.tm_year + 1900, utc.tm_mon + 1, utc.tm_mday,
+                              utc.tm_hour, utc.tm_min, utc.tm_sec, static_cast<int>(time % 1000000));
+        out.append(text, static_cast<size_t>(length));
+    }
+
+    // One event as a JSON object, with the members of its kind.
+    inline void writeEvent(const Event &event, Reply::Builder &out)
+    {
+        static const char *const kinds[] = {"", "set", "selectPreconfiguration", "addPreconfiguration", "addPlant", "checkpoint"};
+        out.append('{').appendKey("actor", true).appendJSON(event.actor);
+        out.appendKey("kind").appendJSON(std::string(kinds[static_cast<uint8_t>(event.kind)]));
+        out.appendKey("sequence").append(static_cast<long long>(event.sequence));
+        out.appendKey("time");
+        writeTime(event.time, out);
+        switch (event.kind)
+        {
+        case Kind::Set:
+            out.appendKey("setting").appendJSON(event.setting);
+            out.appendKey("value").appendJSON(event.value);
+            break;
+        case Kind::SelectPreconfiguration:
+            out.appendKey("preconfiguration").append(static_cast<long long>(event.number));
+            // fall through: the values it applied
+        case Kind::AddPreconfiguration:
+            out.appendKey("luminosity").appendJSON(event.preconfiguration.luminosity);
+            out.appendKey("humidity").appendJSON(event.preconfiguration.humidity);
+            out.appendKey("temperature").appendJSON(event.preconfiguration.temperature);
+            out.appendKey("carbonDioxide").appendJSON(event.preconfiguration.carbonDioxide);
+            out.appendKey("plantType").appendJSON(event.preconfiguration.plantType);
+            break;
+        case Kind::AddPlant:
+            out.appendKey("plantType").appendJSON(event.season.plantType);
+            out.appendKey("year").append(event.season.year);
+            out.appendKey("zone").append(static_cast<int>(event.season.zone));
+            out.appendKey("yield").appendJSON(event.season.yield);
+            break;
+        case Kind::Checkpoint:
+            out.appendKey("settings");
+            event.settings.write(out);
+            break;
+        }
+        out.append('}');
+    }
+
+    class Log
+    {
+    public:
+        Log(Metrics::Registry &metrics)
+            : appended(metrics.counter("greenhouse_audit_events_total", "", "Events appended to the audit log.")),
+              dropped(metrics.counter("greenhouse_audit_dropped_total", "", "Audit events dropped because the ring was full.")),
+              flushDuration(metrics.histogram("greenhouse_audit_flush_seconds", "", "Time spent writing one batch of the audit log."))
+        {
+        }
+
+        ~Log()
+        {
+            stop();
+            closeFile();
+        }
+
+        // Allocates the ring and indexes the batches already in the file. A batch cut short
+        // (the server stopped while writing it) is cut off the file. Call it before start.
+        // The file is locked for as long as the log uses it: a second server given the same file
+        // fails here instead of interleaving its batches with ours.
+        void configure(const Config &auditConfig)
+        {
+            stop();
+            config = auditConfig;
+            size_t capacity = 1;
+            while (capacity < std::max<size_t>(config.capacity, 2))
+                capacity <<= 1;
+            slots.reset(new Slot[capacity]);
+            mask = capacity - 1;
+            for (size_t i = 0; i < capacity; i++)
+                slots[i].sequence.store(i, std::memory_order_relaxed);
+            tail.store(0, std::memory_order_relaxed);
+            head = 0;
+            sinceCheckpoint.store(0, std::memory_order_relaxed);
+
+            std::lock_guard<std::mutex> guard(fileLock);
+            batches.clear();
+            checkpoints.clear();
+            lostRanges.clear();
+            fileSize = 0;
+            nextSequence = 0;
+            closeFile();
+            if (!config.enabled)
+                return;
+            fileFd = open(config.file.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+            if (fileFd < 0)
+                throw std::runtime_error("cannot open the audit log " + config.file + ": " + strerror(errno));
+            if (flock(fileFd, LOCK_EX | LOCK_NB) != 0)
+            {
+                closeFile();
+                throw std::runtime_error("the audit log " + config.file + " is used by another process, give each server its own (--audit-file)");
+            }
+            std::ifstream in(config.file, std::ios::binary | std::ios::ate);
+            uint64_t available = in ? static_cast<uint64_t>(in.tellg()) : 0;
+            in.seekg(0);
+            Header header;
+            while (fileSize + sizeof(header) <= available && in.read(reinterpret_cast<char *>(&header), sizeof(header)) &&
+                   header.magic == kMagic && fileSize + sizeof(header) + header.size <= available)
+            {
+                // Only the batches holding checkpoints are decoded, to index them.
+                if (header.checkpoints > 0)
+                {
+                    buffer.resize(header.size);
+                    if (!in.read(&buffer[0], header.size) || !indexCheckpoints(header, buffer))
+                        break;
+                }
+                index(header, fileSize);
+                fileSize += sizeof(header) + header.size;
+                in.seekg(static_cast<std::streamoff>(fileSize));
+            }
+            in.close();
+            if (truncate(config.file.c_str(), static_cast<off_t>(fileSize)) != 0 && fileSize > 0)
+                throw std::runtime_error("cannot cut the audit log " + config.file + " to its last whole batch");
+        }
+
+        // Starts the flusher thread, unless the log is disabled.
+        void start()
+        {
+            stop();
+            if (!config.enabled)
+                return;
+            running = true;
+            thread = std::thread(&Log::run, this);
+        }
+
+        // Stops the flusher after a last flush.
+        void stop()
+        {
+            {
+                std::lock_guard<std::mutex> guard(wakeLock);
+                running = false;
+            }
+            wake.notify_all();
+            if (thread.joinable())
+                thread.join();
+            if (slots)
+                flush(true);
+            notifyWaiters(true);
+        }
+
+        bool enabled() const
+        {
+            return config.enabled;
+        }
+
+        // Lock free, callable from any thread. Returns false when the event was dropped. at,
+        // when given, receives the position of the event, to wait for it with whenFlushed().
+        bool append(Event &&event, uint64_t *at = nullptr)
+        {
+            if (!config.enabled)
+                return false;
+            uint64_t position = tail.load(std::memory_order_relaxed);
+            for (;;)
+            {
+                Slot &slot = slots[position & mask];
+                uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+                int64_t lag = static_cast<int64_t>(sequence - position);
+                if (lag == 0)
+                {
+                    if (tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                    {
+                        if (event.kind == Kind::Checkpoint)
+                            sinceCheckpoint.store(0, std::memory_order_relaxed);
+                        else
+                            sinceCheckpoint.fetch_add(1, std::memory_order_relaxed);
+                        slot.event = std::move(event);
+                        slot.sequence.store(position + 1, std::memory_order_release);
+                        appended.increment();
+                        if (at != nullptr)
+                            *at = position;
+                        return true;
+                    }
+                }
+                else if (lag < 0)
+                {
+                    // The replay cannot skip a lost event: checkpoint again as soon as possible.
+                    sinceCheckpoint.store(config.checkpointEvery, std::memory_order_relaxed);
+                    dropped.increment();
+                    return false;
+                }
+                else
+                    position = tail.load(std::memory_order_relaxed);
+            }
+        }
+
+        // True when a checkpoint of the settings should follow the events appended so far.
+        bool checkpointDue() const
+        {
+            return sinceCheckpoint.load(std::memory_order_relaxed) >= config.checkpointEvery;
+        }
+
+        // Writes the events still in the ring to the file, and to the disk with sync.
+        void flush(bool sync = false)
+        {
+            std::lock_guard<std::mutex> guard(fileLock);
+            flushLocked(sync);
+        }
+
+        // Calls done once the event appended at position is on the disk (true) or lost to a failed
+        // write (false), from the flusher thread, or from this one when the flusher is stopped.
+        void whenFlushed(uint64_t position, std::function<void(bool)> done)
+        {
+            bool queued = false;
+            {
+                std::lock_guard<std::mutex> guard(wakeLock);
+                if (running)
+                {
+                    waiters.push_back({position, std::move(done)});
+                    flushRequested = queued = true;
+                }
+            }
+            if (queued)
+            {
+                wake.notify_one();
+                return;
+            }
+            flush(true);
+            bool written;
+            {
+                std::lock_guard<std::mutex> guard(fileLock);
+                written = position < head && !lost(position);
+            }
+            done(written);
+        }
+
+        // The events after sequence after (-1: from the first) with a time in [from, to] (microseconds
+        // since the epoch), at most limit of them: {"items":[...],"next":<sequence to continue after, or null>}.
+        void write(int64_t from, int64_t to, long long after, size_t limit, Reply::Builder &out)
+        {
+            std::lock_guard<std::mutex> guard(fileLock);
+            flushLocked();
+
+            out.append("{\"items\":[");
+            long long next = -1;
+            size_t count = 0;
+            // The latest times only grow along the index, so the batches before the first one
+            // reaching from hold nothing in range.
+            auto first = std::lower_bound(batches.begin(), batches.end(), from, [](const Batch &batch, int64_t time)
+                                          { return batch.latestSoFar < time; });
+            std::ifstream in(config.file, std::ios::binary);
+            std::string body;
+            Event event;
+            for (auto batch = first; batch != batches.end() && batch->earliest <= to && next < 0; ++batch)
+            {
+                if (after >= 0 && batch->firstSequence + batch->events <= static_cast<uint64_t>(after) + 1)
+                    continue;
+                Header header;
+                if (!readBatch(in, static_cast<size_t>(batch - batches.begin()), header, body))
+                    break;
+                Codec::Reader reader{body.data(), body.data() + body.size()};
+                for (uint32_t i = 0; i < header.events && Codec::getEvent(reader, header.earliest, event); i++)
+                {
+                    event.sequence = header.firstSequence + i;
+                    if (event.kind == Kind::Checkpoint || static_cast<long long>(event.sequence) <= after || event.time < from || event.time > to)
+                        continue;
+                    if (count == limit)
+                    {
+                        next = static_cast<long long>(event.sequence) - 1;
+                        break;
+                    }
+                    if (count++ != 0)
+                        out.append(',');
+                    writeEvent(event, out);
+                }
+            }
+            out.append("],\"next\":");
+            if (next >= 0)
+                out.append(next);
+            else
+                out.append("null");
+            out.append('}');
+        }
+
+        // Rebuilds the settings at time at (microseconds since the epoch) from the last checkpoint
+        // before it. Returns false when no checkpoint is that old.
+        bool settingsAt(int64_t at, Settings &settings)
+        {
+            std::lock_guard<std::mutex> guard(fileLock);
+            flushLocked();
+
+            auto after = std::upper_bound(checkpoints.begin(), checkpoints.end(), at, [](int64_t time, const Checkpoint &checkpoint)
+                                          { return time < checkpoint.time; });
+            if (after == checkpoints.begin())
+                return false;
+            const Checkpoint &start = *(after - 1);
+
+            std::ifstream in(config.file, std::ios::binary);
+            std::string body;
+            Event event;
+            size_t offset = start.offset;
+            for (size_t b = start.batch; b < batches.size(); b++, offset = 0)
+            {
+                Header header;
+                if (!readBatch(in, b, header, body))
+                    break;
+                Codec::Reader reader{body.data() + offset, body.data() + body.size()};
+                while (Codec::getEvent(reader, header.earliest, event))
+                {
+                    if (event.time > at)
+                        return true;
+                    replay(event, settings);
+                }
+            }
+            return true;
+        }
+
+    private:
+        static constexpr uint32_t kMagic = 0x31414847; // "GHA1"
+
+        struct Header
+        {
+            uint32_t magic;
+            uint32_t size;
+            uint32_t events;
+            uint32_t checkpoints;
+            uint64_t firstSequence;
+            int64_t earliest;
+            int64_t latest;
+        };
+
+        struct Batch
+        {
+            uint64_t offset;
+            uint64_t firstSequence;
+            uint32_t events;
+            int64_t earliest;
+            // Latest time of this batch and all the ones before it.
+            int64_t latestSoFar;
+        };
+
+        // Where a checkpoint is: its batch (position in batches) and offset in the batch's events.
+        struct Checkpoint
+        {
+            int64_t time;
+            size_t batch;
+            size_t offset;
+        };
+
+        struct Slot
+        {
+            std::atomic<uint64_t> sequence;
+            Event event;
+        };
+
+        void index(const Header &header, uint64_t offset)
+        {
+            int64_t latest = batches.empty() ? header.latest : std::max(header.latest, batches.back().latestSoFar);
+            batches.push_back({offset, header.firstSequence, header.events, header.earliest, latest});
+            nextSequence = header.firstSequence + header.events;
+        }
+
+        // Indexes the checkpoints of the batch about to be added to batches.
+        bool indexCheckpoints(const Header &header, const std::string &body)
+        {
+            Codec::Reader reader{body.data(), body.data() + body.size()};
+            Event event;
+            for (uint32_t i = 0; i < header.events; i++)
+            {
+                size_t offset = static_cast<size_t>(reader.at - body.data());
+                if (!Codec::getEvent(reader, header.earliest, event))
+                    return false;
+                if (event.kind == Kind::Checkpoint)
+                    checkpoints.push_back({event.time, batches.size(), offset});
+            }
+            return true;
+        }
+
+        // Reads the batch at position b of the index. False when the file does not hold the batch
+        // the index expects there. Call it with fileLock held.
+        bool readBatch(std::ifstream &in, size_t b, Header &header, std::string &body)
+        {
+            const Batch &batch = batches[b];
+            uint64_t end = b + 1 < batches.size() ? batches[b + 1].offset : fileSize;
+            if (!in.seekg(static_cast<std::streamoff>(batch.offset)) || !in.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+                header.magic != kMagic || batch.offset + sizeof(header) + header.size != end ||
+                header.firstSequence != batch.firstSequence || header.events != batch.events)
+                return false;
+            body.resize(header.size);
+            return static_cast<bool>(in.read(&body[0], header.size));
+        }
+
+        void closeFile()
+        {
+            if (fileFd >= 0)
+                close(fileFd);
+            fileFd = -1;
+        }
+
+        struct Waiter
+        {
+            uint64_t position;
+            std::function<void(bool)> done;
+        };
+
+        // Whether the event at position was in a batch that could not be written. Call it with
+        // fileLock held.
+        bool lost(uint64_t position) const
+        {
+            for (const auto &range : lostRanges)
+                if (position >= range.first && position < range.second)
+                    return true;
+            return false;
+        }
+
+        // Calls the waiters whose event has been flushed; the others wait for the next flush,
+        // unless the log is stopping (all).
+        void notifyWaiters(bool all)
+        {
+            std::vector<std::pair<std::function<void(bool)>, bool>> ready;
+            {
+                std::lock_guard<std::mutex> files(fileLock);
+                std::lock_guard<std::mutex> guard(wakeLock);
+                size_t kept = 0;
+                for (Waiter &waiter : waiters)
+                {
+                    if (waiter.position < head || all)
+                        ready.emplace_back(std::move(waiter.done), waiter.position < head && !lost(waiter.position));
+                    else
+                        waiters[kept++] = std::move(waiter);
+                }
+                waiters.resize(kept);
+                // An event still being appended is written by the next flush, right away.
+                flushRequested = !waiters.empty();
+            }
+            for (auto &waiter : ready)
+                waiter.first(waiter.second);
+        }
+
+        // Writes all of data at offset of the file.
+        bool writeAt(const char *data, size_t size, uint64_t offset)
+        {
+            while (size > 0)
+            {
+                ssize_t written = pwrite(fileFd, data, size, static_cast<off_t>(offset));
+                if (written < 0 && errno == EINTR)
+                    continue;
+                if (written <= 0)
+                    return false;
+                data += written;
+                size -= static_cast<size_t>(written);
+                offset += static_cast<uint64_t>(written);
+            }
+            return true;
+        }
+
+        // Single consumer of the ring: only called with fileLock held. With sync the batch is also
+        // forced to the disk before it counts as written, for the changes someone waits on.
+        void flushLocked(bool sync = false)
+        {
+            uint64_t started = Metrics::nowNs();
+            uint64_t first = head;
+            Header header = {kMagic, 0, 0, 0, nextSequence, INT64_MAX, INT64_MIN};
+            pending.clear();
+            for (;; head++)
+            {
+                Slot &slot = slots[head & mask];
+                if (slot.sequence.load(std::memory_order_acquire) != head + 1)
+                    break;
+                header.earliest = std::min(header.earliest, slot.event.time);
+                header.latest = std::max(header.latest, slot.event.time);
+                pending.push_back(std::move(slot.event));
+                slot.sequence.store(head + mask + 1, std::memory_order_release);
+            }
+            if (pending.empty())
+                return;
+
+            buffer.assign(sizeof(header), '\0');
+            size_t firstCheckpoint = checkpoints.size();
+            for (const Event &event : pending)
+            {
+                if (event.kind == Kind::Checkpoint)
+                {
+                    checkpoints.push_back({event.time, batches.size(), buffer.size() - sizeof(header)});
+                    header.checkpoints++;
+                }
+                Codec::putEvent(buffer, event, header.earliest);
+            }
+            header.size = static_cast<uint32_t>(buffer.size() - sizeof(header));
+            header.events = static_cast<uint32_t>(pending.size());
+            std::memcpy(&buffer[0], &header, sizeof(header));
+
+            if (fileFd < 0 || !writeAt(buffer.data(), buffer.size(), fileSize) || (sync && fdatasync(fileFd) != 0))
+            {
+                // Whatever part of the batch was written is cut off, so the next batch goes where
+                // the index expects it.
+                if (ftruncate(fileFd, static_cast<off_t>(fileSize)) != 0)
+                    std::cerr << "Cannot cut the audit log " << config.file << " back to its last whole batch: " << strerror(errno) << std::endl;
+                lostRanges.emplace_back(first, head);
+                checkpoints.resize(firstCheckpoint);
+                sinceCheckpoint.store(config.checkpointEvery, std::memory_order_relaxed);
+                dropped.increment(pending.size());
+                return;
+            }
+            index(header, fileSize);
+            fileSize += buffer.size();
+            flushDuration.record(Metrics::nowNs() - started);
+        }
+
+        void run()
+        {
+            auto interval = std::chrono::duration<double>(config.flushInterval);
+            std::unique_lock<std::mutex> guard(wakeLock);
+            while (running)
+            {
+                wake.wait_for(guard, interval, [this]()
+                              { return !running || flushRequested; });
+                if (!running)
+                    break;
+                // Only a flush someone waits on pays for the sync.
+                bool sync = !waiters.empty();
+                flushRequested = false;
+                guard.unlock();
+                flush(sync);
+                notifyWaiters(false);
+                guard.lock();
+            }
+        }
+
+        Config config;
+
+        Metrics::Counter &appended;
+        Metrics::Counter &dropped;
+        Metrics::Histogram &flushDuration;
+
+        // Bounded multi producer ring: a slot is free for position p when its sequence is p and
+        // holds the event of p when it is p + 1.
+        std::unique_ptr<Slot[]> slots;
+        size_t mask = 0;
+        alignas(64) std::atomic<uint64_t> tail{0};
+        // Events appended since the last checkpoint.
+        std::atomic<size_t> sinceCheckpoint{0};
+
+        // Owned by whoever holds fileLock.
+        std::mutex fileLock;
+        // Open (and locked) while the log is configured.
+        int fileFd = -1;
+        uint64_t head = 0;
+        uint64_t fileSize = 0;
+        uint64_t nextSequence = 0;
+        std::vector<Batch> batches;
+        // In the order of the log, so of their times too.
+        std::vector<Checkpoint> checkpoints;
+        std::vector<Event> pending;
+        std::string buffer;
+        // Positions [first, end) of the batches that could not be written.
+        std::vector<std::pair<uint64_t, uint64_t>> lostRanges;
+
+        std::mutex wakeLock;
+        std::condition_variable wake;
+        bool running = false;
+        // Waiting for their event to be flushed; the flusher does not wait for its interval.
+        std::vector<Waiter> waiters;
+        bool flushRequested = false;
+        std::thread thread;
+    };
+}
+
+#endif
@@ -0,0 +1,483 @@
+/*
+   Closed loop climate control.
+   Sensors report the measured temperature, humidity, luminosity and carbon dioxide of their zone
+   (POST /telemetry). A control thread wakes up at a fixed rate, compares the latest measurements
+   with the greenhouse's setpoints and runs one PID controller per zone and setting (all of them
+   kept in the arrays of a PidBank and updated with vector instructions); the commands
+   of a tick (between -1 and 1, e.g. cool/heat) are published together as one MQTT message.
+   A tick controls at most zonesPerTick zones, round robin, so its work stays bounded whatever
+   the number of zones; its duration and the deadlines it missed are exported as metrics.
+*/
+
+#ifndef GREENHOUSE_CLIMATE_CONTROL_HPP
+#define GREENHOUSE_CLIMATE_CONTROL_HPP
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "./json.hpp"
+#include "./metrics.hpp"
+#include "./response_builder.hpp"
+
+namespace Climate
+{
+    // The controlled settings, in the order of every per setting array below.
+    constexpr size_t kSettings = 4;
+    constexpr const char *kSettingNames[kSettings] = {"temperature", "humidity", "luminosity", "carbonDioxide"};
+
+    // Gains of one PID controller and the range of its command.
+    struct Gains
+    {
+        double kp = 0;
+        double ki = 0;
+        double kd = 0;
+        double outputMin = -1;
+        double outputMax = 1;
+    };
+
+    struct Config
+    {
+        bool enabled = true;
+        // Ticks per second.
+        double rate = 1;
+        // MQTT topic of the commands.
+        std::string topic = "greenhouse/actuators";
+        // Zones are numbered from 0 to maxZones - 1; their state is allocated up front.
+        size_t maxZones = 4096;
+        // Most zones controlled by one tick.
+        size_t zonesPerTick = 1024;
+        // A zone whose last report is older than this (seconds) is not controlled.
+        double staleAfter = 60;
+        // Gains per setting, in the order of kSettingNames. The errors are in the units of the
+        // settings (degrees, %, %, ppm), so carbon dioxide gets much smaller gains.
+        std::array<Gains, kSettings> gains = {{{0.5, 0.05, 0.1, -1, 1},
+                                               {0.05, 0.005, 0, -1, 1},
+                                               {0.05, 0.01, 0, -1, 1},
+                                               {0.002, 0.0002, 0, -1, 1}}};
+    };
+
+    inline void from_json(const nlohmann::json &j, Gains &g)
+    {
+        g.kp = j.value("kp", g.kp);
+        g.ki = j.value("ki", g.ki);
+        g.kd = j.value("kd", g.kd);
+        g.outputMin = j.value("outputMin", g.outputMin);
+        g.outputMax = j.value("outputMax", g.outputMax);
+    }
+
+    inline void to_json(nlohmann::json &j, const Gains &g)
+    {
+        j = nlohmann::json{
+            {"kp", g.kp},
+            {"ki", g.ki},
+            {"kd", g.kd},
+            {"outputMin", g.outputMin},
+            {"outputMax", g.outputMax}};
+    }
+
+    inline void from_json(const nlohmann::json &j, Config &c)
+    {
+        c.enabled = j.value("enabled", c.enabled);
+        c.rate = j.value("rate", c.rate);
+        c.topic = j.value("topic", c.topic);
+        c.maxZones = j.value("maxZones", c.maxZones);
+        c.zonesPerTick = j.value("zonesPerTick", c.zonesPerTick);
+        c.staleAfter = j.value("staleAfter", c.staleAfter);
+        if (j.contains("gains"))
+            for (size_t i = 0; i < kSettings; i++)
+                c.gains[i] = j["gains"].value(kSettingNames[i], c.gains[i]);
+    }
+
+    inline void to_json(nlohmann::json &j, const Config &c)
+    {
+        nlohmann::json gains;
+        for (size_t i = 0; i < kSettings; i++)
+            gains[kSettingNames[i]] = c.gains[i];
+        j = nlohmann::json{
+            {"enabled", c.enabled},
+            {"rate", c.rate},
+            {"topic", c.topic},
+            {"maxZones", c.maxZones},
+            {"zonesPerTick", c.zonesPerTick},
+            {"staleAfter", c.staleAfter},
+            {"gains", gains}};
+    }
+
+    // Index of a setting in kSettingNames, or kSettings if it is not controlled.
+    inline size_t settingIndex(const std::string &name)
+    {
+        for (size_t i = 0; i < kSettings; i++)
+            if (name == kSettingNames[i])
+                return i;
+        return kSettings;
+    }
+
+    // Two doubles, operated on together: arithmetic on Lanes is one SSE2 instruction (the
+    // compiler may pair them further with AVX). Comparisons give a Mask of 0 / -1 lanes.
+    typedef double Lanes __attribute__((vector_size(16)));
+    typedef int64_t Mask __attribute__((vector_size(16)));
+    constexpr size_t kLanes = sizeof(Lanes) / sizeof(double);
+    // Lanes elements holding the four settings of a zone.
+    constexpr size_t kZoneLanes = kSettings / kLanes;
+
+    // The PID controllers of all zones, structure of arrays: the integrals of all controllers
+    // in one array and their previous errors in another, zone after zone, kZoneLanes elements
+    // per zone. update() walks a range of zones straight through both arrays, a few vector
+    // operations per zone and no pointer chasing; the gains, the same for every zone, stay in
+    // registers.
+    class PidBank
+    {
+    public:
+        // Makes room for the controllers of zones zones, with the gains of every setting.
+        void resize(size_t zones, const std::array<Gains, kSettings> &gains)
+        {
+            for (size_t s = 0; s < kSettings; s++)
+            {
+                kp[s / kLanes][s % kLanes] = gains[s].kp;
+                ki[s / kLanes][s % kLanes] = gains[s].ki;
+                kd[s / kLanes][s % kLanes] = gains[s].kd;
+                outputMin[s / kLanes][s % kLanes] = gains[s].outputMin;
+                outputMax[s / kLanes][s % kLanes] = gains[s].outputMax;
+            }
+            Lanes zero = {};
+            integral.assign(zones * kZoneLanes, zero);
+            // NaN marks a controller without a previous error, which has no derivative yet.
+            previousError.assign(zones * kZoneLanes, zero + NAN);
+        }
+
+        // Runs the controllers of zones first .. first + count - 1 once. dt[i] is the time (seconds)
+        // since zone first + i was last updated; its errors (setpoint - measured) are in
+        // error[i * kZoneLanes ...] and its commands go to the same place in command.
+        // A NaN error resets its controller and gives a NaN command. While a command is saturated
+        // its integral only moves back towards the range (anti windup).
+        void update(size_t first, size_t count, const Lanes *error, const double *dt, Lanes *command)
+        {
+            const Lanes zero = {};
+            const Lanes nan = zero + NAN;
+            for (size_t i = 0; i < count; i++)
+            {
+                Lanes h = zero + dt[i];
+                for (size_t k = 0; k < kZoneLanes; k++)
+                {
+                    size_t c = (first + i) * kZoneLanes + k;
+                    Lanes e = error[i * kZoneLanes + k];
+                    Lanes previous = previousError[c];
+                    Mask valid = e == e;
+
+                    Lanes derivative = ((previous == previous) & (h > 0)) ? (e - previous) / h : zero;
+                    Lanes integrated = integral[c] + e * h;
+                    Lanes output = kp[k] * e + ki[k] * integrated + kd[k] * derivative;
+                    Mask high = output > outputMax[k];
+                    Mask low = output < outputMin[k];
+                    Mask integrate = (~high & ~low) | (high & (e < 0)) | (low & (e > 0));
+                    output = high ? outputMax[k] : (low ? outputMin[k] : output);
+
+                    integral[c] = valid ? (integrate ? integrated : integral[c]) : zero;
+                    previousError[c] = valid ? e : nan;
+                    command[i * kZoneLanes + k] = valid ? output : nan;
+                }
+            }
+        }
+
+    private:
+        std::vector<Lanes> integral;
+        std::vector<Lanes> previousError;
+        Lanes kp[kZoneLanes], ki[kZoneLanes], kd[kZoneLanes];
+        Lanes outputMin[kZoneLanes], outputMax[kZoneLanes];
+    };
+
+    class Controller
+    {
+    public:
+        using Values = std::array<double, kSettings>;
+        // Fills in the setpoints, in the order of kSettingNames.
+        using ReadSetpoints = std::function<void(Values &)>;
+        // Publishes one message; returns false if it could not.
+        using Publish = std::function<bool(const std::string &topic, const std::string &message)>;
+
+        Controller(Metrics::Registry &metrics)
+            : tickDuration(metrics.histogram("greenhouse_control_tick_seconds", "", "Time spent in one tick of the climate control loop.")),
+              missedTicks(metrics.counter("greenhouse_control_missed_ticks_total", "", "Ticks of the climate control loop skipped because the previous one ran late.")),
+              publishFailures(metrics.counter("greenhouse_control_publish_failures_total", "", "Actuator commands that could not be published.")),
+              activeZones(metrics.gauge("greenhouse_control_zones", "", "Zones that have reported telemetry."))
+        {
+        }
+
+        ~Controller()
+        {
+            stop();
+        }
+
+        // Allocates the zones; telemetry is accepted from then on. Call it before start.
+        void configure(const Config &controlConfig)
+        {
+            stop();
+            config = controlConfig;
+            {
+                std::lock_guard<std::mutex> guard(telemetryLock);
+                if (zones.size() < config.maxZones)
+                    zones.resize(config.maxZones);
+                active.reserve(config.maxZones);
+            }
+            // A zone's controllers are at its position in active, so the zones of a tick are
+            // consecutive in the bank.
+            pids.resize(zones.size(), config.gains);
+            controlledNs.assign(zones.size(), 0);
+            size_t perTick = std::min(config.zonesPerTick, config.maxZones);
+            batch.resize(perTick);
+            errors.resize(perTick * kZoneLanes);
+            dts.resize(perTick);
+            commands.resize(perTick * kZoneLanes);
+        }
+
+        // Starts the control thread, unless control is disabled.
+        void start(ReadSetpoints readSetpoints, Publish publish)
+        {
+            stop();
+            this->readSetpoints = std::move(readSetpoints);
+            this->publish = std::move(publish);
+            if (!config.enabled || config.rate <= 0)
+                return;
+            running = true;
+            thread = std::thread(&Controller::run, this);
+        }
+
+        void stop()
+        {
+            {
+                std::lock_guard<std::mutex> guard(wakeLock);
+                running = false;
+            }
+            wake.notify_all();
+            if (thread.joinable())
+                thread.join();
+        }
+
+        // Stores the latest measurements of a zone; NaN keeps the previous value of a setting.
+        // latest, when given, receives the zone's measurements after the update.
+        // Returns false if the zone is out of range.
+        bool report(size_t zone, const Values &measured, Values *latest = nullptr)
+        {
+            std::lock_guard<std::mutex> guard(telemetryLock);
+            if (zone >= zones.size())
+                return false;
+            Zone &z = zones[zone];
+            if (z.reportedNs == 0)
+            {
+                active.push_back(static_cast<uint32_t>(zone));
+                activeZones.set(static_cast<int64_t>(active.size()));
+            }
+            for (size_t i = 0; i < kSettings; i++)
+                if (!std::isnan(measured[i]))
+                    z.measured[i] = measured[i];
+            z.reportedNs = Metrics::nowNs();
+            if (latest != nullptr)
+                *latest = z.measured;
+            return true;
+        }
+
+        // {"commands":{..},"measured":{..},"zone":n}, null for unknown values. Returns false if
+        // the zone never reported.
+        bool writeZone(size_t zone, Reply::Builder &out)
+        {
+            std::lock_guard<std::mutex> guard(telemetryLock);
+            if (zone >= zones.size() || zones[zone].reportedNs == 0)
+                return false;
+            out.append('{').appendKey("commands", true);
+            writeValues(zones[zone].command, out);
+            out.appendKey("measured");
+            writeValues(zones[zone].measured, out);
+            out.appendKey("zone").append(static_cast<long long>(zone)).append('}');
+            return true;
+        }
+
+        // One round of control, at time now. Called by the control thread; public for benchmarks.
+        void tick(uint64_t now)
+        {
+            Values setpoints;
+            setpoints.fill(NAN);
+            if (readSetpoints)
+                readSetpoints(setpoints);
+
+            // Copy the measurements of this tick's zones, so the lock is held for a copy only.
+            size_t count = 0, first = 0, n = 0;
+            {
+                std::lock_guard<std::mutex> guard(telemetryLock);
+                n = active.size();
+                count = std::min(n, batch.size());
+                first = cursor;
+                for (size_t i = 0; i < count; i++)
+                {
+                    uint32_t id = active[(first + i) % n];
+                    batch[i].zone = id;
+                    batch[i].measured = zones[id].measured;
+                    batch[i].reportedNs = zones[id].reportedNs;
+                }
+                if (n > 0)
+                    cursor = (first + count) % n;
+            }
+            if (count == 0)
+                return;
+
+            // Errors of stale zones are NaN, which resets their controllers.
+            uint64_t staleNs = static_cast<uint64_t>(config.staleAfter * 1e9);
+            for (size_t i = 0; i < count; i++)
+            {
+                Item &item = batch[i];
+                uint64_t &last = controlledNs[(first + i) % n];
+                item.stale = now > item.reportedNs && now - item.reportedNs > staleNs;
+                dts[i] = last != 0 ? (now - last) / 1e9 : 1 / config.rate;
+                last = item.stale ? 0 : now;
+                for (size_t s = 0; s < kSettings; s++)
+                    errors[i * kZoneLanes + s / kLanes][s % kLanes] = item.stale ? NAN : setpoints[s] - item.measured[s];
+            }
+
+            // Once around active at most: the zones from first to its end, then from its start.
+            size_t head = std::min(count, n - first);
+            pids.update(first, head, errors.data(), dts.data(), commands.data());
+            pids.update(0, count - head, errors.data() + head * kZoneLanes, dts.data() + head, commands.data() + head * kZoneLanes);
+
+            message.clear();
+            Reply::Builder out(message);
+            out.append("{\"commands\":[");
+            bool any = false;
+            for (size_t i = 0; i < count; i++)
+            {
+                Item &item = batch[i];
+                for (size_t s = 0; s < kSettings; s++)
+                    item.command[s] = commands[i * kZoneLanes + s / kLanes][s % kLanes];
+                if (item.stale)
+                    continue;
+
+                if (any)
+                    out.append(',');
+                any = true;
+                out.append('{');
+                for (size_t s = 0; s < kSettings; s++)
+                {
+                    out.appendKey(kSettingNames[s], s == 0);
+                    writeValue(item.command[s], out);
+                }
+                out.appendKey("zone").append(static_cast<long long>(item.zone)).append('}');
+            }
+            out.append("]}");
+
+            {
+                std::lock_guard<std::mutex> guard(telemetryLock);
+                for (size_t i = 0; i < count; i++)
+                    zones[batch[i].zone].command = batch[i].command;
+            }
+            if (any && publish && !publish(config.topic, message))
+                publishFailures.increment();
+        }
+
+    private:
+        struct Zone
+        {
+            Values measured = {NAN, NAN, NAN, NAN};
+            Values command = {NAN, NAN, NAN, NAN};
+            uint64_t reportedNs = 0;
+        };
+
+        // A zone's copy for the current tick.
+        struct Item
+        {
+            uint32_t zone;
+            Values measured;
+            Values command;
+            uint64_t reportedNs;
+            bool stale;
+        };
+
+        static void writeValue(double value, Reply::Builder &out)
+        {
+            if (std::isnan(value))
+                out.append("null");
+            else
+                out.appendJSON(value);
+        }
+
+        static void writeValues(const Values &values, Reply::Builder &out)
+        {
+            out.append('{');
+            for (size_t s = 0; s < kSettings; s++)
+            {
+                out.appendKey(kSettingNames[s], s == 0);
+                writeValue(values[s], out);
+            }
+            out.append('}');
+        }
+
+        // Fixed rate: every tick is due one period after the previous one was due, not after it
+        // ended. When a tick ends past the next deadlines those ticks are skipped and counted.
+        void run()
+        {
+            uint64_t period = static_cast<uint64_t>(1e9 / config.rate);
+            uint64_t due = Metrics::nowNs() + period;
+            std::unique_lock<std::mutex> guard(wakeLock);
+            while (running)
+            {
+                std::chrono::steady_clock::time_point deadline{std::chrono::nanoseconds(due)};
+                if (wake.wait_until(guard, deadline, [this]()
+                                    { return !running; }))
+                    break;
+                guard.unlock();
+
+                uint64_t started = Metrics::nowNs();
+                tick(started);
+                uint64_t ended = Metrics::nowNs();
+                tickDuration.record(ended - started);
+
+                due += period;
+                if (ended > due)
+                {
+                    uint64_t missed = (ended - due) / period + 1;
+                    missedTicks.increment(missed);
+                    due += missed * period;
+                }
+                guard.lock();
+            }
+        }
+
+        Config config;
+        ReadSetpoints readSetpoints;
+        Publish publish;
+
+        Metrics::Histogram &tickDuration;
+        Metrics::Counter &missedTicks;
+        Metrics::Counter &publishFailures;
+        Metrics::Gauge &activeZones;
+
+        // Latest telemetry and commands, shared with the request threads.
+        std::mutex telemetryLock;
+        std::vector<Zone> zones;
+        std::vector<uint32_t> active;
+
+        // Owned by the control thread.
+        PidBank pids;
+        std::vector<uint64_t> controlledNs;
+        std::vector<Item> batch;
+        std::vector<Lanes> errors;
+        std::vector<double> dts;
+        std::vector<Lanes> commands;
+        size_t cursor = 0;
+        std::string message;
+
+        std::mutex wakeLock;
+        std::condition_variable wake;
+        bool running = false;
+        std::thread thread;
+    };
+}
+
+#endif
@@ -0,0 +1,241 @@
+/*
+   Compressed response bodies.
+   negotiate() picks an encoding from the client's Accept-Encoding header, BodyCache keeps the
+   plain body of a large response together with the version of the data it was built from and
+   compresses it lazily, at most once per encoding and version. Responses that did not change
+   are then neither rebuilt nor recompressed, whatever the number of requests.
+   zstd is only offered when the build finds <zstd.h>, gzip and deflate come from zlib.
+*/
+
+#ifndef GREENHOUSE_COMPRESSION_HPP
+#define GREENHOUSE_COMPRESSION_HPP
+
+#include <array>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <zlib.h>
+
+#if __has_include(<zstd.h>)
+#include <zstd.h>
+#define GREENHOUSE_HAVE_ZSTD 1
+#else
+#define GREENHOUSE_HAVE_ZSTD 0
+#endif
+
+#include "./json.hpp"
+
+namespace Compression
+{
+    enum class Encoding
+    {
+        Identity,
+        Gzip,
+        Deflate,
+        Zstd
+    };
+
+    constexpr size_t kEncodings = 4;
+
+    inline const char *name(Encoding encoding)
+    {
+        switch (encoding)
+        {
+        case Encoding::Gzip:
+            return "gzip";
+        case Encoding::Deflate:
+            return "deflate";
+        case Encoding::Zstd:
+            return "zstd";
+        default:
+            return "identity";
+        }
+    }
+
+    struct Config
+    {
+        bool enabled = true;
+        // Bodies smaller than this (in bytes) are always sent as they are.
+        size_t minSize = 1024;
+        // Compression level, 1 (fast) to 9 (small); zstd uses it as its own level.
+        int level = 6;
+    };
+
+    inline void from_json(const nlohmann::json &j, Config &c)
+    {
+        c.enabled = j.value("enabled", c.enabled);
+        c.minSize = j.value("minSize", c.minSize);
+        c.level = j.value("level", c.level);
+    }
+
+    inline void to_json(nlohmann::json &j, const Config &c)
+    {
+        j = nlohmann::json{
+            {"enabled", c.enabled},
+            {"minSize", c.minSize},
+            {"level", c.level}};
+    }
+
+    // The encoding to answer with, given the value of Accept-Encoding. The client's q-values
+    // decide; on equal q the smaller output wins (zstd, gzip, then deflate).
+    inline Encoding negotiate(const std::string &acceptEncoding)
+    {
+        static const Encoding preference[] = {Encoding::Zstd, Encoding::Gzip, Encoding::Deflate};
+        double quality[kEncodings] = {0, 0, 0, 0};
+        double wildcard = -1;
+
+        size_t start = 0;
+        while (start < acceptEncoding.size())
+        {
+            size_t end = acceptEncoding.find(',', start);
+            if (end == std::string::npos)
+                end = acceptEncoding.size();
+            std::string item = acceptEncoding.substr(start, end - start);
+            start = end + 1;
+
+            double q = 1;
+            size_t semicolon = item.find(';');
+            if (semicolon != std::string::npos)
+            {
+                size_t qAt = item.find("q=", semicolon);
+                if (qAt != std::string::npos)
+                    q = std::atof(item.c_str() + qAt + 2);
+                item.erase(semicolon);
+            }
+            size_t first = item.find_first_not_of(" \t");
+            size_t last = item.find_last_not_of(" \t");
+            if (first == std::string::npos)
+                continue;
+            item = item.substr(first, last - first + 1);
+            for (char &c : item)
+                c = static_cast<char>(tolower(c));
+
+            if (item == "gzip" || item == "x-gzip")
+                quality[static_cast<int>(Encoding::Gzip)] = q;
+            else if (item == "deflate")
+                quality[static_cast<int>(Encoding::Deflate)] = q;
+            else if (item == "zstd")
+                quality[static_cast<int>(Encoding::Zstd)] = q;
+            else if (item == "*")
+                wildcard = q;
+        }
+
+        Encoding best = Encoding::Identity;
+        double bestQuality = 0;
+        for (Encoding encoding : preference)
+        {
+            if (encoding == Encoding::Zstd && !GREENHOUSE_HAVE_ZSTD)
+                continue;
+            double q = quality[static_cast<int>(encoding)];
+            if (q == 0 && wildcard > 0 && acceptEncoding.find(name(encoding)) == std::string::npos)
+                q = wildcard;
+            if (q > bestQuality)
+            {
+                best = encoding;
+                bestQuality = q;
+            }
+        }
+        return best;
+    }
+
+    // Compresses in into out. Returns false if the encoding is not available or fails.
+    inline bool compress(Encoding encoding, const std::string &in, std::string &out, int level)
+    {
+        if (encoding == Encoding::Gzip || encoding == Encoding::Deflate)
+        {
+            // windowBits 15 + 16 writes the gzip wrapper, 15 alone the zlib one that HTTP calls deflate.
+            z_stream stream{};
+            int windowBits = encoding == Encoding::Gzip ? 15 + 16 : 15;
+            if (deflateInit2(&stream, level, Z_DEFLATED, windowBits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+                return false;
+            out.resize(deflateBound(&stream, static_cast<uLong>(in.size())));
+            stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(in.data()));
+            stream.avail_in = static_cast<uInt>(in.size());
+            stream.next_out = reinterpret_cast<Bytef *>(&out[0]);
+            stream.avail_out = static_cast<uInt>(out.size());
+            int result = deflate(&stream, Z_FINISH);
+            out.resize(stream.total_out);
+            deflateEnd(&stream);
+            return result == Z_STREAM_END;
+        }
+#if GREENHOUSE_HAVE_ZSTD
+        if (encoding == Encoding::Zstd)
+        {
+            out.resize(ZSTD_compressBound(in.size()));
+            size_t size = ZSTD_compress(&out[0], out.size(), in.data(), in.size(), level);
+            if (ZSTD_isError(size))
+                return false;
+            out.resize(size);
+            return true;
+        }
+#endif
+        return false;
+    }
+
+    // A response body built from versioned data, with its compressed forms.
+    class Body
+    {
+    public:
+        Body(uint64_t version, std::string plain)
+            : version(version), plain(std::move(plain))
+        {
+        }
+
+        // The body in the given encoding, compressing it on first use. Falls back to the plain
+        // body (and sets encoding to Identity) when compression fails or does not make it smaller.
+        const std::string &get(Encoding &encoding, int level) const
+        {
+            if (encoding == Encoding::Identity)
+                return plain;
+            size_t index = static_cast<size_t>(encoding);
+            std::call_once(once[index], [&]()
+                           {
+                               if (!compress(encoding, plain, encoded[index], level) || encoded[index].size() >= plain.size())
+                                   encoded[index].clear(); });
+            if (encoded[index].empty())
+            {
+                encoding = Encoding::Identity;
+                return plain;
+            }
+            return encoded[index];
+        }
+
+        const uint64_t version;
+        const std::string plain;
+
+    private:
+        mutable std::array<std::once_flag, kEncodings> once;
+        mutable std::array<std::string, kEncodings> encoded;
+    };
+
+    // The latest Body of one response. Readers keep their Body alive through the shared_ptr,
+    // so a new version can replace it while older ones are still being sent.
+    class BodyCache
+    {
+    public:
+        // Returns the body for version, calling build(std::string &) to make the plain body
+        // when the cached one is from another version. Call it with the data's lock held.
+        template <typename Build>
+        std::shared_ptr<const Body> get(uint64_t version, Build build)
+        {
+            std::lock_guard<std::mutex> guard(cacheLock);
+            if (!current || current->version != version)
+            {
+                std::string plain;
+                build(plain);
+                current = std::make_shared<const Body>(version, std::move(plain));
+            }
+            return current;
+        }
+
+    private:
+        std::mutex cacheLock;
+        std::shared_ptr<const Body> current;
+    };
+}
+
+#endif
@@ -0,0 +1,164 @@
+/*
+   C++20 coroutines for the route handlers that wait on something other than a lock, such as the
+   audit log writing a change (?durable=1). A coroutine handler keeps its state in the coroutine
+   frame while it waits and gives the thread back, so a waiting request costs no thread: the
+   reactor goes on with its other connections, and whatever the handler waits for resumes it.
+
+       Coro::Task handler(Rest::Request request, Http::ResponseWriter &response)
+       {
+           bool written = co_await Coro::Callback<bool>([&](std::function<void(bool)> resume)
+                                                        { log.whenFlushed(position, std::move(resume)); });
+           response.send(...);
+       }
+
+   Locks must not be held across a co_await: the coroutine may resume on another thread.
+*/
+
+#ifndef GREENHOUSE_COROUTINE_HPP
+#define GREENHOUSE_COROUTINE_HPP
+
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <utility>
+
+namespace Coro
+{
+    // A coroutine that starts when spawned and reports how it ended to the spawner.
+    class Task
+    {
+    public:
+        using Done = std::function<void(std::exception_ptr)>;
+
+        struct promise_type
+        {
+            Done done;
+            std::exception_ptr error;
+
+            Task get_return_object()
+            {
+                return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+            }
+
+            std::suspend_always initial_suspend() noexcept
+            {
+                return {};
+            }
+
+            // Frees the frame, then reports: done may destroy what the coroutine referred to.
+            struct Final
+            {
+                bool await_ready() noexcept
+                {
+                    return false;
+                }
+
+                void await_suspend(std::coroutine_handle<promise_type> coroutine) noexcept
+                {
+                    Done done = std::move(coroutine.promise().done);
+                    std::exception_ptr error = coroutine.promise().error;
+                    coroutine.destroy();
+                    if (done)
+                        done(error);
+                }
+
+                void await_resume() noexcept
+                {
+                }
+            };
+
+            Final final_suspend() noexcept
+            {
+                return {};
+            }
+
+            void return_void()
+            {
+            }
+
+            void unhandled_exception()
+            {
+                error = std::current_exception();
+            }
+        };
+
+        Task(Task &&other) noexcept
+            : coroutine(std::exchange(other.coroutine, nullptr))
+        {
+        }
+
+        Task(const Task &) = delete;
+        Task &operator=(const Task &) = delete;
+
+        ~Task()
+        {
+            if (coroutine)
+                coroutine.destroy();
+        }
+
+    private:
+        explicit Task(std::coroutine_handle<promise_type> coroutine)
+            : coroutine(coroutine)
+        {
+        }
+
+        friend void spawn(Task task, Task::Done done);
+
+        std::coroutine_handle<promise_type> coroutine;
+    };
+
+    // Runs the task on this thread until it first waits. done gets nullptr or the exception the
+    // task ended with, on the thread that ran its last part.
+    inline void spawn(Task task, Task::Done done)
+    {
+        std::coroutine_handle<Task::promise_type> coroutine = std::exchange(task.coroutine, nullptr);
+        coroutine.promise().done = std::move(done);
+        coroutine.resume();
+    }
+
+    // Awaits a value delivered through a callback: start is given a resume function to call
+    // exactly once, from any thread, possibly before start returns.
+    template <typename T>
+    class Callback
+    {
+    public:
+        using Start = std::function<void(std::function<void(T)>)>;
+
+        explicit Callback(Start start)
+            : start(std::move(start))
+        {
+        }
+
+        bool await_ready() const
+        {
+            return false;
+        }
+
+        // Whichever of this and the callback comes second resumes the coroutine; when the
+        // callback came first the coroutine does not suspend at all.
+        bool await_suspend(std::coroutine_handle<> coroutine)
+        {
+            waiting = coroutine;
+            start([this](T delivered)
+                  {
+                      value = std::move(delivered);
+                      if (arrived.exchange(true))
+                          waiting.resume(); });
+            return !arrived.exchange(true);
+        }
+
+        T await_resume()
+        {
+            return std::move(value);
+        }
+
+    private:
+        Start start;
+        std::coroutine_handle<> waiting;
+        std::atomic<bool> arrived{false};
+        T value{};
+    };
+}
+
+#endif
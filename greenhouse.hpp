@@ -0,0 +1,692 @@
+/*
+   The Greenhouse model: settings, preconfigurations and soil history, without any HTTP.
+   GreenhouseEndpoint serves it over Pistache, greenhouse_microbench measures it directly.
+*/
+
+#ifndef GREENHOUSE_MODEL_HPP
+#define GREENHOUSE_MODEL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <climits>
+#include <cstdint>
+#include <ctime>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <time.h>
+#include <vector>
+
+#include "./json.hpp"
+#include "./response_builder.hpp"
+#include "./soil_history.hpp"
+#include "./rotation_model.hpp"
+#include "./shared_settings.hpp"
+
+using json = nlohmann::json;
+
+using namespace std;
+
+struct Preconfiguration
+{
+    double luminosity, humidity, temperature, carbonDioxide;
+    std::string plantType;
+    bool operator==(const Preconfiguration &other)
+    {
+        return plantType == other.plantType;
+    }
+};
+
+inline void to_json(json &j, const Preconfiguration &p)
+{
+    j = json{{"luminosity", p.luminosity}, {"humidity", p.humidity}, {"temperature", p.temperature}, {"carbonDioxide", p.carbonDioxide}, {"plantType", p.plantType}};
+}
+
+inline void from_json(const json &j, Preconfiguration &p)
+{
+    j.at("luminosity").get_to(p.luminosity);
+    j.at("humidity").get_to(p.humidity);
+    j.at("temperature").get_to(p.temperature);
+    j.at("carbonDioxide").get_to(p.carbonDioxide);
+    j.at("plantType").get_to(p.plantType);
+}
+
+// All the settings at one time, e.g. for the checkpoints of the audit log and for replicas.
+struct SettingsSnapshot
+{
+    double area = 0, carbonDioxide = 0, humidity = 0, luminosity = 0, temperature = 0, waterAmount = 0;
+    std::string irigationTime, plantType;
+
+    // The JSON of GET /settings/getAll.
+    void write(Reply::Builder &out) const
+    {
+        // Members in the (sorted) order json::dump() prints them.
+        out.append('{');
+        out.appendKey("area", true).appendJSON(area);
+        out.appendKey("carbonDioxide").appendJSON(carbonDioxide);
+        out.appendKey("humidity").appendJSON(humidity);
+        out.appendKey("irigationTime").appendJSON(irigationTime);
+        out.appendKey("luminosity").appendJSON(luminosity);
+        out.appendKey("plantType").appendJSON(plantType);
+        out.appendKey("temperature").appendJSON(temperature);
+        out.appendKey("waterAmount").appendJSON(waterAmount);
+        out.append('}');
+    }
+};
+
+inline void to_json(json &j, const std::string s)
+{
+    j = json{{"plantType", s}};
+}
+
+// Defining the class of the Greenhouse. It should model the entire configuration of the Greenhouse
+class Greenhouse
+{
+public:
+    explicit Greenhouse()
+        : Greenhouse("soil_history.txt", "preconfigurations.txt")
+    {
+    }
+
+    // The data files can be relocated, e.g. the microbenchmarks load generated fixtures.
+    Greenhouse(const std::string &soilHistoryLocation, const std::string &preconfigurationsLocation)
+        : soilHistoryLocation(soilHistoryLocation), preconfigurationsLocation(preconfigurationsLocation)
+    {
+        SharedSettings::Block initial = {};
+        SharedSettings::copyString(initial.irigationTime, "2021-05-25-7:00:00");
+        writeSettings(initial);
+        previousPlantSugestion = "";
+
+        readSoilHistory();
+        readPreconfigurations();
+        setPreconfiguration(0);
+    }
+
+    // The first line holds the number of years and, optionally, the first year. Without it the
+    // history is taken to end with the current year.
+    // Every following line is one season: the plant, then optionally the zone, the yield in kg/m2
+    // and the season's start and end dates (YYYY-MM-DD); "-" stands for an unknown yield or date.
+    void readSoilHistory()
+    {
+        ifstream fin(soilHistoryLocation);
+        std::string line;
+        getline(fin, line);
+        std::istringstream header(line);
+        int nrYears = 0, firstYear;
+        header >> nrYears;
+        if (!(header >> firstYear))
+            firstYear = currentYear() - nrYears + 1;
+        for (int i = 0; i < nrYears && getline(fin, line);)
+        {
+            std::istringstream fields(line);
+            Season season;
+            std::string zone, yield, start, end;
+            if (!(fields >> season.plantType))
+                continue;
+            fields >> zone >> yield >> start >> end;
+            season.year = firstYear + i;
+            if (zone != "" && zone != "-")
+                season.zone = static_cast<uint16_t>(std::stoi(zone));
+            if (yield != "" && yield != "-")
+                season.yield = std::stod(yield);
+            if (start != "" && start != "-")
+                SoilHistory::parseDate(start, season.seasonStart);
+            if (end != "" && end != "-")
+                SoilHistory::parseDate(end, season.seasonEnd);
+            recordSeason(season);
+            i++;
+        }
+        soilHistoryStamp++;
+    }
+
+    static int currentYear()
+    {
+        time_t now = time(0);
+        struct tm local;
+        localtime_r(&now, &local);
+        return local.tm_year + 1900;
+    }
+
+    void readPreconfigurations()
+    {
+        ifstream fin(preconfigurationsLocation);
+        int nrPreconfigurations;
+        fin >> nrPreconfigurations;
+        for (int i = 0; i < nrPreconfigurations; i++)
+        {
+            Preconfiguration p;
+            fin >> p.luminosity >> p.humidity >> p.temperature >> p.carbonDioxide >> p.plantType;
+            preconfigurations.push_back(p);
+        }
+        preconfigurationsStamp++;
+    }
+
+    // Versions of the soil history and of the preconfigurations, they change on every change of
+    // the data, so responses built from an older version can be told apart.
+    uint64_t soilHistoryVersion() const
+    {
+        return soilHistoryStamp;
+    }
+
+    uint64_t preconfigurationsVersion() const
+    {
+        return preconfigurationsStamp;
+    }
+
+    // Times the soil history was cleared. Seasons are otherwise only appended, so positions into
+    // the history stay valid as long as this does not change.
+    uint64_t soilHistoryResetCount() const
+    {
+        return soilHistoryResets;
+    }
+
+    int setPreconfiguration(int nrPreconfig)
+    {
+        if (nrPreconfig >= preconfigurations.size())
+        {
+            return -1;
+        }
+
+        applyPreconfiguration(preconfigurations[nrPreconfig]);
+        return 1;
+    }
+
+    // Sets the climate and plant type of a preconfiguration, which need not be one of ours.
+    // A plant type longer than the settings block holds is cut.
+    void applyPreconfiguration(const Preconfiguration &p)
+    {
+        SharedSettings::Block next = settingsBlock;
+        next.luminosity = p.luminosity;
+        next.humidity = p.humidity;
+        next.temperature = p.temperature;
+        next.carbonDioxide = p.carbonDioxide;
+        SharedSettings::copyString(next.plantType, p.plantType);
+        writeSettings(next);
+    }
+
+    // A consistent copy of the settings. Needs no lock: a copy that overlaps a change is retried.
+    SharedSettings::Block readSettings() const
+    {
+        SharedSettings::Block block;
+        SharedSettings::read(settingsSequence, settingsBlock, block);
+        return block;
+    }
+
+    SettingsSnapshot getSettings() const
+    {
+        SharedSettings::Block block = readSettings();
+        SettingsSnapshot settings;
+        settings.area = block.area;
+        settings.carbonDioxide = block.carbonDioxide;
+        settings.humidity = block.humidity;
+        settings.luminosity = block.luminosity;
+        settings.temperature = block.temperature;
+        settings.waterAmount = block.waterAmount;
+        settings.irigationTime = block.irigationTime;
+        settings.plantType = block.plantType;
+        return settings;
+    }
+
+    // Sets all the settings at once, without checking them: they come from a greenhouse that did.
+    void restoreSettings(const SettingsSnapshot &settings)
+    {
+        SharedSettings::Block next = settingsBlock;
+        next.area = settings.area;
+        next.carbonDioxide = settings.carbonDioxide;
+        next.humidity = settings.humidity;
+        next.luminosity = settings.luminosity;
+        next.temperature = settings.temperature;
+        next.waterAmount = settings.waterAmount;
+        SharedSettings::copyString(next.irigationTime, settings.irigationTime);
+        SharedSettings::copyString(next.plantType, settings.plantType);
+        writeSettings(next);
+    }
+
+    // Forgets the preconfigurations and the soil history, before a replica loads the leader's.
+    void clear()
+    {
+        preconfigurations.clear();
+        soilHistory = SoilHistory();
+        rotation = RotationModel();
+        lastPlantInZone.clear();
+        previousPlantSugestion = "";
+        preconfigurationsStamp++;
+        soilHistoryStamp++;
+        soilHistoryResets++;
+    }
+
+    size_t preconfigurationCount() const
+    {
+        return preconfigurations.size();
+    }
+
+    // The preconfiguration of number nrPreconfig, which must exist.
+    const Preconfiguration &getPreconfiguration(int nrPreconfig) const
+    {
+        return preconfigurations[nrPreconfig];
+    }
+
+    string preconfigurationsToJSON()
+    {
+        json j(preconfigurations);
+
+        return j.dump();
+    }
+
+    // The plant names of the soil history, as a JSON array.
+    string soilHistoryToJSON()
+    {
+        string result;
+        Reply::Builder out(result);
+        soilHistory.writePlantNames(out);
+        return result;
+    }
+
+    // Ranked suggestions for the next season, from the rotation model: the plants that most often
+    // followed the last plant grown (in zone, or in the whole greenhouse when zone is -1), at most k.
+    // Writes {"basedOn":..,"suggestedPlant":..,"suggestions":[{"plantType":..,"probability":..,"seasons":..}]}.
+    // While the model knows no successor of that plant, suggestedPlant falls back to leastGrownPlant().
+    void writePlantTypeSuggestions(size_t k, int zone, Reply::Builder &out)
+    {
+        SoilHistory::PlantId last = SoilHistory::kNoPlant;
+        if (zone < 0 && !soilHistory.empty())
+            last = soilHistory.plantColumn().back();
+        else if (zone >= 0)
+        {
+            auto it = lastPlantInZone.find(static_cast<uint16_t>(zone));
+            if (it != lastPlantInZone.end())
+                last = it->second;
+        }
+
+        uint32_t total = 0;
+        const std::vector<RotationModel::Suggestion> &successors = rotation.successors(last, total);
+        k = std::min(k, successors.size());
+
+        out.append('{').appendKey("basedOn", true);
+        if (last == SoilHistory::kNoPlant)
+            out.append("null");
+        else
+            out.appendJSON(soilHistory.plantName(last));
+        out.appendKey("suggestedPlant").appendJSON(k > 0 ? soilHistory.plantName(successors[0].plant) : leastGrownPlant());
+        out.appendKey("suggestions").append('[');
+        for (size_t i = 0; i < k; i++)
+        {
+            if (i != 0)
+                out.append(',');
+            out.append('{').appendKey("plantType", true).appendJSON(soilHistory.plantName(successors[i].plant));
+            out.appendKey("probability").appendJSON(static_cast<double>(successors[i].count) / total);
+            out.appendKey("seasons").append(static_cast<long long>(successors[i].count)).append('}');
+        }
+        out.append("]}");
+    }
+
+    string getPlantTypeSuggestion()
+    {
+        string result;
+        Reply::Builder out(result);
+        writePlantTypeSuggestions(3, -1, out);
+        return result;
+    }
+
+    // Suggests the plant grown the fewest times (counting the current one), other than the previous
+    // suggestion; on a tie the one that appears first in the history. Only reads the plant column.
+    string leastGrownPlant()
+    {
+        const std::vector<SoilHistory::PlantId> &plants = soilHistory.plantColumn();
+        SoilHistory::PlantId previous = soilHistory.plantId(previousPlantSugestion);
+        std::vector<int> counts(soilHistory.plantCount(), 0);
+
+        for (SoilHistory::PlantId plant : plants)
+            if (plant != previous)
+                counts[plant]++;
+        SharedSettings::Block settings = readSettings();
+        SoilHistory::PlantId current = settings.plantType[0] != '\0' ? soilHistory.plantId(settings.plantType) : SoilHistory::kNoPlant;
+        if (current != SoilHistory::kNoPlant)
+            counts[current]++;
+
+        int minim = INT_MAX - 1;
+        std::string pos = "";
+        for (SoilHistory::PlantId plant : plants)
+            if (counts[plant] < minim && plant != previous)
+            {
+                minim = counts[plant];
+                pos = soilHistory.plantName(plant);
+            }
+        previousPlantSugestion = pos;
+        return pos;
+    }
+
+    // Setting the value for one of the settings. Hardcoded for the defrosting option
+    // Strings longer than their field of the settings block are refused.
+    int set(const std::string &name, const std::string &value)
+    {
+        SharedSettings::Block next = settingsBlock;
+        for (const NumberSetting &setting : kNumberSettings)
+        {
+            if (setting.name != name)
+                continue;
+            try
+            {
+                double doubleValue = std::stod(value);
+                if (doubleValue >= setting.min && doubleValue <= setting.max)
+                {
+                    next.*setting.field = doubleValue;
+                    writeSettings(next);
+                    return 1;
+                }
+            }
+            catch (std::exception)
+            {
+                return 0;
+            }
+        }
+
+        if (name == "plantType" && value.size() < sizeof(next.plantType))
+        {
+            SharedSettings::copyString(next.plantType, value);
+            writeSettings(next);
+            return 1;
+        }
+
+        if (name == "irigationTime" && value.size() < sizeof(next.irigationTime))
+        {
+            struct tm irigationTimeTransformed = {0};
+            auto result = strptime(value.c_str(), "%F-%T", &irigationTimeTransformed);
+            if (result != NULL)
+            {
+                SharedSettings::copyString(next.irigationTime, value);
+                writeSettings(next);
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    // Appends the value of a setting to out, formatted like std::to_string for numbers.
+    // Returns false when there is nothing to show: unknown setting or empty value.
+    bool writeSetting(const std::string &name, Reply::Builder &out)
+    {
+        SharedSettings::Block settings = readSettings();
+        for (const NumberSetting &setting : kNumberSettings)
+            if (setting.name == name)
+            {
+                out.appendFixed(settings.*setting.field);
+                return true;
+            }
+        const char *text = name == "irigationTime" ? settings.irigationTime : name == "plantType" ? settings.plantType : nullptr;
+        if (text == nullptr || text[0] == '\0')
+            return false;
+        out.append(text);
+        return true;
+    }
+
+    // Getter
+    // Value of a numeric setting, NaN if there is no such setting.
+    double getNumber(const std::string &name) const
+    {
+        SharedSettings::Block settings = readSettings();
+        for (const NumberSetting &setting : kNumberSettings)
+            if (setting.name == name)
+                return settings.*setting.field;
+        return NAN;
+    }
+
+    string get(string name)
+    {
+        string value;
+        Reply::Builder out(value);
+        writeSetting(name, out);
+        return value;
+    }
+
+    // Same JSON as dumping a json object with these members, written without building one.
+    void writeCurrentConfiguration(Reply::Builder &out)
+    {
+        getSettings().write(out);
+    }
+
+    string getCurrentConfiguration()
+    {
+        string result;
+        Reply::Builder out(result);
+        writeCurrentConfiguration(out);
+        return result;
+    }
+
+    void writeWaterAmount(Reply::Builder &out)
+    {
+        SharedSettings::Block settings = readSettings();
+        double result;
+        if (settings.temperature < 25)
+            result = settings.area * 0.7;
+        else if (settings.temperature >= 25 && settings.temperature <= 28)
+            result = settings.area * 0.8;
+        else
+            result = settings.area * 0.9;
+
+        out.append('{').appendKey("waterAmount", true).appendJSON(result).append('}');
+    }
+
+    string calculateWaterAmount()
+    {
+        string result;
+        Reply::Builder out(result);
+        writeWaterAmount(out);
+        return result;
+    }
+
+    void writeIrigationTime(Reply::Builder &out)
+    {
+        struct tm newtime;
+        time_t now = time(0);
+
+        newtime = *localtime(&now);
+
+        const char *day = "";
+        int count = 0;
+
+        if (newtime.tm_mday % 2 == 0)
+        {
+            day = "Tomorrow, ";
+            count = 1;
+        }
+        else
+        {
+            const char *irigationTimeVar = "7:0:0";
+
+            struct tm irigationTimeTransformed = {0};
+            strptime(irigationTimeVar, "%H:%M:%S", &irigationTimeTransformed);
+            time_t irigation = mktime(&irigationTimeTransformed);
+
+            if (now < irigation)
+            {
+                day = "Today, ";
+                count = 0;
+            }
+
+            else
+            {
+                day = "After 2 days, ";
+                count = 2;
+            }
+        }
+
+        out.append('{').appendKey("irigationTime", true).append('"');
+        out.append(day, strlen(day)).append(newtime.tm_year + 1900).append('-').append(newtime.tm_mon + 1).append('-');
+        out.append(newtime.tm_mday + count).append("-07:00:00\"}");
+    }
+
+    string calculateIrigationTime()
+    {
+        string result;
+        Reply::Builder out(result);
+        writeIrigationTime(out);
+        return result;
+    }
+
+    // Longest plant type a preconfiguration may have: it has to fit the settings block when selected.
+    static const size_t kMaxPlantTypeLength = sizeof(SharedSettings::Block::plantType) - 1;
+
+    // Returns -1 if the preconfiguration already exists, -2 if its plant type is too long.
+    int addPreconfiguration(Preconfiguration p)
+    {
+        if (p.plantType.size() > kMaxPlantTypeLength)
+        {
+            return -2;
+        }
+        if (std::find(preconfigurations.begin(), preconfigurations.end(), p) != preconfigurations.end())
+        {
+            /* v contains x */
+            return -1;
+        }
+        else
+        {
+            /* v does not contain x */
+            preconfigurations.push_back(p);
+            preconfigurationsStamp++;
+            return 1;
+        }
+    }
+
+    // Adds a new season. Without a year it is the year after the last one; the years must not go
+    // back in time, as the history is kept sorted by year. Returns -1 if the season is refused.
+    // The year the season was given is written back to it.
+    int addSeason(Season &season)
+    {
+        if (season.year == 0)
+            season.year = (soilHistory.empty() ? currentYear() - 1 : soilHistory.lastYear()) + 1;
+        if (!recordSeason(season))
+            return -1;
+        soilHistoryStamp++;
+        return 1;
+    }
+
+    int addPlant(std::string plant, int year = 0)
+    {
+        Season season;
+        season.plantType = plant;
+        season.year = year;
+        return addSeason(season);
+    }
+
+    size_t soilHistorySize() const
+    {
+        return soilHistory.size();
+    }
+
+    Season getSeason(size_t i) const
+    {
+        return soilHistory.season(i);
+    }
+
+    // Positions [first, last) of the seasons from fromYear to toYear, both included, in O(log n).
+    std::pair<size_t, size_t> soilHistoryRange(int fromYear, int toYear) const
+    {
+        return soilHistory.rangeOfYears(fromYear, toYear);
+    }
+
+    // Writes the seasons at positions [first, last) as comma separated JSON objects.
+    void writeSoilHistoryPage(size_t first, size_t last, Reply::Builder &out) const
+    {
+        soilHistory.writeSeasons(first, last, out);
+    }
+
+    // Number of seasons and mean yield of every plant with a known yield, optionally only in one
+    // zone, as a JSON array. Reads the plant, yield and (when filtering) zone columns.
+    void writeYieldStatistics(int zone, Reply::Builder &out) const
+    {
+        const std::vector<SoilHistory::PlantId> &plants = soilHistory.plantColumn();
+        const std::vector<int32_t> &yields = soilHistory.yieldColumn();
+        const std::vector<uint16_t> &zones = soilHistory.zoneColumn();
+        std::vector<long long> seasons(soilHistory.plantCount(), 0), total(soilHistory.plantCount(), 0);
+
+        for (size_t i = 0; i < plants.size(); i++)
+        {
+            if (yields[i] == SoilHistory::kNoYield || (zone >= 0 && zones[i] != zone))
+                continue;
+            seasons[plants[i]]++;
+            total[plants[i]] += yields[i];
+        }
+
+        out.append('[');
+        bool first = true;
+        for (SoilHistory::PlantId plant = 0; plant < seasons.size(); plant++)
+        {
+            if (seasons[plant] == 0)
+                continue;
+            if (!first)
+                out.append(',');
+            first = false;
+            out.append('{').appendKey("meanYield", true).appendJSON(total[plant] / 1000.0 / seasons[plant]);
+            out.appendKey("plantType").appendJSON(soilHistory.plantName(plant));
+            out.appendKey("seasons").append(seasons[plant]).append('}');
+        }
+        out.append(']');
+    }
+
+private:
+    // Appends a season to the history and teaches the rotation model what followed what in its zone.
+    bool recordSeason(const Season &season)
+    {
+        if (!soilHistory.append(season))
+            return false;
+        SoilHistory::PlantId plant = soilHistory.plantColumn().back();
+        auto previous = lastPlantInZone.find(season.zone);
+        if (previous != lastPlantInZone.end())
+        {
+            rotation.observe(previous->second, plant);
+            previous->second = plant;
+        }
+        else
+            lastPlantInZone.emplace(season.zone, plant);
+        return true;
+    }
+
+    // The numeric settings of the settings block and the values they accept.
+    struct NumberSetting
+    {
+        const char *name;
+        double SharedSettings::Block::*field;
+        double min, max;
+    };
+    static constexpr NumberSetting kNumberSettings[] = {
+        {"luminosity", &SharedSettings::Block::luminosity, 0, 100},
+        {"humidity", &SharedSettings::Block::humidity, 0, 100},
+        {"temperature", &SharedSettings::Block::temperature, 5, 35},
+        {"carbonDioxide", &SharedSettings::Block::carbonDioxide, 0, 100},
+        {"area", &SharedSettings::Block::area, 0, INFINITY},
+        {"waterAmount", &SharedSettings::Block::waterAmount, 0, INFINITY},
+    };
+
+    // Writes a changed copy of the settings block. The writers take turns (the endpoint holds
+    // settingsLock), the readers never wait.
+    void writeSettings(SharedSettings::Block &next)
+    {
+        next.version = settingsBlock.version + 1;
+        next.updated = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        SharedSettings::write(settingsSequence, settingsBlock, next);
+    }
+
+    // Written under the seqlock of settingsSequence only.
+    SharedSettings::Block settingsBlock = {};
+    std::atomic<uint64_t> settingsSequence{0};
+    std::string previousPlantSugestion;
+
+    map<std::string, std::string> actions;
+    SoilHistory soilHistory;
+    RotationModel rotation;
+    std::unordered_map<uint16_t, SoilHistory::PlantId> lastPlantInZone;
+    vector<Preconfiguration> preconfigurations;
+    const std::string soilHistoryLocation;
+    const std::string preconfigurationsLocation;
+    uint64_t soilHistoryStamp = 0;
+    uint64_t soilHistoryResets = 0;
+    uint64_t preconfigurationsStamp = 0;
+
+};
+
+#endif
@@ -0,0 +1,292 @@
+/*
+   Load generator and benchmark for GreenhouseEndpoint.
+   Starts the endpoint in-process on a loopback port, drives every route from setupRoutes with a
+   number of closed-loop client threads and prints throughput and latency percentiles per route.
+
+   Usage:
+     ./bin/greenhouse_bench [--port 9180] [--server-threads 2] [--concurrency 8] [--duration 10]
+                            [--warmup 2] [--keep-alive 1] [--write-ratio 0.1] [--route <substring>]
+                            [--tuning server_tuning.json] [--shards 4 --reuse-port 1] [--pin 1] ...
+
+   Every option of server_tuning.hpp (--threads, --shards, --pin, --cpus, --no-delay, ...) is accepted
+   and applied to the endpoint under test, in the order given (put --tuning first).
+
+   Run it from the repository root, the Greenhouse model reads its data files from there.
+   Writes are real writes: POST /soilHistory makes the history grow during the run, the same way
+   it would on a live server.
+*/
+
+#include <atomic>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "./greenhouse_endpoint.hpp"
+#include "./http_client.hpp"
+#include "./loadgen.hpp"
+
+namespace Bench
+{
+    using LoadGen::Rng;
+
+    struct Route
+    {
+        std::string name;
+        std::string method;
+        bool write;
+        std::function<std::string(Rng &)> path;
+        std::function<std::string(Rng &)> body;
+
+        Metrics::Histogram latency;
+        std::atomic<uint64_t> non2xx{0};
+        std::atomic<uint64_t> failures{0};
+    };
+
+    struct Options
+    {
+        uint16_t port = 9180;
+        Tuning::ServerTuning tuning;
+        int concurrency = 8;
+        double duration = 10;
+        double warmup = 2;
+        bool keepAlive = true;
+        double writeRatio = 0.1;
+        std::string routeFilter;
+    };
+
+    Options parseOptions(int argc, char *argv[])
+    {
+        Options options;
+        // All the clients of the benchmark share one address, so the per client rate limit
+        // would only measure itself. --rate-limit 1 turns it back on.
+        options.tuning.rateLimit.enabled = false;
+        // Nor does the benchmark publish its random settings where the server of this machine
+        // does, or log its traffic to the server's audit log: --shared-settings and --audit 1
+        // (or a --tuning file) turn them back on.
+        options.tuning.sharedSettings = "";
+        options.tuning.audit.enabled = false;
+        for (int i = 1; i + 1 < argc; i += 2)
+        {
+            std::string name = argv[i];
+            std::string value = argv[i + 1];
+            if (name == "--port")
+                options.port = static_cast<uint16_t>(std::stoi(value));
+            else if (name == "--server-threads")
+                options.tuning.threads = std::stoi(value);
+            else if (name == "--tuning")
+                Tuning::loadFile(value, options.tuning);
+            else if (name == "--concurrency")
+                options.concurrency = std::stoi(value);
+            else if (name == "--duration")
+                options.duration = std::stod(value);
+            else if (name == "--warmup")
+                options.warmup = std::stod(value);
+            else if (name == "--keep-alive")
+                options.keepAlive = value != "0";
+            else if (name == "--write-ratio")
+                options.writeRatio = std::stod(value);
+            else if (name == "--route")
+                options.routeFilter = value;
+            else if (!Tuning::applyOption(name, value, options.tuning))
+                throw std::invalid_argument("unknown option " + name);
+        }
+        options.tuning.validate();
+        return options;
+    }
+
+    void add(std::vector<std::unique_ptr<Route>> &routes, const std::string &method, const std::string &name,
+             std::function<std::string(Rng &)> path, std::function<std::string(Rng &)> body = nullptr)
+    {
+        std::unique_ptr<Route> route(new Route());
+        route->name = method + " " + name;
+        route->method = method;
+        route->write = method == "POST";
+        route->path = path;
+        route->body = body;
+        routes.push_back(std::move(route));
+    }
+
+    // One entry per route registered in GreenhouseEndpoint::setupRoutes, except POST /replication/promote:
+    // it turns a follower into a leader once, there is nothing to measure under load.
+    // GET /audit answers 404 unless the audit log is turned back on with --audit 1.
+    std::vector<std::unique_ptr<Route>> allRoutes()
+    {
+        auto fixed = [](const std::string &path)
+        {
+            return [path](Rng &)
+            { return path; };
+        };
+
+        std::vector<std::unique_ptr<Route>> routes;
+        add(routes, "GET", "/ready", fixed("/ready"));
+        add(routes, "GET", "/auth", fixed("/auth"));
+        add(routes, "POST", "/settings/:settingName/:value", [](Rng &rng)
+            { return "/settings/temperature/" + std::to_string(5 + rng.below(31)); });
+        add(routes, "GET", "/settings/:settingName/", fixed("/settings/temperature/"));
+        add(routes, "GET", "/settings/getAll", fixed("/settings/getAll"));
+        add(routes, "GET", "/waterAmount", fixed("/waterAmount"));
+        add(routes, "GET", "/irigationTime", fixed("/irigationTime"));
+        add(routes, "GET", "/preconfigurations/getAll", fixed("/preconfigurations/getAll"));
+        add(routes, "POST", "/preconfigurations/select/:value", [](Rng &rng)
+            { return "/preconfigurations/select/" + std::to_string(rng.below(2)); });
+        // A bounded set of plant types: once all exist, the route answers with its duplicate error.
+        add(routes, "POST", "/preconfigurations", fixed("/preconfigurations"), [](Rng &rng)
+            { return "{\"luminosity\":50,\"humidity\":60,\"temperature\":22,\"carbonDioxide\":3,\"plantType\":\"bench" +
+                     std::to_string(rng.below(1000)) + "\"}"; });
+        add(routes, "POST", "/soilHistory", fixed("/soilHistory"), [](Rng &rng)
+            {
+                static const char *plants[] = {"rosie", "castravete", "ardei", "salata"};
+                return std::string("{\"plantType\":\"") + plants[rng.below(4)] + "\"}"; });
+        add(routes, "GET", "/soilHistory", fixed("/soilHistory"));
+        add(routes, "GET", "/soilHistory?from=&limit=", [](Rng &rng)
+            { return "/soilHistory?from=" + std::to_string(2017 + rng.below(5)) + "&limit=50"; });
+        add(routes, "GET", "/soilHistory/yields", fixed("/soilHistory/yields"));
+        add(routes, "GET", "/plantType", fixed("/plantType"));
+        add(routes, "POST", "/telemetry", fixed("/telemetry"), [](Rng &rng)
+            { return "{\"zone\":" + std::to_string(rng.below(1000)) + ",\"temperature\":" + std::to_string(15 + rng.below(15)) +
+                     ",\"humidity\":" + std::to_string(40 + rng.below(40)) + "}"; });
+        add(routes, "GET", "/telemetry/:zone", [](Rng &rng)
+            { return "/telemetry/" + std::to_string(rng.below(1000)); });
+        add(routes, "GET", "/alerts", fixed("/alerts"));
+        add(routes, "GET", "/health/score", fixed("/health/score"));
+        add(routes, "GET", "/audit", fixed("/audit?limit=100"));
+        add(routes, "GET", "/replication", fixed("/replication"));
+        add(routes, "GET", "/metrics", fixed("/metrics"));
+        add(routes, "GET", "/metrics/locks", fixed("/metrics/locks"));
+        return routes;
+    }
+
+    void report(const std::vector<Route *> &routes, double seconds)
+    {
+        printf("%-42s %10s %8s %8s %11s %10s %10s %10s\n", "route", "requests", "non2xx", "failed", "req/s", "p50 us", "p99 us", "p999 us");
+        Metrics::Snapshot total;
+        uint64_t totalNon2xx = 0, totalFailures = 0;
+        for (Route *route : routes)
+        {
+            Metrics::Snapshot s = route->latency.snapshot();
+            uint64_t non2xx = route->non2xx.load(), failures = route->failures.load();
+            printf("%-42s %10llu %8llu %8llu %11.1f %10.1f %10.1f %10.1f\n", route->name.c_str(),
+                   (unsigned long long)s.count, (unsigned long long)non2xx, (unsigned long long)failures, s.count / seconds,
+                   LoadGen::micros(s.percentile(0.5)), LoadGen::micros(s.percentile(0.99)), LoadGen::micros(s.percentile(0.999)));
+            LoadGen::merge(total, s);
+            totalNon2xx += non2xx;
+            totalFailures += failures;
+        }
+        printf("%-42s %10llu %8llu %8llu %11.1f %10.1f %10.1f %10.1f\n", "total",
+               (unsigned long long)total.count, (unsigned long long)totalNon2xx, (unsigned long long)totalFailures, total.count / seconds,
+               LoadGen::micros(total.percentile(0.5)), LoadGen::micros(total.percentile(0.99)), LoadGen::micros(total.percentile(0.999)));
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    Bench::Options options;
+    try
+    {
+        options = Bench::parseOptions(argc, argv);
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    auto allRoutes = Bench::allRoutes();
+    std::vector<Bench::Route *> reads, writes, selected;
+    for (auto &route : allRoutes)
+    {
+        if (route->name.find(options.routeFilter) == std::string::npos)
+            continue;
+        selected.push_back(route.get());
+        (route->write ? writes : reads).push_back(route.get());
+    }
+    if (selected.empty())
+    {
+        std::cerr << "no route matches '" << options.routeFilter << "'" << std::endl;
+        return 1;
+    }
+
+    // The endpoint under test, exactly as greenhouse_app runs it, but only on loopback.
+    GreenhouseEndpoint endpoint(Address(Ipv4::loopback(), Port(options.port)));
+    endpoint.init(options.tuning);
+    endpoint.start();
+
+    bool ready = false;
+    for (int attempt = 0; attempt < 50 && !ready; attempt++)
+    {
+        try
+        {
+            HttpClient::Connection probe("127.0.0.1", options.port);
+            ready = probe.request("GET", "/ready").ok();
+        }
+        catch (const std::exception &)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+    }
+    if (!ready)
+    {
+        std::cerr << "endpoint did not come up on port " << options.port << std::endl;
+        endpoint.stop();
+        return 1;
+    }
+
+    cout << "Server threads = " << options.tuning.threads << " x " << options.tuning.shards << " shards, pinned = " << options.tuning.pinThreads
+         << ", concurrency = " << options.concurrency
+         << ", keep-alive = " << options.keepAlive << ", write ratio = " << options.writeRatio << endl;
+
+    std::atomic<bool> measuring{false};
+    std::atomic<bool> stopping{false};
+    std::vector<std::thread> clients;
+    for (int c = 0; c < options.concurrency; c++)
+    {
+        clients.emplace_back([&, c]()
+                             {
+            Bench::Rng rng(c + 1);
+            HttpClient::Connection connection("127.0.0.1", options.port);
+            while (!stopping.load(std::memory_order_relaxed))
+            {
+                bool write = !writes.empty() && (reads.empty() || rng.unit() < options.writeRatio);
+                auto &pool = write ? writes : reads;
+                Bench::Route *route = pool[rng.below(pool.size())];
+                std::string path = route->path(rng);
+                std::string body = route->body ? route->body(rng) : "";
+
+                uint64_t start = Metrics::nowNs();
+                try
+                {
+                    HttpClient::Response response = connection.request(route->method, path, body, options.keepAlive);
+                    if (measuring.load(std::memory_order_relaxed))
+                    {
+                        route->latency.record(Metrics::nowNs() - start);
+                        if (!response.ok())
+                            route->non2xx++;
+                    }
+                }
+                catch (const std::exception &)
+                {
+                    if (measuring.load(std::memory_order_relaxed))
+                        route->failures++;
+                }
+            } });
+    }
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(options.warmup));
+    measuring = true;
+    uint64_t start = Metrics::nowNs();
+    std::this_thread::sleep_for(std::chrono::duration<double>(options.duration));
+    measuring = false;
+    double elapsed = (Metrics::nowNs() - start) / 1e9;
+    stopping = true;
+    for (auto &client : clients)
+        client.join();
+
+    Bench::report(selected, elapsed);
+
+    endpoint.stop();
+    return 0;
+}
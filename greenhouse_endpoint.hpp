@@ -0,0 +1,1447 @@
+/*
+   GreenhouseEndpoint: the REST routes of the smart greenhouse, serving the model from greenhouse.hpp.
+   Kept in a header so that the server (greenhouse_app.cpp) and the benchmarks can host the same endpoint.
+*/
+
+#ifndef GREENHOUSE_ENDPOINT_HPP
+#define GREENHOUSE_ENDPOINT_HPP
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <climits>
+#include <random>
+#include <sstream>
+
+#include <pistache/net.h>
+#include <pistache/http.h>
+#include <pistache/peer.h>
+#include <pistache/http_headers.h>
+#include <pistache/cookie.h>
+#include <pistache/router.h>
+#include <pistache/endpoint.h>
+#include <pistache/common.h>
+
+#include <map>
+#include <list>
+#include <fstream>
+#include <time.h>
+#include <ctime>
+
+#include "./json.hpp"
+#include "./greenhouse.hpp"
+#include "./metrics.hpp"
+#include "./lock_profiler.hpp"
+#include "./response_builder.hpp"
+#include "./server_tuning.hpp"
+#include "./rate_limit.hpp"
+#include "./compression.hpp"
+#include "./health_score.hpp"
+#include "./replication.hpp"
+#include "./shared_settings.hpp"
+#include "./offload.hpp"
+#include "./coroutine.hpp"
+
+using json = nlohmann::json;
+
+using namespace std;
+using namespace Pistache;
+
+// General advice: pay atetntion to the namespaces that you use in various contexts. Could prevent headaches.
+
+// This is just a helper function to preety-print the Cookies that one of the enpoints shall receive.
+inline void printCookies(const Http::Request &req)
+{
+    auto cookies = req.cookies();
+    std::cout << "Cookies: [" << std::endl;
+    const std::string indent(4, ' ');
+    for (const auto &c : cookies)
+    {
+        std::cout << indent << c.name << " = " << c.value << std::endl;
+    }
+    std::cout << "]" << std::endl;
+}
+
+// Some generic namespace, with a simple function we could use to test the creation of the endpoints.
+namespace Generic
+{
+    inline void handleReady(const Rest::Request &, Http::ResponseWriter response)
+    {
+        response.send(Http::Code::Ok, "2");
+    }
+
+}
+
+class ErrorHTTP
+{
+private:
+    string error;
+    Pistache::Http::Code code;
+    // Seconds after which the client may try again, sent as Retry-After when above 0.
+    int retryAfter;
+
+public:
+    ErrorHTTP(Pistache::Http::Code code, string error, int retryAfter = 0)
+    {
+        this->code = code;
+        this->error = error;
+        this->retryAfter = retryAfter;
+    }
+
+    void setError(string error)
+    {
+        this->error = error;
+    }
+
+    void setCode(Pistache::Http::Code code)
+    {
+        this->code = code;
+    }
+
+    string getError() const
+    {
+        return error;
+    }
+
+    Pistache::Http::Code getCode() const
+    {
+        return code;
+    }
+
+    void setRetryAfter(int retryAfter)
+    {
+        this->retryAfter = retryAfter;
+    }
+
+    int getRetryAfter() const
+    {
+        return retryAfter;
+    }
+};
+
+class ErrorMQTT
+{
+private:
+    string error;
+
+public:
+    ErrorMQTT(string error)
+    {
+        this->error = error;
+    }
+
+    void setError(string error)
+    {
+        this->error = error;
+    }
+
+    string getError() const
+    {
+        return error;
+    }
+};
+
+inline void from_json(const json &json, ErrorHTTP &error)
+{
+    error.setCode(json.at("code"));
+    error.setError(json.at("error"));
+}
+
+inline void from_json(const json &json, ErrorMQTT &error)
+{
+    error.setError(json.at("error"));
+}
+
+inline void to_json(json &j, const ErrorHTTP &error)
+{
+    j = json{
+        {"error", error.getError()},
+        {"code", error.getCode()}};
+}
+
+inline void to_json(json &j, const ErrorMQTT &error)
+{
+    j = json{
+        {"error", error.getError()}};
+}
+
+// Definition of the GreenhouseEnpoint class
+class GreenhouseEndpoint
+{
+public:
+    explicit GreenhouseEndpoint(Address addr)
+        : httpErrors(metrics.codeCounters("greenhouse_http_errors_total", "Error responses sent through ErrorHTTP, by status code.")),
+          mqttPublishes(metrics.counter("greenhouse_mqtt_publish_total", "", "Messages published on the mqtt topic.", true)),
+          greenhouseLock("greenhouseLock", &metrics.histogram("greenhouse_lock_wait_seconds", "lock=\"greenhouseLock\"", "Time spent waiting to acquire a lock.")),
+          settingsLock("settingsLock", &metrics.histogram("greenhouse_lock_wait_seconds", "lock=\"settingsLock\"", "Time spent waiting to acquire a lock.")),
+          address(addr),
+          rateLimits(metrics.counter("greenhouse_rate_limit_overflow_total", "", "Requests of clients that found the rate limit table full and shared a bucket.")),
+          climate(metrics),
+          alerts(metrics),
+          health(metrics),
+          audit(metrics),
+          leader(metrics),
+          follower(metrics),
+          offload(metrics)
+    {
+        for (size_t i = 0; i < Compression::kEncodings; i++)
+            compressedResponses[i] = &metrics.counter("greenhouse_cached_responses_total",
+                                                      std::string("encoding=\"") + Compression::name(static_cast<Compression::Encoding>(i)) + "\"",
+                                                      "Responses of /soilHistory and /preconfigurations/getAll, by content encoding.");
+    }
+
+    // Initialization of the server with the default tuning and thr worker threads.
+    void init(size_t thr = 2)
+    {
+        Tuning::ServerTuning tuning;
+        tuning.threads = static_cast<int>(thr);
+        init(tuning);
+    }
+
+    // Initialization of the server. Every shard is its own Http::Endpoint (with its own reactor)
+    // listening on the same address; with SO_REUSEPORT the kernel balances connections between them.
+    void init(const Tuning::ServerTuning &serverTuning)
+    {
+        serverTuning.validate();
+        tuning = serverTuning;
+
+        Tcp::Options flags = Tcp::Options::None;
+        if (tuning.noDelay)
+            flags = flags | Tcp::Options::NoDelay;
+        if (tuning.reuseAddr)
+            flags = flags | Tcp::Options::ReuseAddr;
+        if (tuning.reusePort)
+            flags = flags | Tcp::Options::ReusePort;
+
+        for (int shard = 0; shard < tuning.shards; shard++)
+        {
+            auto opts = Http::Endpoint::options()
+                            .threads(tuning.threads)
+                            .threadsName(tuning.shardThreadsName(shard))
+                            .flags(flags)
+                            .backlog(tuning.backlog)
+                            .maxRequestSize(tuning.maxRequestSize);
+            auto httpEndpoint = std::make_shared<Http::Endpoint>(address);
+            httpEndpoint->init(opts);
+            httpEndpoints.push_back(httpEndpoint);
+        }
+        climate.configure(tuning.climate);
+        alerts.configure(tuning.alerts.enabled ? Alerts::loadRules(tuning.alerts.rulesFile) : std::vector<Alerts::Rule>(), tuning.climate.maxZones);
+        health.configure(Health::loadIdeal("ideal_parameters.txt"), tuning.climate.maxZones);
+        audit.configure(tuning.audit);
+        if (!tuning.sharedSettings.empty() && !sharedSettings.open(tuning.sharedSettings))
+            std::cerr << "The settings are not published in shared memory: cannot open " << tuning.sharedSettings << ": " << strerror(errno) << std::endl;
+        {
+            Guard guard(settingsLock);
+            settingsChanged();
+            if (audit.enabled())
+                audit.append(Audit::checkpoint(gh.getSettings()));
+        }
+        readOnly = !tuning.replication.leader.empty();
+        // Server routes are loaded up
+        setupRoutes();
+    }
+
+    // Server is started threaded. All shards share the same routes.
+    void start()
+    {
+        audit.start();
+        if (readOnly)
+            follower.start(tuning.replication, [this](const std::vector<Audit::Event> &changes, bool reset)
+                           { applyReplicated(changes, reset); });
+        else
+            startLeading();
+        offload.start(tuning.offload);
+        for (auto &httpEndpoint : httpEndpoints)
+        {
+            httpEndpoint->setHandler(router.handler());
+            httpEndpoint->serveThreaded();
+        }
+        if (tuning.pinThreads)
+        {
+            int pinned = Tuning::pinReactorThreads(tuning);
+            if (pinned < tuning.threads * tuning.shards)
+                std::cerr << "Pinned only " << pinned << " of " << tuning.threads * tuning.shards << " reactor threads" << std::endl;
+        }
+    }
+
+    // Starts what publishes on MQTT with publish: the climate control loop (the actuator
+    // commands) and the alerts raised and cleared by the telemetry. The actuators are driven by
+    // the leader only, a follower starts its control loop once promoted.
+    void startPublishing(Climate::Controller::Publish publish)
+    {
+        std::atomic_store(&alertPublisher, std::make_shared<const Climate::Controller::Publish>(publish));
+        if (!readOnly)
+            startClimateControl(std::move(publish));
+    }
+
+    // When signaled server shuts down
+    void stop()
+    {
+        climate.stop();
+        follower.stop();
+        leader.stop();
+        for (auto &httpEndpoint : httpEndpoints)
+            httpEndpoint->shutdown();
+        offload.stop();
+        audit.stop();
+        sharedSettings.close();
+    }
+
+    const int HTTP = 0;
+    const int MQTT = 1;
+
+    // Called by the MQTT publisher after every successful publish.
+    void countMqttPublish()
+    {
+        mqttPublishes.increment();
+    }
+
+    json genericAddPreconfiguration(int reqType)
+    {
+        Preconfiguration p;
+
+        // from_json(clientJson, p);
+
+        p.luminosity = 10;
+        p.humidity = 11;
+        p.temperature = 12;
+        p.carbonDioxide = 13;
+        p.plantType = "salata";
+
+        // Setting the Greenhouse's setting to value
+        int setResponse = gh.addPreconfiguration(p);
+
+        // Sending some confirmation or error response.
+        if (setResponse == -1)
+        {
+            if (reqType == HTTP)
+            {
+
+                ErrorHTTP error(Http::Code::Bad_Request, "The preconfiguration already exists");
+                json jsonErrorHttp(error);
+                return jsonErrorHttp;
+            }
+            else
+            {
+                ErrorMQTT error("The preconfiguration already exists");
+                json jsonError(error);
+                return jsonError;
+            }
+            
+        }
+        else if (setResponse == -2)
+        {
+            string message = "The plant type is longer than " + std::to_string(Greenhouse::kMaxPlantTypeLength) + " characters";
+            if (reqType == HTTP)
+            {
+                ErrorHTTP error(Http::Code::Bad_Request, message);
+                json jsonErrorHttp(error);
+                return jsonErrorHttp;
+            }
+            else
+            {
+                ErrorMQTT error(message);
+                json jsonError(error);
+                return jsonError;
+            }
+        }
+        else
+        {
+            return p;
+        }
+    }
+
+private:
+    void setupRoutes()
+    {
+        using namespace Rest;
+        // Defining various endpoints
+        // Generally say that when http://localhost:9080/ready is called, the handleReady function should be called.
+        Routes::Get(router, "/ready", instrument("GET /ready", Routes::bind(&Generic::handleReady)));
+        Routes::Get(router, "/auth", instrument("GET /auth", Routes::bind(&GreenhouseEndpoint::doAuth, this)));
+        Routes::Post(router, "/settings/:settingName/:value", instrument("POST /settings/:settingName/:value", coroutine(&GreenhouseEndpoint::setSetting)));
+        Routes::Get(router, "/settings/:settingName/", instrument("GET /settings/:settingName/", Routes::bind(&GreenhouseEndpoint::getSetting, this)));
+        Routes::Get(router, "/settings/getAll", instrument("GET /settings/getAll", Routes::bind(&GreenhouseEndpoint::getCurrentConfiguration, this)));
+        Routes::Get(router, "/waterAmount", instrument("GET /waterAmount", Routes::bind(&GreenhouseEndpoint::getWaterAmountNeeded, this)));
+        Routes::Get(router, "/irigationTime", instrument("GET /irigationTime", Routes::bind(&GreenhouseEndpoint::getIrigationTime, this)));
+        Routes::Get(router, "/preconfigurations/getAll", instrument("GET /preconfigurations/getAll", Routes::bind(&GreenhouseEndpoint::getPreconfigurations, this)));
+        Routes::Post(router, "/preconfigurations/select/:value", instrument("POST /preconfigurations/select/:value", coroutine(&GreenhouseEndpoint::setPreconfiguration)));
+        Routes::Post(router, "/preconfigurations", instrument("POST /preconfigurations", coroutine(&GreenhouseEndpoint::addPreconfiguration)));
+        Routes::Post(router, "/soilHistory", instrument("POST /soilHistory", coroutine(&GreenhouseEndpoint::addPlant)));
+        Routes::Get(router, "/soilHistory", instrument("GET /soilHistory", Routes::bind(&GreenhouseEndpoint::getSoilHistory, this)));
+        Routes::Get(router, "/soilHistory/yields", instrument("GET /soilHistory/yields", Routes::bind(&GreenhouseEndpoint::getYieldStatistics, this)));
+        Routes::Post(router, "/telemetry", instrument("POST /telemetry", Routes::bind(&GreenhouseEndpoint::addTelemetry, this)));
+        Routes::Get(router, "/health/score", instrument("GET /health/score", Routes::bind(&GreenhouseEndpoint::getHealthScore, this)));
+        Routes::Get(router, "/audit", instrument("GET /audit", Routes::bind(&GreenhouseEndpoint::getAudit, this)));
+        Routes::Get(router, "/replication", instrument("GET /replication", Routes::bind(&GreenhouseEndpoint::getReplication, this)));
+        Routes::Post(router, "/replication/promote", instrument("POST /replication/promote", Routes::bind(&GreenhouseEndpoint::promote, this)));
+        Routes::Get(router, "/alerts", instrument("GET /alerts", Routes::bind(&GreenhouseEndpoint::getAlerts, this)));
+        Routes::Get(router, "/telemetry/:zone", instrument("GET /telemetry/:zone", Routes::bind(&GreenhouseEndpoint::getTelemetry, this)));
+        Routes::Get(router, "/plantType", instrument("GET /plantType", Routes::bind(&GreenhouseEndpoint::getPlantTypeSuggestion, this)));
+        Routes::Get(router, "/metrics", Routes::bind(&GreenhouseEndpoint::getMetrics, this));
+        Routes::Get(router, "/metrics/locks", Routes::bind(&GreenhouseEndpoint::getLockReport, this));
+    }
+
+    // The control loop reads the setpoints from the settings block, without greenhouseLock.
+    void startClimateControl(Climate::Controller::Publish publish)
+    {
+        climate.start([this](Climate::Controller::Values &setpoints)
+                      { setpoints = this->setpoints(); },
+                      std::move(publish));
+    }
+
+    // Accepts followers, when a replication port is configured.
+    void startLeading()
+    {
+        if (tuning.replication.port == 0)
+            return;
+        leader.start(tuning.replication, [this](std::vector<Audit::Event> &state)
+                     {
+                         Guard guard(greenhouseLock);
+                         Guard settings(settingsLock);
+                         Replication::snapshot(gh, state);
+                         return leader.sequence(); });
+    }
+
+    // Applies the changes received from the leader, and logs them like our own.
+    void applyReplicated(const std::vector<Audit::Event> &changes, bool reset)
+    {
+        Guard guard(greenhouseLock);
+        Guard settings(settingsLock);
+        // Promoted meanwhile: the changes of the old leader no longer apply.
+        if (!readOnly)
+            return;
+        if (reset)
+            gh.clear();
+        for (const Audit::Event &change : changes)
+        {
+            Replication::applyChange(change, gh);
+            if (!reset && audit.enabled())
+                recordChange(Audit::Event(change));
+        }
+        if (reset && audit.enabled())
+            audit.append(Audit::checkpoint(gh.getSettings()));
+        settingsChanged();
+    }
+
+    // The routes that change the greenhouse, refused by followers.
+    static constexpr const char *kChangingRoutes[] = {"POST /settings/:settingName/:value", "POST /preconfigurations/select/:value",
+                                                      "POST /preconfigurations", "POST /soilHistory"};
+
+    // Route handlers written as coroutines, see coroutine.hpp. The request is theirs, the
+    // response stays valid until they are done.
+    using CoroutineHandler = std::function<Coro::Task(Rest::Request, Http::ResponseWriter &)>;
+
+    // Wraps a route handler so that its latency ends up in the per-route histogram
+    // and the locks it takes are attributed to the route by the contention profiler.
+    // Clients over the rate limit of the route get a 429, and routes listed in the admission
+    // config are shed with a 503 once over their concurrency limit; both before the handler runs.
+    // The handlers of the offloaded routes run on the executor, not on the reactor thread.
+    Rest::Route::Handler instrument(const std::string &route, Rest::Route::Handler handler, CoroutineHandler coroutineHandler = nullptr)
+    {
+        Metrics::Histogram &latency = metrics.histogram("greenhouse_http_request_duration_seconds", "route=\"" + route + "\"",
+                                                        "Time spent in each route handler.");
+        Metrics::CodeCounters &errors = httpErrors;
+        const char *name = Contention::intern(route);
+        Admission::Limiter *limiter = admissionLimiter(route);
+        bool changes = std::find(std::begin(kChangingRoutes), std::end(kChangingRoutes), route) != std::end(kChangingRoutes);
+        const Offload::Config &offloading = tuning.offload;
+        bool offloaded = offloading.enabled && std::find(offloading.routes.begin(), offloading.routes.end(), route) != offloading.routes.end();
+
+        RateLimit::Limit rateLimit = tuning.rateLimit.limitOf(route);
+        bool rateLimited = tuning.rateLimit.enabled && rateLimit.rate > 0;
+        uint64_t routeKey = RateLimit::hash(route.data(), route.size());
+        Metrics::Counter &throttled = metrics.counter("greenhouse_rate_limited_total", "route=\"" + route + "\"",
+                                                      "Requests refused with a 429 by the per client rate limit.");
+
+        return [this, &latency, &errors, &throttled, name, limiter, changes, offloaded, rateLimited, rateLimit, routeKey, handler, coroutineHandler](const Rest::Request request, Http::ResponseWriter response)
+        {
+            Contention::RouteScope scope(name);
+            if (changes && readOnly)
+            {
+                sendError(response, ErrorHTTP(Http::Code::Forbidden, "This server is a read-only follower of " + tuning.replication.leader + ", send changes to the leader."));
+                return Rest::Route::Result::Ok;
+            }
+            if (rateLimited)
+            {
+                uint32_t waitMs = rateLimits.take(clientKey(request, routeKey), rateLimit);
+                if (waitMs > 0)
+                {
+                    throttled.increment();
+                    sendError(response, ErrorHTTP(Http::Code::Too_Many_Requests, "Too many requests, slow down.", static_cast<int>((waitMs + 999) / 1000)));
+                    return Rest::Route::Result::Ok;
+                }
+            }
+            if (limiter && !limiter->tryAcquire())
+            {
+                sendError(response, ErrorHTTP(Http::Code::Service_Unavailable, "The server is busy, try again later.", limiter->getRetryAfter()));
+                return Rest::Route::Result::Ok;
+            }
+            uint64_t start = Metrics::nowNs();
+            if (coroutineHandler)
+            {
+                startCoroutine(coroutineHandler, request, std::move(response), start, latency, limiter);
+                return Rest::Route::Result::Ok;
+            }
+            // When the executor is full the handler runs here, like the other routes.
+            Http::ResponseWriter *writer = &response;
+            std::shared_ptr<Http::ResponseWriter> pending;
+            if (offloaded)
+            {
+                pending = std::make_shared<Http::ResponseWriter>(std::move(response));
+                if (offload.submit([this, &latency, name, limiter, handler, request, pending, start]()
+                                   { runOffloaded(name, handler, request, std::move(*pending), start, latency, limiter); }))
+                    return Rest::Route::Result::Ok;
+                writer = pending.get();
+            }
+            try
+            {
+                auto result = handler(request, std::move(*writer));
+                uint64_t elapsed = Metrics::nowNs() - start;
+                latency.record(elapsed);
+                if (limiter)
+                    limiter->release(elapsed);
+                return result;
+            }
+            catch (...)
+            {
+                // Pistache answers uncaught exceptions (e.g. a malformed JSON body) with a 500.
+                uint64_t elapsed = Metrics::nowNs() - start;
+                latency.record(elapsed);
+                if (limiter)
+                    limiter->release(elapsed);
+                errors.increment(static_cast<int>(Http::Code::Internal_Server_Error));
+                throw;
+            }
+        };
+    }
+
+    // The same for a coroutine handler. It runs on the reactor thread until it first waits, and
+    // its latency counts until it is done.
+    Rest::Route::Handler instrument(const std::string &route, CoroutineHandler handler)
+    {
+        return instrument(route, nullptr, std::move(handler));
+    }
+
+    // Binds a coroutine handler of this class, as Routes::bind does for the others.
+    CoroutineHandler coroutine(Coro::Task (GreenhouseEndpoint::*handler)(Rest::Request, Http::ResponseWriter &))
+    {
+        return [this, handler](Rest::Request request, Http::ResponseWriter &response)
+        { return (this->*handler)(std::move(request), response); };
+    }
+
+    // Pistache answers the exceptions of the handlers it runs itself with a 500 and their
+    // message; for the handlers it does not see finish (offloaded, coroutines) it is done here.
+    void sendException(Http::ResponseWriter &response, std::exception_ptr error)
+    {
+        httpErrors.increment(static_cast<int>(Http::Code::Internal_Server_Error));
+        try
+        {
+            std::rethrow_exception(error);
+        }
+        catch (const std::exception &e)
+        {
+            response.send(Http::Code::Internal_Server_Error, e.what());
+        }
+        catch (...)
+        {
+            response.send(Http::Code::Internal_Server_Error);
+        }
+    }
+
+    // Runs a handler on a worker of the executor.
+    void runOffloaded(const char *route, const Rest::Route::Handler &handler, const Rest::Request &request, Http::ResponseWriter response,
+                      uint64_t start, Metrics::Histogram &latency, Admission::Limiter *limiter)
+    {
+        Contention::RouteScope scope(route);
+        Http::ResponseWriter fallback = response.clone();
+        try
+        {
+            handler(request, std::move(response));
+        }
+        catch (...)
+        {
+            sendException(fallback, std::current_exception());
+        }
+        uint64_t elapsed = Metrics::nowNs() - start;
+        latency.record(elapsed);
+        if (limiter)
+            limiter->release(elapsed);
+    }
+
+    // Starts a coroutine handler. The response lives until the coroutine is done.
+    void startCoroutine(const CoroutineHandler &handler, const Rest::Request &request, Http::ResponseWriter response,
+                        uint64_t start, Metrics::Histogram &latency, Admission::Limiter *limiter)
+    {
+        auto writer = std::make_shared<Http::ResponseWriter>(std::move(response));
+        Coro::spawn(handler(request, *writer), [this, writer, start, &latency, limiter](std::exception_ptr error)
+                    {
+                        if (error)
+                            sendException(*writer, error);
+                        uint64_t elapsed = Metrics::nowNs() - start;
+                        latency.record(elapsed);
+                        if (limiter)
+                            limiter->release(elapsed); });
+    }
+
+    // With ?durable=1, waits until the change logged at position is written to the audit log.
+    // False when it could not be: dropped or lost to a failed write. True without waiting when
+    // not asked, or when the audit log is off.
+    Coro::Callback<bool> durable(const Rest::Request &request, uint64_t position)
+    {
+        bool wanted = request.query().has("durable") && audit.enabled();
+        return Coro::Callback<bool>([this, wanted, position](std::function<void(bool)> resume)
+                                    {
+                                        if (!wanted)
+                                            resume(true);
+                                        else if (position == kNotLogged)
+                                            resume(false);
+                                        else
+                                            audit.whenFlushed(position, std::move(resume)); });
+    }
+
+    // Identifies the client of a request for the rate limit of one route: its IP address and,
+    // when it sent one, its session cookie.
+    uint64_t clientKey(const Rest::Request &request, uint64_t routeKey) const
+    {
+        std::string host = request.address().host();
+        uint64_t key = RateLimit::hash(host.data(), host.size(), routeKey);
+        const std::string &cookie = tuning.rateLimit.cookie;
+        if (!cookie.empty() && request.cookies().has(cookie))
+        {
+            std::string session = request.cookies().get(cookie).value;
+            key = RateLimit::hash(session.data(), session.size(), key ^ 0xff);
+        }
+        return key;
+    }
+
+    // Who made a change, for the audit log: the client's address and, when it sent one, its session.
+    std::string actorOf(const Rest::Request &request) const
+    {
+        std::string actor = request.address().host();
+        const std::string &cookie = tuning.rateLimit.cookie;
+        if (!cookie.empty() && request.cookies().has(cookie))
+            actor.append(" ").append(request.cookies().get(cookie).value);
+        return actor;
+    }
+
+    // The limiter of a route, or nullptr when the route is not admission controlled.
+    Admission::Limiter *admissionLimiter(const std::string &route)
+    {
+        const Admission::Config &config = tuning.admission;
+        if (!config.enabled || std::find(config.routes.begin(), config.routes.end(), route) == config.routes.end())
+            return nullptr;
+        std::string labels = "route=\"" + route + "\"";
+        limiters.emplace_back(new Admission::Limiter(config,
+                                                     metrics.counter("greenhouse_admission_rejected_total", labels, "Requests shed with a 503 by admission control."),
+                                                     metrics.gauge("greenhouse_admission_limit", labels, "Current concurrency limit of an admission controlled route.")));
+        return limiters.back().get();
+    }
+
+    // Sends a body built with Reply::Builder. The Server and Content-Type headers are built once
+    // and shared by every response; confirmations of POST routes never had them.
+    void sendText(Http::ResponseWriter &response, Http::Code code, const Reply::Builder &body, bool withHeaders = true)
+    {
+        if (withHeaders)
+            response.headers().add(textHeaders.server).add(textHeaders.contentType);
+        response.send(code, body.data(), body.size());
+    }
+
+    // Sends a cached body, compressed when it is large enough and the client accepts an encoding.
+    // The body is built once per version of the data with greenhouseLock held (BodyCache::get),
+    // only its compression happens here, outside of the lock.
+    void sendBody(const Rest::Request &request, Http::ResponseWriter &response, const Compression::Body &body)
+    {
+        const Compression::Config &config = tuning.compression;
+        Compression::Encoding encoding = Compression::Encoding::Identity;
+        if (config.enabled && body.plain.size() >= config.minSize)
+            encoding = Compression::negotiate(acceptEncoding(request));
+        const std::string &payload = body.get(encoding, config.level);
+
+        response.headers().add(textHeaders.server).add(textHeaders.contentType);
+        response.headers().addRaw(Http::Header::Raw("Vary", "Accept-Encoding"));
+        if (encoding != Compression::Encoding::Identity)
+            response.headers().addRaw(Http::Header::Raw("Content-Encoding", Compression::name(encoding)));
+        compressedResponses[static_cast<size_t>(encoding)]->increment();
+        response.send(Http::Code::Ok, payload.data(), payload.size());
+    }
+
+    // Accept-Encoding of a request. Depending on the Pistache version the header is kept raw or parsed.
+    static std::string acceptEncoding(const Rest::Request &request)
+    {
+        auto raw = request.headers().tryGetRaw("Accept-Encoding");
+        if (raw)
+            return raw->value();
+        auto typed = request.headers().tryGet("Accept-Encoding");
+        if (!typed)
+            return "";
+        std::ostringstream value;
+        typed->write(value);
+        return value.str();
+    }
+
+    // Every error response goes through here, so it is counted by status code.
+    void sendError(Http::ResponseWriter &response, const ErrorHTTP &error)
+    {
+        httpErrors.increment(static_cast<int>(error.getCode()));
+        if (error.getRetryAfter() > 0)
+            response.headers().addRaw(Http::Header::Raw("Retry-After", std::to_string(error.getRetryAfter())));
+        response.send(error.getCode(), error.getError());
+    }
+
+    void getMetrics(const Rest::Request &request, Http::ResponseWriter response)
+    {
+        using namespace Http;
+        response.headers()
+            .add<Header::Server>("pistache/0.1")
+            .add<Header::ContentType>(MIME(Text, Plain));
+
+        response.send(Http::Code::Ok, metrics.renderPrometheus());
+    }
+
+    // Which handlers wait the most on greenhouseLock, and for how long they hold it.
+    void getLockReport(const Rest::Request &request, Http::ResponseWriter response)
+    {
+        using namespace Http;
+        response.headers()
+            .add<Header::Server>("pistache/0.1")
+            .add<Header::ContentType>(MIME(Application, Json));
+
+        response.send(Http::Code::Ok, Contention::Profiler::instance().report().dump());
+    }
+
+    void doAuth(const Rest::Request &request, Http::ResponseWriter response)
+    {
+        // Function that prints cookies
+        printCookies(request);
+        // In the response object, it adds a cookie regarding the communications language,
+        // and a session id if the client does not have one yet (the rate limit tells sessions apart by it).
+        response.cookies()
+            .add(Http::Cookie("lang", "en-US"));
+        const std::string &sessionCookie = tuning.rateLimit.cookie;
+        if (!sessionCookie.empty() && !request.cookies().has(sessionCookie))
+            response.cookies().add(Http::Cookie(sessionCookie, newSessionId()));
+        // Send the response
+        response.send(Http::Code::Ok);
+    }
+
+    // Random 64-bit session id, in hex.
+    static std::string newSessionId()
+    {
+        thread_local std::mt19937_64 generator(std::random_device{}());
+        char id[17];
+        snprintf(id, sizeof(id), "%016llx", static_cast<unsigned long long>(generator()));
+        return id;
+    }
+
+    // Endpoint to configure one of the Greenhouse's settings.
+    Coro::Task setSetting(Rest::Request request, Http::ResponseWriter &response)
+    {
+        // You don't know what the parameter content that you receive is, but you should
+        // try to cast it to some data structure. Here, I cast the settingName to string.
+        auto settingName = request.param(":settingName").as<std::string>();
+
+        string val = "";
+        if (request.hasParam(":value"))
+        {
+            auto value = request.param(":value");
+            val = value.as<string>();
+        }
+
+        int setResponse;
+        uint64_t logged = kNotLogged;
+        {
+            // This is a guard that prevents editing the same value by two concurent threads.
+            // A single setting only needs settingsLock: the routes holding greenhouseLock go on.
+            Guard guard(settingsLock);
+
+            // Setting the Greenhouse's setting to value
+            setResponse = gh.set(settingName, val);
+            if (setResponse == 1)
+            {
+                settingsChanged();
+                if (recording())
+                    logged = recordChange(Audit::settingChanged(actorOf(request), settingName, val));
+            }
+        }
+
+        // Sending some confirmation or error response.
+        if (setResponse == 1)
+        {
+            if (!co_await durable(request, logged))
+            {
+                sendError(response, ErrorHTTP(Http::Code::Internal_Server_Error, settingName + " was set to " + val + " but could not be written to the audit log"));
+                co_return;
+            }
+            Reply::Builder out;
+            out.append(settingName).append(" was set to ").append(val);
+            sendText(response, Http::Code::Ok, out, false);
+        }
+        else
+        {
+            sendError(response, ErrorHTTP(Http::Code::Not_Found, settingName + " was not found and or '" + val + "' was not a valid value "));
+        }
+    }
+
+    Coro::Task addPreconfiguration(Rest::Request request, Http::ResponseWriter &response){
+        // You don't know what the parameter content that you receive is, but you should
+        // try to cast it to some data structure. Here, I cast the settingName to string.
+        string requestSettings = request.body();
+        Preconfiguration p;
+
+        json j = json::parse(requestSettings);
+
+        int setResponse;
+        uint64_t logged = kNotLogged;
+        {
+            // This is a guard that prevents editing the same value by two concurent threads.
+            Guard guard(greenhouseLock);
+
+            from_json(j, p);
+
+            // Setting the Greenhouse's setting to value
+            setResponse = gh.addPreconfiguration(p);
+            if (setResponse == 1 && recording())
+            {
+                Guard settings(settingsLock);
+                logged = recordChange(Audit::preconfigurationAdded(actorOf(request), p));
+            }
+        }
+
+        // Sending some confirmation or error response.
+        if (setResponse == 1) {
+            if (!co_await durable(request, logged))
+            {
+                sendError(response, ErrorHTTP(Http::Code::Internal_Server_Error, "Added a new preconfiguration but could not write it to the audit log"));
+                co_return;
+            }
+            response.send(Http::Code::Ok, "Added a new preconfiguration");
+        }
+        else if (setResponse == -2) {
+            sendError(response, ErrorHTTP(Http::Code::Bad_Request, "The plant type is longer than " + std::to_string(Greenhouse::kMaxPlantTypeLength) + " characters"));
+        }
+        else {
+            sendError(response, ErrorHTTP(Http::Code::Not_Found, "Error occured. Could not add a new preconfiguration"));
+        }
+
+    }
+
+    Coro::Task addPlant(Rest::Request request, Http::ResponseWriter &response)
+    {
+        // You don't know what the parameter content that you receive is, but you should
+        // try to cast it to some data structure. Here, I cast the settingName to string.
+        string requestSettings = request.body();
+
+        json j = json::parse(requestSettings);
+
+        // Only the plant type is required. The year defaults to the year after the last season,
+        // the other fields of the season are unknown unless given.
+        Season season;
+        j.at("plantType").get_to(season.plantType);
+        long long year = 0, zone = 0;
+        if (j.contains("year") && (!j["year"].is_number_integer() || (year = j["year"].get<long long>()) < INT_MIN || year > INT_MAX))
+        {
+            sendError(response, ErrorHTTP(Http::Code::Bad_Request, "year must be an integer"));
+            co_return;
+        }
+        if (j.contains("zone") && (!j["zone"].is_number_integer() || (zone = j["zone"].get<long long>()) < 0 || zone > UINT16_MAX))
+        {
+            sendError(response, ErrorHTTP(Http::Code::Bad_Request, "zone must be an integer from 0 to 65535"));
+            co_return;
+        }
+        season.year = static_cast<int>(year);
+        season.zone = static_cast<uint16_t>(zone);
+        if (j.contains("yield") && !j["yield"].is_null())
+            j.at("yield").get_to(season.yield);
+        if ((j.contains("seasonStart") && (!j["seasonStart"].is_string() || !SoilHistory::parseDate(j["seasonStart"].get<std::string>(), season.seasonStart))) ||
+            (j.contains("seasonEnd") && (!j["seasonEnd"].is_string() || !SoilHistory::parseDate(j["seasonEnd"].get<std::string>(), season.seasonEnd))))
+        {
+            sendError(response, ErrorHTTP(Http::Code::Bad_Request, "seasonStart and seasonEnd must be dates (YYYY-MM-DD)"));
+            co_return;
+        }
+
+        int setResponse;
+        uint64_t logged = kNotLogged;
+        {
+            // This is a guard that prevents editing the same value by two concurent threads.
+            Guard guard(greenhouseLock);
+
+            // Setting the Greenhouse's setting to value
+            setResponse = gh.addSeason(season);
+            if (setResponse == 1 && recording())
+            {
+                Guard settings(settingsLock);
+                logged = recordChange(Audit::plantAdded(actorOf(request), season));
+            }
+        }
+
+        // Sending some confirmation or error response.
+        if (setResponse == 1)
+        {
+            if (!co_await durable(request, logged))
+            {
+                sendError(response, ErrorHTTP(Http::Code::Internal_Server_Error, "Added a new plant to soil history but could not write it to the audit log"));
+                co_return;
+            }
+            response.send(Http::Code::Ok, "Added a new plant to soil history");
+        }
+        else
+        {
+            sendError(response, ErrorHTTP(Http::Code::Bad_Request, "Could not add a new plant to soil history: the year is before the last season, the season ends before it starts or the yield is impossible"));
+        }
+    }
+
+    // Mean yield per plant over the seasons with a known yield, in all zones or in ?zone=<n>.
+    void getYieldStatistics(const Rest::Request &request, Http::ResponseWriter response)
+    {
+        long long zone = -1;
+        if (!queryNumber(request, "zone", zone) || zone < -1 || zone > UINT16_MAX)
+        {
+            sendError(response, ErrorHTTP(Http::Code::Bad_Request, "zone must be an integer from 0 to 65535"));
+            return;
+        }
+
+        Reply::Builder out;
+        {
+            Guard guard(greenhouseLock);
+            gh.writeYieldStatistics(static_cast<int>(zone), out);
+        }
+        sendText(response, Http::Code::Ok, out);
+    }
+
+    // Latest sensor readings, {"zone":n,"temperature":..,"humidity":..,"luminosity":..,"carbonDioxide":..}
+    // or an array of them. A missing setting keeps its previous reading. Nothing is stored
+    // unless every reading is valid.
+    void addTelemetry(const Rest::Request &request, Http::ResponseWriter response)
+    {
+        std::vector<std::pair<size_t, Climate::Controller::Values>> readings;
+        try
+        {
+            json j = json::parse(request.body());
+            if (!j.is_array())
+                j = json::array({j});
+            for (const json &item : j)
+            {
+                long long zone = item.at("zone").get<long long>();
+                if (zone < 0 || zone >= static_cast<long long>(tuning.climate.maxZones))
+                    throw std::out_of_range("zone");
+                Climate::Controller::Values values;
+                for (size_t i = 0; i < Climate::kSettings; i++)
+                    values[i] = item.contains(Climate::kSettingNames[i]) ? item[Climate::kSettingNames[i]].get<double>() : NAN;
+                readings.emplace_back(static_cast<size_t>(zone), values);
+            }
+        }
+        catch (const std::exception &)
+        {
+            sendError(response, ErrorHTTP(Http::Code::Bad_Request, "telemetry must be readings with a zone from 0 to " + to_string(tuning.climate.maxZones - 1) + " and numeric values"));
+            return;
+        }
+
+        // The setpoints are read once for the whole batch, and only if a rule compares with them.
+        Climate::Controller::Values setpoints;
+        setpoints.fill(NAN);
+        if (tuning.alerts.enabled && alerts.usesSetpoints())
+            setpoints = this->setpoints();
+
+        std::vector<Alerts::Event> events;
+        std::shared_ptr<const Climate::Controller::Publish> publish = std::atomic_load(&alertPublisher);
+        for (const auto &reading : readings)
+        {
+            Climate::Controller::Values latest;
+            climate.report(reading.first, reading.second, &latest);
+            health.zoneReported(reading.first, latest);
+            if (!tuning.alerts.enabled)
+                continue;
+            events.clear();
+            alerts.check(reading.first, latest, setpoints, events);
+            for (const Alerts::Event &event : events)
+            {
+                if (!publish)
+                    break;
+                std::string message;
+                Reply::Builder out(message);
+                alerts.writeEvent(event, latest, out);
+                (*publish)(tuning.alerts.topic, message);
+            }
+        }
+        response.send(Http::Code::Ok, "Telemetry received");
+    }
+
+    // Health score of the greenhouse against the ideal parameters, with the ?worst=<n> (default 10)
+    // zones that score lowest.
+    void getHealthScore(const Rest::Request &request, Http::ResponseWriter response)
+    {
+        long long worst = 10;
+        if (!queryNumber(request, "worst", worst) || worst < 0 || worst > kHealthMaxWorst)
+        {
+            sendError(response, ErrorHTTP(Http::Code::Bad_Request, "worst must be from 0 to " + to_string(kHealthMaxWorst)));
+            return;
+        }
+        Reply::Builder out;
+        health.write(static_cast<size_t>(worst), out);
+        sendText(response, Http::Code::Ok, out);
+    }
+
+    // Changes made to the greenhouse, oldest first: GET /audit?from=&to=&after=&limit=, from and to
+    // in seconds since the epoch, after the sequence to continue after (the "next" of the previous page).
+    void getAudit(const Rest::Request &request, Http::ResponseWriter response)
+    {
+        if (!audit.enabled())
+        {
+            sendError(response, ErrorHTTP(Http::Code::Not_Found, "The audit log is turned off"));
+            return;
+        }
+        long long from = 0, to = kAuditMaxSeconds, after = -1, limit = kAuditPage;
+        if (!queryNumber(request, "from", from) || !queryNumber(request, "to", to) || !queryNumber(request, "after", after) ||
+            !queryNumber(request, "limit", limit) || from < 0 || from > kAuditMaxSeconds || to < 0 || to > kAuditMaxSeconds || after < -1 ||
+            limit < 1 || limit > static_cast<long long>(kAuditMaxPage))
+        {
+            sendError(response, ErrorHTTP(Http::Code::Bad_Request, "from and to must be seconds since the epoch, after a sequence and limit from 1 to " + to_string(kAuditMaxPage)));
+            return;
+        }
+        Reply::Builder out;
+        audit.write(from * 1000000, to * 1000000 + 999999, after, static_cast<size_t>(limit), out);
+        sendText(response, Http::Code::Ok, out);
+    }
+
+    // Role of the server in the replication and how far it is.
+    void getReplication(const Rest::Request &request, Http::ResponseWriter response)
+    {
+        Reply::Builder out;
+        if (readOnly)
+            follower.writeStatus(out);
+        else
+            leader.writeStatus(out);
+        sendText(response, Http::Code::Ok, out);
+    }
+
+    // Makes a follower the leader: it stops following, accepts changes and followers, and
+    // drives the actuators. For fail over, once the old leader is gone.
+    void promote(const Rest::Request &request, Http::ResponseWriter response)
+    {
+        // Only one of concurrent promotions gets past this, so the follower is stopped once.
+        bool expected = true;
+        bool promoted;
+        {
+            Guard guard(greenhouseLock);
+            promoted = readOnly.compare_exchange_strong(expected, false);
+        }
+        if (!promoted)
+        {
+            sendError(response, ErrorHTTP(Http::Code::Bad_Request, "This server is already the leader"));
+            return;
+        }
+        follower.stop();
+        std::string failure;
+        try
+        {
+            startLeading();
+        }
+        catch (const std::exception &e)
+        {
+            failure = e.what();
+        }
+        auto publish = std::atomic_load(&alertPublisher);
+        if (publish)
+            startClimateControl(*publish);
+        if (!failure.empty())
+        {
+            sendError(response, ErrorHTTP(Http::Code::Internal_Server_Error, "Promoted to leader, but the replication server did not start: " + failure));
+            return;
+        }
+        Reply::Builder out;
+        out.append("Promoted to leader");
+        sendText(response, Http::Code::Ok, out);
+    }
+
+    // The alerts raised by the telemetry and not cleared yet.
+    void getAlerts(const Rest::Request &request, Http::ResponseWriter response)
+    {
+        Reply::Builder out;
+        alerts.writeActive(out);
+        sendText(response, Http::Code::Ok, out);
+    }
+
+    // Latest readings of a zone and the commands the control loop computed from them.
+    void getTelemetry(const Rest::Request &request, Http::ResponseWriter response)
+    {
+        auto text = request.param(":zone").as<std::string>();
+        long long zone = -1;
+        auto result = std::from_chars(text.data(), text.data() + text.size(), zone);
+        Reply::Builder out;
+        if (result.ec != std::errc() || result.ptr != text.data() + text.size() || zone < 0 || !climate.writeZone(static_cast<size_t>(zone), out))
+        {
+            sendError(response, ErrorHTTP(Http::Code::Not_Found, "zone " + text + " has not reported any telemetry"));
+            return;
+        }
+        sendText(response, Http::Code::Ok, out);
+    }
+
+    // Without parameters the whole history, as a JSON array of plant types.
+    // ?after=<index>&limit=<n> and ?from=<year>&to=<year> return one page of seasons instead:
+    //   {"items":[{"index":..,"plantType":..,"year":..},...],"next":<index to pass as after, or null>}
+    // ?stream=1 sends the whole history (or the from/to years) as a chunked response, page by page.
+    void getSoilHistory(const Rest::Request &request, Http::ResponseWriter response)
+    {
+        const auto &query = request.query();
+        if (!query.has("after") && !query.has("limit") && !query.has("from") && !query.has("to") && !query.has("stream"))
+        {
+            std::shared_ptr<const Compression::Body> body;
+            {
+                Guard guard(greenhouseLock);
+                body = soilHistoryBody.get(gh.soilHistoryVersion(), [this](std::string &plain)
+                                           { plain = gh.soilHistoryToJSON(); });
+            }
+            sendBody(request, response, *body);
+            return;
+        }
+
+        long long after = -1, limit = kSoilHistoryPage, from = INT_MIN, to = INT_MAX;
+        if (!queryNumber(request, "after", after) || !queryNumber(request, "limit", limit) ||
+            !queryNumber(request, "from", from) || !queryNumber(request, "to", to) ||
+            after < -1 || after >= LLONG_MAX || limit < 1 || limit > static_cast<long long>(kSoilHistoryMaxPage))
+        {
+            sendError(response, ErrorHTTP(Http::Code::Bad_Request, "after, limit (1 to " + to_string(kSoilHistoryMaxPage) + "), from and to must be integers"));
+            return;
+        }
+
+        from = std::max<long long>(from, INT_MIN);
+        to = std::min<long long>(to, INT_MAX);
+
+        if (query.has("stream"))
+        {
+            streamSoilHistory(response, static_cast<int>(from), static_cast<int>(to));
+            return;
+        }
+
+        Reply::Builder out;
+        {
+            Guard guard(greenhouseLock);
+            auto range = gh.soilHistoryRange(static_cast<int>(from), static_cast<int>(to));
+            size_t first = std::min(range.second, std::max(range.first, static_cast<size_t>(after + 1)));
+            size_t last = std::min(range.second, first + static_cast<size_t>(limit));
+
+            out.append("{\"items\":[");
+            gh.writeSoilHistoryPage(first, last, out);
+            out.append("],\"next\":");
+            if (last < range.second)
+                out.append(static_cast<long long>(last - 1));
+            else
+                out.append("null");
+            out.append('}');
+        }
+        sendText(response, Http::Code::Ok, out);
+    }
+
+    // Streams the seasons of [fromYear, toYear] as one JSON array. greenhouseLock is only held while
+    // a page is written, so a long export does not block the other routes. Seasons added meanwhile
+    // do not move the positions taken at the start, a clear does (a follower catching up): then the
+    // stream ends without the closing ']', so the client sees the export failed.
+    void streamSoilHistory(Http::ResponseWriter &response, int fromYear, int toYear)
+    {
+        std::pair<size_t, size_t> range;
+        uint64_t resets;
+        {
+            Guard guard(greenhouseLock);
+            range = gh.soilHistoryRange(fromYear, toYear);
+            resets = gh.soilHistoryResetCount();
+        }
+
+        response.headers().add(textHeaders.server).add(textHeaders.contentType);
+        auto stream = response.stream(Http::Code::Ok);
+        stream << "[";
+        std::string page;
+        bool wrote = false;
+        bool cut = false;
+        for (size_t first = range.first; first < range.second; first += kSoilHistoryMaxPage)
+        {
+            Reply::Builder out(page);
+            {
+                Guard guard(greenhouseLock);
+                if (gh.soilHistoryResetCount() != resets)
+                {
+                    cut = true;
+                    break;
+                }
+                gh.writeSoilHistoryPage(first, std::min(range.second, first + kSoilHistoryMaxPage), out);
+            }
+            if (page.empty())
+                continue;
+            if (wrote)
+                stream << ",";
+            stream << page;
+            stream.flush();
+            wrote = true;
+        }
+        if (!cut)
+            stream << "]";
+        stream.ends();
+    }
+
+    // Follows a change of the settings: rescores them and publishes them in shared memory.
+    // Call it with settingsLock held, which also keeps a single writer on the shared block.
+    void settingsChanged()
+    {
+        health.setpointsChanged(setpoints());
+        if (sharedSettings.isOpen())
+            sharedSettings.publish(gh.readSettings());
+    }
+
+    // True when changes go somewhere: the audit log or the followers.
+    bool recording() const
+    {
+        return audit.enabled() || leader.active();
+    }
+
+    // Sends a change to the followers and logs it, followed by a checkpoint of the settings when
+    // one is due. Call it with settingsLock held, so both get the changes in the order they were made.
+    // Returns the position of the change in the audit log, kNotLogged when it is not in it.
+    uint64_t recordChange(Audit::Event &&event)
+    {
+        if (leader.active())
+            leader.publish(event);
+        uint64_t position = kNotLogged;
+        if (!audit.enabled() || !audit.append(std::move(event), &position))
+            return kNotLogged;
+        if (audit.checkpointDue())
+            audit.append(Audit::checkpoint(gh.getSettings()));
+        return position;
+    }
+
+    // The settings the climate is controlled to, in the order of Climate::kSettingNames, all
+    // from the same version of the settings. Needs no lock.
+    Climate::Controller::Values setpoints()
+    {
+        SharedSettings::Block settings = gh.readSettings();
+        return {settings.temperature, settings.humidity, settings.luminosity, settings.carbonDioxide};
+    }
+
+    // Reads an integer query parameter into value, if present. Returns false when it is not a number.
+    static bool queryNumber(const Rest::Request &request, const char *name, long long &value)
+    {
+        auto text = request.query().get(name);
+        if (!text)
+            return true;
+        const std::string &digits = *text;
+        auto result = std::from_chars(digits.data(), digits.data() + digits.size(), value);
+        return result.ec == std::errc() && result.ptr == digits.data() + digits.size();
+    }
+
+
+    // Setting to get the settings value of one of the configurations of the Greenhouse
+    void getSetting(const Rest::Request &request, Http::ResponseWriter response)
+    {
+        auto settingName = request.param(":settingName").as<std::string>();
+
+        // The settings are read from their block, without greenhouseLock.
+        Reply::Builder out;
+        out.append(settingName).append(" is ");
+
+        if (gh.writeSetting(settingName, out))
+        {
+            sendText(response, Http::Code::Ok, out);
+        }
+        else
+        {
+            sendError(response, ErrorHTTP(Http::Code::Not_Found, settingName + " was not found"));
+        }
+    }
+
+    // The current settings, or with ?at=<seconds since the epoch> the settings at that time, rebuilt
+    // from the audit log.
+    void getCurrentConfiguration(const Rest::Request &request, Http::ResponseWriter response)
+    {
+        if (request.query().has("at"))
+        {
+            getPastConfiguration(request, response);
+            return;
+        }
+
+        Reply::Builder out;
+        gh.writeCurrentConfiguration(out);
+
+        sendText(response, Http::Code::Ok, out);
+    }
+
+    void getPastConfiguration(const Rest::Request &request, Http::ResponseWriter &response)
+    {
+        long long at = 0;
+        if (!queryNumber(request, "at", at) || at < 0 || at > LLONG_MAX / 1000000 - 1)
+        {
+            sendError(response, ErrorHTTP(Http::Code::Bad_Request, "at must be seconds since the epoch"));
+            return;
+        }
+        Audit::Settings settings;
+        if (!audit.enabled() || !audit.settingsAt(at * 1000000 + 999999, settings))
+        {
+            sendError(response, ErrorHTTP(Http::Code::Not_Found, "The audit log has no settings that old"));
+            return;
+        }
+        Reply::Builder out;
+        settings.write(out);
+        sendText(response, Http::Code::Ok, out);
+    }
+
+    void getWaterAmountNeeded(const Rest::Request &request, Http::ResponseWriter response)
+    {
+        Reply::Builder out;
+        gh.writeWaterAmount(out);
+
+        sendText(response, Http::Code::Ok, out);
+    }
+
+    void getIrigationTime(const Rest::Request &request, Http::ResponseWriter response)
+    {
+
+        Guard guard(greenhouseLock);
+
+        Reply::Builder out;
+        gh.writeIrigationTime(out);
+
+        sendText(response, Http::Code::Ok, out);
+    }
+
+    void getPreconfigurations(const Rest::Request &request, Http::ResponseWriter response)
+    {
+        std::shared_ptr<const Compression::Body> body;
+        {
+            Guard guard(greenhouseLock);
+            body = preconfigurationsBody.get(gh.preconfigurationsVersion(), [this](std::string &plain)
+                                             { plain = gh.preconfigurationsToJSON(); });
+        }
+        sendBody(request, response, *body);
+    }
+
+    Coro::Task setPreconfiguration(Rest::Request request, Http::ResponseWriter &response)
+    {
+        // You don't know what the parameter content that you receive is, but you should
+        // try to cast it to some data structure. Here, I cast the settingName to string.
+        int nrConfig = request.param(":value").as<int>();
+
+        int setResponse;
+        uint64_t logged = kNotLogged;
+        {
+            // This is a guard that prevents editing the same value by two concurent threads.
+            // Selecting a preconfiguration reads the preconfigurations and changes the settings.
+            Guard guard(greenhouseLock);
+            Guard settings(settingsLock);
+
+            // Setting the Greenhouse's setting to value
+            setResponse = gh.setPreconfiguration(nrConfig);
+            if (setResponse == 1)
+            {
+                settingsChanged();
+                if (recording())
+                    logged = recordChange(Audit::preconfigurationSelected(actorOf(request), nrConfig, gh.getPreconfiguration(nrConfig)));
+            }
+        }
+
+        // Sending some confirmation or error response.
+        if (setResponse == 1)
+        {
+            if (!co_await durable(request, logged))
+            {
+                sendError(response, ErrorHTTP(Http::Code::Internal_Server_Error, "Configuration " + to_string(nrConfig) + " was applied but could not be written to the audit log"));
+                co_return;
+            }
+            Reply::Builder out;
+            out.append("Configuration ").append(nrConfig).append(" was applied");
+            sendText(response, Http::Code::Ok, out, false);
+        }
+        else
+        {
+            sendError(response, ErrorHTTP(Http::Code::Not_Found, "The preconfiguration " + to_string(nrConfig) + " was not found"));
+        }
+    }
+
+    // Ranked suggestions for the next season: GET /plantType?k=<1..8>&zone=<n>, by default the top 3
+    // for the greenhouse as a whole. suggestedPlant keeps the answer of the original API.
+    void getPlantTypeSuggestion(const Rest::Request &request, Http::ResponseWriter response)
+    {
+        long long k = 3, zone = -1;
+        if (!queryNumber(request, "k", k) || !queryNumber(request, "zone", zone) ||
+            k < 1 || k > static_cast<long long>(RotationModel::kTopK) || zone < -1 || zone > UINT16_MAX)
+        {
+            sendError(response, ErrorHTTP(Http::Code::Bad_Request, "k must be from 1 to " + to_string(RotationModel::kTopK) + " and zone from 0 to 65535"));
+            return;
+        }
+
+        Reply::Builder out;
+        {
+            Guard guard(greenhouseLock);
+            gh.writePlantTypeSuggestions(static_cast<size_t>(k), static_cast<int>(zone), out);
+        }
+        sendText(response, Http::Code::Ok, out);
+    }
+
+    // Default and largest number of seasons in a page of GET /soilHistory.
+    static constexpr long long kSoilHistoryPage = 100;
+    static constexpr size_t kSoilHistoryMaxPage = 1000;
+    // Default and largest number of events in a page of GET /audit.
+    static constexpr long long kAuditPage = 100;
+    static constexpr size_t kAuditMaxPage = 1000;
+    // Latest second of GET /audit whose last microsecond still fits a long long.
+    static constexpr long long kAuditMaxSeconds = (LLONG_MAX - 999999) / 1000000;
+    // Largest number of zones listed by GET /health/score.
+    static constexpr long long kHealthMaxWorst = 1000;
+    // Position of a change that is not in the audit log.
+    static constexpr uint64_t kNotLogged = UINT64_MAX;
+
+    // Headers of the text responses, shared by all of them.
+    struct TextHeaders
+    {
+        std::shared_ptr<Http::Header::Server> server = std::make_shared<Http::Header::Server>("pistache/0.1");
+        std::shared_ptr<Http::Header::ContentType> contentType = std::make_shared<Http::Header::ContentType>(MIME(Text, Plain));
+    } textHeaders;
+
+    // Metrics of this endpoint, exposed at GET /metrics
+    Metrics::Registry metrics;
+    Metrics::CodeCounters &httpErrors;
+    Metrics::Counter &mqttPublishes;
+
+    // Create the lock which prevents concurrent editing of the same variable.
+    // Acquisitions are profiled (GET /metrics/locks) and the wait time is also recorded in greenhouse_lock_wait_seconds.
+    using Lock = Contention::ProfiledMutex;
+    using Guard = std::lock_guard<Lock>;
+    Lock greenhouseLock;
+    // Held while the settings change and while a change is recorded, after greenhouseLock when
+    // both are needed. Reading the settings takes neither.
+    Lock settingsLock;
+
+    // Instance of the Greenhouse model
+    Greenhouse gh;
+
+    // Defining the httpEndpoints (one per shard) and a router.
+    Address address;
+    Tuning::ServerTuning tuning;
+    std::vector<std::shared_ptr<Http::Endpoint>> httpEndpoints;
+
+    // One admission limiter per limited route, created in setupRoutes.
+    std::vector<std::unique_ptr<Admission::Limiter>> limiters;
+
+    // Token buckets of the per client rate limits, shared by all routes.
+    RateLimit::Table rateLimits;
+
+    // Latest bodies of the large JSON responses, with their compressed forms.
+    Compression::BodyCache soilHistoryBody;
+    Compression::BodyCache preconfigurationsBody;
+    std::array<Metrics::Counter *, Compression::kEncodings> compressedResponses;
+
+    // Control loop of the climate and alerts, both fed by POST /telemetry.
+    Climate::Controller climate;
+    Alerts::Engine alerts;
+    Health::Scores health;
+    Audit::Log audit;
+    Replication::Leader leader;
+    Replication::Follower follower;
+    // Runs the handlers of the offloaded routes away from the reactor threads.
+    Offload::Executor offload;
+    // While following, the routes that change the greenhouse are refused.
+    std::atomic<bool> readOnly{false};
+    SharedSettings::Publisher sharedSettings;
+    std::shared_ptr<const Climate::Controller::Publish> alertPublisher;
+    Rest::Router router;
+};
+
+#endif
@@ -0,0 +1,207 @@
+/*
+   Microbenchmarks for the Greenhouse model, without Pistache in the way.
+   Every operation is timed against soil histories and preconfiguration lists of growing size
+   (10, 100, ... up to --max-size), so that the cost of an operation as the data grows is
+   visible at a glance.
+
+   Usage:
+     ./bin/greenhouse_microbench [--max-size 1000000] [--min-time 0.2] [--csv 1]
+
+   --max-size goes up to 10000000. At that size the fixtures need a few GB of memory.
+*/
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "./greenhouse.hpp"
+#include "./climate_control.hpp"
+#include "./loadgen.hpp"
+
+namespace Microbench
+{
+    struct Options
+    {
+        size_t maxSize = 1000000;
+        double minTime = 0.2;
+        bool csv = false;
+    };
+
+    Options parseOptions(int argc, char *argv[])
+    {
+        Options options;
+        for (int i = 1; i + 1 < argc; i += 2)
+        {
+            std::string name = argv[i];
+            std::string value = argv[i + 1];
+            if (name == "--max-size")
+                options.maxSize = std::stoull(value);
+            else if (name == "--min-time")
+                options.minTime = std::stod(value);
+            else if (name == "--csv")
+                options.csv = value != "0";
+            else
+                throw std::invalid_argument("unknown option " + name);
+        }
+        return options;
+    }
+
+    // Keeps the compiler from dropping the work of an operation whose result is unused.
+    volatile size_t sink;
+
+    // Metrics of the climate controllers, which want a registry.
+    Metrics::Registry metrics;
+
+    // A climate controller with min(size, 65536) zones that all reported, controlled in one tick.
+    // Its thread is not started and nothing is published, so a tick is only the control step.
+    std::shared_ptr<Climate::Controller> climateFixture(size_t size)
+    {
+        auto controller = std::make_shared<Climate::Controller>(metrics);
+        Climate::Config config;
+        config.enabled = false;
+        config.maxZones = config.zonesPerTick = std::min<size_t>(size, 65536);
+        config.staleAfter = 1e9;
+        controller->configure(config);
+        for (size_t zone = 0; zone < config.maxZones; zone++)
+            controller->report(zone, {18.0 + zone % 8, 50, 40, 600});
+        controller->start([](Climate::Controller::Values &setpoints)
+                          { setpoints = {22, 60, 50, 800}; },
+                          nullptr);
+        return controller;
+    }
+
+    // Writes data files of the given size in the formats Greenhouse reads.
+    // The history cycles through a small set of plants, like a real crop rotation;
+    // every preconfiguration has its own plant type.
+    void writeFixture(const std::string &historyFile, const std::string &preconfigurationsFile, size_t size)
+    {
+        static const char *plants[] = {"rosie", "castravete", "ardei", "salata", "varza", "morcov", "ceapa", "dovlecel"};
+        LoadGen::Rng rng(size);
+
+        std::ofstream history(historyFile);
+        history << size << "\n";
+        for (size_t i = 0; i < size; i++)
+            history << plants[rng.below(8)] << "\n";
+
+        std::ofstream preconfigurations(preconfigurationsFile);
+        preconfigurations << size << "\n";
+        for (size_t i = 0; i < size; i++)
+            preconfigurations << 40 + rng.below(40) << " " << 50 + rng.below(40) << " " << 15 + rng.below(15) << " "
+                              << rng.below(10) << " plant" << i << "\n";
+    }
+
+    struct Operation
+    {
+        std::string name;
+        std::function<void(Greenhouse &)> run;
+    };
+
+    // Runs the operation until min-time has passed (at least once) and returns ns per call.
+    double measure(Greenhouse &gh, const Operation &op, double minTime, uint64_t &iterations)
+    {
+        uint64_t budget = static_cast<uint64_t>(minTime * 1e9);
+        uint64_t start = Metrics::nowNs();
+        uint64_t elapsed = 0;
+        uint64_t batch = 1;
+        iterations = 0;
+        while (elapsed < budget)
+        {
+            for (uint64_t i = 0; i < batch; i++)
+                op.run(gh);
+            iterations += batch;
+            elapsed = Metrics::nowNs() - start;
+            if (batch < (1u << 20))
+                batch *= 2;
+        }
+        return static_cast<double>(elapsed) / iterations;
+    }
+
+    // The operations, in the order they run for each size. The ones that make the data grow
+    // (addPlant) come last so they do not change the size seen by the others. The duplicate
+    // preconfiguration is the last one of the fixture, so looking it up scans the whole list.
+    std::vector<Operation> operations(size_t size)
+    {
+        Preconfiguration duplicate{50, 60, 20, 3, "plant" + std::to_string(size - 1)};
+        std::shared_ptr<Climate::Controller> climate = climateFixture(size);
+        return {
+            {"set temperature", [](Greenhouse &gh)
+             { sink = gh.set("temperature", "25"); }},
+            {"set irigationTime", [](Greenhouse &gh)
+             { sink = gh.set("irigationTime", "2021-05-25-07:00:00"); }},
+            {"get temperature", [](Greenhouse &gh)
+             { sink = gh.get("temperature").size(); }},
+            {"get plantType", [](Greenhouse &gh)
+             { sink = gh.get("plantType").size(); }},
+            {"getCurrentConfiguration", [](Greenhouse &gh)
+             { sink = gh.getCurrentConfiguration().size(); }},
+            {"calculateWaterAmount", [](Greenhouse &gh)
+             { sink = gh.calculateWaterAmount().size(); }},
+            {"setPreconfiguration", [](Greenhouse &gh)
+             { sink = gh.setPreconfiguration(0); }},
+            {"getPlantTypeSuggestion", [](Greenhouse &gh)
+             { sink = gh.getPlantTypeSuggestion().size(); }},
+            {"soilHistoryToJSON", [](Greenhouse &gh)
+             { sink = gh.soilHistoryToJSON().size(); }},
+            {"preconfigurationsToJSON", [](Greenhouse &gh)
+             { sink = gh.preconfigurationsToJSON().size(); }},
+            {"climate control tick", [climate](Greenhouse &)
+             { climate->tick(Metrics::nowNs()); sink = 1; }},
+            {"addPreconfiguration (duplicate)", [duplicate](Greenhouse &gh)
+             { sink = gh.addPreconfiguration(duplicate); }},
+            {"addPlant", [](Greenhouse &gh)
+             { sink = gh.addPlant("rosie"); }},
+        };
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    Microbench::Options options;
+    try
+    {
+        options = Microbench::parseOptions(argc, argv);
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    std::string prefix = "/tmp/greenhouse_microbench_" + std::to_string(getpid());
+    std::string historyFile = prefix + "_soil_history.txt";
+    std::string preconfigurationsFile = prefix + "_preconfigurations.txt";
+
+    if (options.csv)
+        printf("operation,size,iterations,ns_per_op\n");
+    else
+        printf("%-34s %10s %12s %16s\n", "operation", "size", "iterations", "ns/op");
+
+    for (size_t size = 10; size <= options.maxSize; size *= 10)
+    {
+        auto ops = Microbench::operations(size);
+        Microbench::writeFixture(historyFile, preconfigurationsFile, size);
+        std::unique_ptr<Greenhouse> gh(new Greenhouse(historyFile, preconfigurationsFile));
+
+        for (const auto &op : ops)
+        {
+            uint64_t iterations;
+            double ns = Microbench::measure(*gh, op, options.minTime, iterations);
+            if (options.csv)
+                printf("%s,%zu,%llu,%.1f\n", op.name.c_str(), size, (unsigned long long)iterations, ns);
+            else
+                printf("%-34s %10zu %12llu %16.1f\n", op.name.c_str(), size, (unsigned long long)iterations, ns);
+            fflush(stdout);
+        }
+    }
+
+    unlink(historyFile.c_str());
+    unlink(preconfigurationsFile.c_str());
+    return 0;
+}
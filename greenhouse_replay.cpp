@@ -0,0 +1,527 @@
+/*
+   Replay load harness driven by buffers.json.
+   Every input and output buffer described for the fuzzer is turned into requests: valid ones
+   (tokens generated from the regex-rule) and boundary ones (empty tokens, tokens of exactly
+   byte-size bytes, tokens one byte over, truncated JSON). The requests are replayed at a fixed
+   target rate against a running server and the latency and status distribution is reported per
+   buffer and kind.
+
+   Usage:
+     ./bin/greenhouse_replay [--buffers buffers.json] [--host 127.0.0.1] [--port 9080] [--rate 500]
+                             [--duration 10] [--connections 8] [--boundary-ratio 0.2] [--seed 1]
+
+   Input buffers are sent as POST, output buffers as GET. The schedule is open-loop: latency is
+   measured from the time a request was due, so a stalled server cannot hide behind its own slowness.
+*/
+
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "./json.hpp"
+#include "./http_client.hpp"
+#include "./loadgen.hpp"
+
+using json = nlohmann::json;
+
+using namespace std;
+
+namespace Replay
+{
+    // Generates strings matching the simple regular expressions used in buffers.json:
+    // literals, escapes, '.', character classes with ranges and the *, +, ?, {n}, {n,m} quantifiers.
+    class RegexGenerator
+    {
+    public:
+        explicit RegexGenerator(const string &regex)
+        {
+            size_t i = 0;
+            while (i < regex.size())
+            {
+                Atom atom;
+                char c = regex[i++];
+                if (c == '[')
+                    i = parseClass(regex, i, atom.chars);
+                else if (c == '.')
+                    atom.chars = alphabet();
+                else if (c == '\\' && i < regex.size())
+                    atom.chars = string(1, regex[i++]);
+                else
+                    atom.chars = string(1, c);
+                i = parseQuantifier(regex, i, atom);
+                atoms.push_back(atom);
+            }
+        }
+
+        bool empty() const
+        {
+            return atoms.empty();
+        }
+
+        // True when the expression only accepts digits.
+        bool numeric() const
+        {
+            for (const Atom &atom : atoms)
+                if (atom.chars.find_first_not_of("0123456789") != string::npos)
+                    return false;
+            return !atoms.empty();
+        }
+
+        // Shortest string the expression accepts.
+        size_t minLength() const
+        {
+            size_t length = 0;
+            for (const Atom &atom : atoms)
+                length += atom.min;
+            return length;
+        }
+
+        // A matching string as close as possible to the requested length.
+        string generate(LoadGen::Rng &rng, size_t length) const
+        {
+            size_t extra = length > minLength() ? length - minLength() : 0;
+            string result;
+            for (const Atom &atom : atoms)
+            {
+                size_t room = atom.max - atom.min;
+                size_t count = atom.min + std::min(room, extra);
+                extra -= count - atom.min;
+                for (size_t k = 0; k < count; k++)
+                    result += atom.chars[rng.below(atom.chars.size())];
+            }
+            return result;
+        }
+
+        // Characters safe to put in a URL path, used for '.' and for tokens without a rule.
+        static string alphabet()
+        {
+            return "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+        }
+
+    private:
+        struct Atom
+        {
+            string chars;
+            size_t min = 1;
+            size_t max = 1;
+        };
+
+        static size_t parseClass(const string &regex, size_t i, string &chars)
+        {
+            while (i < regex.size() && regex[i] != ']')
+            {
+                char from = regex[i++];
+                if (from == '\\' && i < regex.size())
+                    from = regex[i++];
+                if (i + 1 < regex.size() && regex[i] == '-' && regex[i + 1] != ']')
+                {
+                    char to = regex[i + 1];
+                    i += 2;
+                    for (int ch = from; ch <= to; ch++)
+                        chars += static_cast<char>(ch);
+                }
+                else
+                    chars += from;
+            }
+            if (i >= regex.size())
+                throw invalid_argument("unterminated character class in " + regex);
+            return i + 1;
+        }
+
+        static size_t parseQuantifier(const string &regex, size_t i, Atom &atom)
+        {
+            if (i >= regex.size())
+                return i;
+            switch (regex[i])
+            {
+            case '*':
+                atom.min = 0;
+                atom.max = SIZE_MAX / 2;
+                return i + 1;
+            case '+':
+                atom.min = 1;
+                atom.max = SIZE_MAX / 2;
+                return i + 1;
+            case '?':
+                atom.min = 0;
+                atom.max = 1;
+                return i + 1;
+            case '{':
+            {
+                size_t close = regex.find('}', i);
+                if (close == string::npos)
+                    throw invalid_argument("unterminated quantifier in " + regex);
+                string range = regex.substr(i + 1, close - i - 1);
+                size_t comma = range.find(',');
+                atom.min = stoul(range.substr(0, comma));
+                if (comma == string::npos)
+                    atom.max = atom.min;
+                else if (comma + 1 == range.size())
+                    atom.max = SIZE_MAX / 2;
+                else
+                    atom.max = stoul(range.substr(comma + 1));
+                return close + 1;
+            }
+            default:
+                return i;
+            }
+        }
+
+        vector<Atom> atoms;
+    };
+
+    enum Kind
+    {
+        Valid,
+        Boundary
+    };
+
+    struct Request
+    {
+        size_t target;
+        Kind kind;
+        string method;
+        string path;
+        string body;
+    };
+
+    // Latency and status distribution of one (buffer, kind) pair.
+    struct Target
+    {
+        string name;
+        Metrics::Histogram latency;
+        std::map<int, std::atomic<uint64_t>> statuses;
+        std::atomic<uint64_t> failures{0};
+    };
+
+    struct Token
+    {
+        string type;
+        size_t byteSize;
+        bool optional;
+        RegexGenerator rule;
+    };
+
+    struct Buffer
+    {
+        string label;
+        string method;
+        string path;
+        string delimiter;
+        vector<Token> tokens;
+    };
+
+    // "http://127.0.0.1:9080/settings" -> "/settings"
+    string pathOf(const string &prefix)
+    {
+        size_t scheme = prefix.find("://");
+        size_t start = prefix.find('/', scheme == string::npos ? 0 : scheme + 3);
+        return start == string::npos ? "/" : prefix.substr(start);
+    }
+
+    vector<Buffer> loadBuffers(const string &file)
+    {
+        ifstream fin(file);
+        if (!fin)
+            throw runtime_error("cannot open " + file);
+        json description = json::parse(fin);
+
+        vector<Buffer> buffers;
+        for (const char *section : {"input-buffers", "output-buffers"})
+        {
+            if (!description.contains(section))
+                continue;
+            for (auto &entry : description[section].items())
+            {
+                const json &b = entry.value();
+                Buffer buffer;
+                buffer.method = string(section) == "input-buffers" ? "POST" : "GET";
+                buffer.path = pathOf(b.at("prefix").get<string>());
+                buffer.label = string(section).substr(0, string(section).find('-')) + " " + entry.key() + " " + buffer.method + " " + buffer.path;
+                buffer.delimiter = b.value("token-delimitators", "");
+                for (const json &t : b.at("buffer-tokens"))
+                    buffer.tokens.push_back(Token{t.value("token-type", "string"), t.value("byte-size", 256u),
+                                                  t.value("optional", false), RegexGenerator(t.value("regex-rule", ""))});
+                buffers.push_back(buffer);
+            }
+        }
+        return buffers;
+    }
+
+    // The JSON tokens have no schema in buffers.json; these are the bodies the routes expect.
+    string jsonBody(const string &path, const string &plantType)
+    {
+        json body;
+        if (path == "/preconfigurations")
+            body = {{"luminosity", 50}, {"humidity", 60}, {"temperature", 22}, {"carbonDioxide", 3}, {"plantType", plantType}};
+        else
+            body = {{"plantType", plantType}};
+        return body.dump();
+    }
+
+    // JSON body padded (through plantType) to exactly the given size, when the fixed part fits.
+    string jsonBodyOfSize(const string &path, size_t size)
+    {
+        size_t fixed = jsonBody(path, "").size();
+        return jsonBody(path, string(size > fixed ? size - fixed : 0, 'x'));
+    }
+
+    // Token value for a path segment, as the fuzzer would produce it.
+    string pathToken(const Token &token, LoadGen::Rng &rng, size_t length)
+    {
+        if (token.rule.empty())
+            return length == 0 ? "" : RegexGenerator("[a-zA-Z0-9]*").generate(rng, length);
+        return token.rule.generate(rng, length);
+    }
+
+    // Joins the prefix and the path tokens with the buffer's delimiter (or '/', when it has none).
+    string joinPath(const Buffer &buffer, const vector<string> &segments)
+    {
+        string path = buffer.path;
+        string delimiter = buffer.delimiter.empty() ? "/" : buffer.delimiter;
+        for (const string &segment : segments)
+        {
+            if (segment.empty())
+                continue;
+            if (path.empty() || path.back() != '/')
+                path += delimiter;
+            path += segment;
+        }
+        return path;
+    }
+
+    // Longest numeric token of a valid request: 9 digits always fit the int the server parses
+    // them into, longer ones are left to the boundary requests.
+    const size_t kMaxValidDigits = 9;
+
+    // One valid request for the buffer: path tokens of a typical length, JSON bodies well formed.
+    Request validRequest(const Buffer &buffer, size_t target, LoadGen::Rng &rng)
+    {
+        Request request{target, Valid, buffer.method, "", ""};
+        vector<string> segments;
+        for (const Token &token : buffer.tokens)
+        {
+            if (token.optional && rng.below(2) == 0)
+                continue;
+            if (token.type == "JSON")
+                request.body = jsonBody(buffer.path, "plant" + to_string(rng.below(100)));
+            else if (!token.rule.empty())
+            {
+                size_t longest = token.rule.numeric() ? kMaxValidDigits : 12;
+                segments.push_back(pathToken(token, rng, std::max<size_t>(token.rule.minLength(), 1 + rng.below(longest))));
+            }
+        }
+        request.path = joinPath(buffer, segments);
+        return request;
+    }
+
+    // Boundary requests for the buffer: every token at 0, byte-size and byte-size + 1 bytes,
+    // plus a truncated body for JSON tokens.
+    vector<Request> boundaryRequests(const Buffer &buffer, size_t target, LoadGen::Rng &rng)
+    {
+        vector<Request> requests;
+        enum Size
+        {
+            Empty,
+            Exact,
+            Over
+        };
+        for (Size variant : {Empty, Exact, Over})
+        {
+            Request request{target, Boundary, buffer.method, "", ""};
+            vector<string> segments;
+            for (const Token &token : buffer.tokens)
+            {
+                size_t size = variant == Empty ? 0 : (variant == Exact ? token.byteSize : token.byteSize + 1);
+                if (token.type == "JSON")
+                    request.body = size == 0 ? "{}" : jsonBodyOfSize(buffer.path, size);
+                else
+                    segments.push_back(pathToken(token, rng, size));
+            }
+            request.path = joinPath(buffer, segments);
+            requests.push_back(request);
+        }
+        for (const Token &token : buffer.tokens)
+        {
+            if (token.type != "JSON")
+                continue;
+            string body = jsonBody(buffer.path, "truncated");
+            requests.push_back(Request{target, Boundary, buffer.method, buffer.path, body.substr(0, body.size() / 2)});
+        }
+        return requests;
+    }
+
+    struct Options
+    {
+        string buffers = "buffers.json";
+        string host = "127.0.0.1";
+        uint16_t port = 9080;
+        double rate = 500;
+        double duration = 10;
+        int connections = 8;
+        double boundaryRatio = 0.2;
+        uint64_t seed = 1;
+    };
+
+    Options parseOptions(int argc, char *argv[])
+    {
+        Options options;
+        for (int i = 1; i + 1 < argc; i += 2)
+        {
+            string name = argv[i];
+            string value = argv[i + 1];
+            if (name == "--buffers")
+                options.buffers = value;
+            else if (name == "--host")
+                options.host = value;
+            else if (name == "--port")
+                options.port = static_cast<uint16_t>(stoi(value));
+            else if (name == "--rate")
+                options.rate = stod(value);
+            else if (name == "--duration")
+                options.duration = stod(value);
+            else if (name == "--connections")
+                options.connections = stoi(value);
+            else if (name == "--boundary-ratio")
+                options.boundaryRatio = stod(value);
+            else if (name == "--seed")
+                options.seed = stoull(value);
+            else
+                throw invalid_argument("unknown option " + name);
+        }
+        if (options.rate <= 0 || options.connections <= 0)
+            throw invalid_argument("--rate and --connections must be positive");
+        return options;
+    }
+
+    void report(const vector<unique_ptr<Target>> &targets, double seconds)
+    {
+        printf("%-58s %9s %9s %9s %9s %9s %10s %10s %10s\n", "buffer", "requests", "2xx", "4xx", "5xx", "failed", "p50 us", "p99 us", "p999 us");
+        Metrics::Snapshot total;
+        for (const auto &target : targets)
+        {
+            Metrics::Snapshot s = target->latency.snapshot();
+            uint64_t classes[6] = {0};
+            for (const auto &status : target->statuses)
+                classes[std::min(status.first / 100, 5)] += status.second.load();
+            printf("%-58s %9llu %9llu %9llu %9llu %9llu %10.1f %10.1f %10.1f\n", target->name.c_str(),
+                   (unsigned long long)s.count, (unsigned long long)classes[2], (unsigned long long)classes[4],
+                   (unsigned long long)classes[5], (unsigned long long)target->failures.load(),
+                   LoadGen::micros(s.percentile(0.5)), LoadGen::micros(s.percentile(0.99)), LoadGen::micros(s.percentile(0.999)));
+            LoadGen::merge(total, s);
+        }
+        printf("%-58s %9llu %49s %10.1f %10.1f %10.1f\n", "total", (unsigned long long)total.count, "",
+               LoadGen::micros(total.percentile(0.5)), LoadGen::micros(total.percentile(0.99)), LoadGen::micros(total.percentile(0.999)));
+        printf("achieved rate: %.1f req/s\n", total.count / seconds);
+
+        printf("\nstatus distribution:\n");
+        for (const auto &target : targets)
+        {
+            printf("  %s:", target->name.c_str());
+            for (const auto &status : target->statuses)
+                if (status.second.load() != 0)
+                    printf(" %d=%llu", status.first, (unsigned long long)status.second.load());
+            printf("\n");
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    Replay::Options options;
+    vector<Replay::Buffer> buffers;
+    try
+    {
+        options = Replay::parseOptions(argc, argv);
+        buffers = Replay::loadBuffers(options.buffers);
+    }
+    catch (const std::exception &e)
+    {
+        cerr << e.what() << endl;
+        return 1;
+    }
+
+    // Two targets (valid, boundary) per buffer, and a pool of pre-built requests for each kind,
+    // so nothing but the request itself is built on the sending path.
+    LoadGen::Rng rng(options.seed);
+    vector<unique_ptr<Replay::Target>> targets;
+    vector<Replay::Request> valid, boundary;
+    // Status counters are created up front (599 collects any other code), the workers only look them up.
+    static const int codes[] = {200, 400, 403, 404, 405, 413, 429, 500, 503, 599};
+    for (const Replay::Buffer &buffer : buffers)
+    {
+        for (const char *kind : {"valid", "boundary"})
+        {
+            unique_ptr<Replay::Target> target(new Replay::Target());
+            target->name = buffer.label + " [" + kind + "]";
+            for (int code : codes)
+                target->statuses[code];
+            targets.push_back(std::move(target));
+        }
+        size_t validTarget = targets.size() - 2, boundaryTarget = targets.size() - 1;
+        for (int k = 0; k < 64; k++)
+            valid.push_back(Replay::validRequest(buffer, validTarget, rng));
+        for (const Replay::Request &request : Replay::boundaryRequests(buffer, boundaryTarget, rng))
+            boundary.push_back(request);
+    }
+
+    cout << "Replaying " << buffers.size() << " buffers from " << options.buffers << " at " << options.rate
+         << " req/s against " << options.host << ":" << options.port << endl;
+
+    using Clock = std::chrono::steady_clock;
+    const Clock::time_point start = Clock::now() + std::chrono::milliseconds(100);
+    const uint64_t totalRequests = static_cast<uint64_t>(options.rate * options.duration);
+    std::atomic<uint64_t> nextTicket{0};
+
+    vector<std::thread> workers;
+    for (int c = 0; c < options.connections; c++)
+    {
+        workers.emplace_back([&, c]()
+                             {
+            LoadGen::Rng local(options.seed * 1000 + c + 1);
+            HttpClient::Connection connection(options.host, options.port);
+            for (;;)
+            {
+                uint64_t ticket = nextTicket.fetch_add(1);
+                if (ticket >= totalRequests)
+                    break;
+                Clock::time_point due = start + std::chrono::nanoseconds(static_cast<uint64_t>(ticket * 1e9 / options.rate));
+                std::this_thread::sleep_until(due);
+
+                bool pickBoundary = !boundary.empty() && local.unit() < options.boundaryRatio;
+                const auto &pool = pickBoundary ? boundary : valid;
+                const Replay::Request &request = pool[local.below(pool.size())];
+                Replay::Target &target = *targets[request.target];
+                try
+                {
+                    HttpClient::Response response = connection.request(request.method, request.path, request.body);
+                    uint64_t latency = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - due).count();
+                    target.latency.record(latency);
+                    auto status = target.statuses.find(response.status);
+                    if (status != target.statuses.end())
+                        status->second++;
+                    else
+                        target.statuses.at(599)++;
+                }
+                catch (const std::exception &)
+                {
+                    target.failures++;
+                }
+            } });
+    }
+    for (auto &worker : workers)
+        worker.join();
+
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    Replay::report(targets, elapsed);
+    return 0;
+}
@@ -0,0 +1,68 @@
+/*
+   Example reader of the settings greenhouse_app publishes in shared memory (shared_settings.hpp).
+
+   Usage:
+     ./bin/greenhouse_settings_reader [--name /greenhouse-settings] [--watch 1]
+
+   Prints the settings once, or with --watch every time they change (polling every millisecond,
+   which costs a few nanoseconds per poll and no syscall).
+*/
+
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include "./shared_settings.hpp"
+
+using namespace std;
+
+static void print(const SharedSettings::Block &settings)
+{
+    printf("version %llu: temperature %.2f, humidity %.2f, luminosity %.2f, carbonDioxide %.2f, area %.2f, waterAmount %.2f, plantType %s, irigationTime %s\n",
+           static_cast<unsigned long long>(settings.version), settings.temperature, settings.humidity, settings.luminosity,
+           settings.carbonDioxide, settings.area, settings.waterAmount, settings.plantType, settings.irigationTime);
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    string name = SharedSettings::kDefaultName;
+    bool watch = false;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        string option = argv[i];
+        if (option == "--name")
+            name = argv[i + 1];
+        else if (option == "--watch")
+            watch = string(argv[i + 1]) != "0";
+        else
+        {
+            cerr << "Unknown option " << option << endl;
+            return 1;
+        }
+    }
+
+    SharedSettings::Reader reader;
+    SharedSettings::Block settings;
+    if (!reader.open(name) || !reader.read(settings))
+    {
+        cerr << "No settings published in " << name << ", is greenhouse_app running?" << endl;
+        return 1;
+    }
+    print(settings);
+
+    uint64_t seen = settings.version;
+    while (watch)
+    {
+        this_thread::sleep_for(chrono::milliseconds(1));
+        reader.read(settings);
+        if (settings.version != seen)
+        {
+            seen = settings.version;
+            print(settings);
+        }
+    }
+    return 0;
+}
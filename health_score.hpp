@@ -0,0 +1,196 @@
+/*
+   Health score of the greenhouse: how close its settings and its measured climate are to the
+   ideal parameters (ideal_parameters.txt). Every value scores by its distance from the ideal
+   relative to a tolerance, weighted per setting, from 100 (ideal) to 0 (off by the tolerance or
+   more). The scores are kept up to date as settings change and telemetry arrives: a change
+   rescores one zone (or the settings) and adjusts a running sum and a ranking of the zones, so
+   GET /health/score only reads them.
+*/
+
+#ifndef GREENHOUSE_HEALTH_SCORE_HPP
+#define GREENHOUSE_HEALTH_SCORE_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "./metrics.hpp"
+#include "./response_builder.hpp"
+#include "./climate_control.hpp"
+
+namespace Health
+{
+    using Values = Climate::Controller::Values;
+
+    // In the order of Climate::kSettingNames (temperature, humidity, luminosity, carbonDioxide).
+    struct Ideal
+    {
+        Values value = {NAN, NAN, NAN, NAN};
+        // Distance from the ideal at which a value scores 0.
+        Values tolerance = {5, 15, 20, 2};
+        Values weight = {1, 1, 1, 1};
+    };
+
+    // The file has the ideal luminosity, humidity, temperature and carbon dioxide on its first
+    // line, in the order of preconfigurations.txt; optionally their tolerances on the second line
+    // and their weights on the third. A missing file leaves the ideal unknown, which scores nothing.
+    inline Ideal loadIdeal(const std::string &file)
+    {
+        // Position of each value of a line in Climate::kSettingNames.
+        static const size_t order[Climate::kSettings] = {2, 1, 0, 3};
+        Ideal ideal;
+        std::ifstream in(file);
+        Values *lines[] = {&ideal.value, &ideal.tolerance, &ideal.weight};
+        for (Values *line : lines)
+        {
+            Values read;
+            for (size_t i = 0; i < Climate::kSettings; i++)
+                if (!(in >> read[order[i]]))
+                    return ideal;
+            *line = read;
+        }
+        return ideal;
+    }
+
+    // Score of the values against the ideal, over the values that are known (NaN when none is).
+    inline double score(const Ideal &ideal, const Values &values)
+    {
+        double sum = 0, weights = 0;
+        for (size_t i = 0; i < Climate::kSettings; i++)
+        {
+            if (std::isnan(values[i]) || std::isnan(ideal.value[i]) || ideal.weight[i] <= 0)
+                continue;
+            double off = ideal.tolerance[i] > 0 ? std::fabs(values[i] - ideal.value[i]) / ideal.tolerance[i] : (values[i] == ideal.value[i] ? 0 : 1);
+            sum += ideal.weight[i] * (1 - std::min(1.0, off));
+            weights += ideal.weight[i];
+        }
+        return weights > 0 ? 100 * sum / weights : NAN;
+    }
+
+    class Scores
+    {
+    public:
+        Scores(Metrics::Registry &metrics)
+            : scoreGauge(metrics.gauge("greenhouse_health_score", "", "Health score of the greenhouse, 0 to 100."))
+        {
+        }
+
+        void configure(const Ideal &ideal, size_t zones)
+        {
+            std::lock_guard<std::mutex> guard(scoresLock);
+            this->ideal = ideal;
+            zoneScores.assign(zones, kNoScore);
+            ranking.clear();
+            zoneSum = 0;
+            setpointScore = NAN;
+        }
+
+        void setpointsChanged(const Values &setpoints)
+        {
+            std::lock_guard<std::mutex> guard(scoresLock);
+            setpointScore = score(ideal, setpoints);
+            publish();
+        }
+
+        // Rescores a zone from its latest measurements.
+        void zoneReported(size_t zone, const Values &measured)
+        {
+            double value = score(ideal, measured);
+            int64_t fixed = std::isnan(value) ? kNoScore : static_cast<int64_t>(std::llround(value * kScale));
+            std::lock_guard<std::mutex> guard(scoresLock);
+            if (zone >= zoneScores.size() || zoneScores[zone] == fixed)
+                return;
+            int64_t &current = zoneScores[zone];
+            if (current != kNoScore)
+            {
+                ranking.erase({current, static_cast<uint32_t>(zone)});
+                zoneSum -= current;
+            }
+            current = fixed;
+            if (current != kNoScore)
+            {
+                ranking.insert({current, static_cast<uint32_t>(zone)});
+                zoneSum += current;
+            }
+            publish();
+        }
+
+        // {"score":..,"setpoints":..,"telemetry":..,"worstZones":[{"score":..,"zone":..}],"zones":..}
+        // telemetry is the mean score of the zones that reported, worstZones their worst ones.
+        void write(size_t worst, Reply::Builder &out)
+        {
+            std::lock_guard<std::mutex> guard(scoresLock);
+            out.append('{').appendKey("score", true);
+            writeScore(overall(), out);
+            out.appendKey("setpoints");
+            writeScore(setpointScore, out);
+            out.appendKey("telemetry");
+            writeScore(telemetryScore(), out);
+            out.appendKey("worstZones").append('[');
+            size_t i = 0;
+            for (auto it = ranking.begin(); it != ranking.end() && i < worst; ++it, ++i)
+            {
+                if (i != 0)
+                    out.append(',');
+                out.append('{').appendKey("score", true);
+                writeScore(static_cast<double>(it->first) / kScale, out);
+                out.appendKey("zone").append(static_cast<long long>(it->second)).append('}');
+            }
+            out.append(']');
+            out.appendKey("zones").append(static_cast<long long>(ranking.size())).append('}');
+        }
+
+    private:
+        // Zone scores are summed in fixed point, so adding and removing them never drifts.
+        static constexpr double kScale = 1e6;
+        static constexpr int64_t kNoScore = -1;
+
+        static void writeScore(double value, Reply::Builder &out)
+        {
+            if (std::isnan(value))
+                out.append("null");
+            else
+                out.appendJSON(std::round(value * 100) / 100);
+        }
+
+        double telemetryScore() const
+        {
+            return ranking.empty() ? NAN : static_cast<double>(zoneSum) / kScale / ranking.size();
+        }
+
+        // The settings and the measured climate count the same.
+        double overall() const
+        {
+            double telemetry = telemetryScore();
+            if (std::isnan(telemetry))
+                return setpointScore;
+            if (std::isnan(setpointScore))
+                return telemetry;
+            return (setpointScore + telemetry) / 2;
+        }
+
+        void publish()
+        {
+            double value = overall();
+            scoreGauge.set(std::isnan(value) ? 0 : std::llround(value));
+        }
+
+        Metrics::Gauge &scoreGauge;
+
+        std::mutex scoresLock;
+        Ideal ideal;
+        double setpointScore = NAN;
+        std::vector<int64_t> zoneScores;
+        // Zones that have a score, worst first.
+        std::set<std::pair<int64_t, uint32_t>> ranking;
+        int64_t zoneSum = 0;
+    };
+}
+
+#endif
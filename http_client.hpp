@@ -0,0 +1,250 @@
+/*
+   Minimal blocking HTTP/1.1 client used by the load generators.
+   It only speaks plain IPv4 TCP, which is all the benchmarks need, and keeps one
+   connection open across requests unless told otherwise.
+*/
+
+#ifndef GREENHOUSE_HTTP_CLIENT_HPP
+#define GREENHOUSE_HTTP_CLIENT_HPP
+
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace HttpClient
+{
+    struct Response
+    {
+        int status = 0;
+        std::string body;
+
+        bool ok() const
+        {
+            return status >= 200 && status < 300;
+        }
+    };
+
+    class Connection
+    {
+    public:
+        Connection(const std::string &host, uint16_t port)
+            : host(host == "localhost" ? "127.0.0.1" : host), port(port)
+        {
+        }
+
+        ~Connection()
+        {
+            close();
+        }
+
+        Connection(const Connection &) = delete;
+        Connection &operator=(const Connection &) = delete;
+
+        // Sends one request and waits for the whole response. With keepAlive = false the
+        // connection is closed afterwards, like a client that does not reuse connections.
+        // Throws std::runtime_error when the server cannot be reached or the response is malformed.
+        Response request(const std::string &method, const std::string &path, const std::string &body = "", bool keepAlive = true)
+        {
+            if (fd < 0)
+                connect();
+
+            out.clear();
+            out += method;
+            out += ' ';
+            out += path;
+            out += " HTTP/1.1\r\nHost: ";
+            out += host;
+            out += "\r\n";
+            if (!body.empty())
+            {
+                out += "Content-Type: application/json\r\nContent-Length: ";
+                out += std::to_string(body.size());
+                out += "\r\n";
+            }
+            if (!keepAlive)
+                out += "Connection: close\r\n";
+            out += "\r\n";
+            out += body;
+
+            Response response;
+            try
+            {
+                writeAll(out);
+                readResponse(response);
+            }
+            catch (...)
+            {
+                close();
+                throw;
+            }
+            if (!keepAlive || serverClosing)
+                close();
+            return response;
+        }
+
+        void close()
+        {
+            if (fd >= 0)
+                ::close(fd);
+            fd = -1;
+            in.clear();
+        }
+
+    private:
+        void connect()
+        {
+            fd = ::socket(AF_INET, SOCK_STREAM, 0);
+            if (fd < 0)
+                throw std::runtime_error(std::string("socket: ") + strerror(errno));
+
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+            sockaddr_in addr{};
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(port);
+            if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1)
+            {
+                close();
+                throw std::runtime_error("invalid IPv4 address " + host);
+            }
+            if (::connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0)
+            {
+                std::string error = strerror(errno);
+                close();
+                throw std::runtime_error("connect: " + error);
+            }
+        }
+
+        void writeAll(const std::string &data)
+        {
+            size_t sent = 0;
+            while (sent < data.size())
+            {
+                ssize_t n = ::send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                    throw std::runtime_error(std::string("send: ") + strerror(errno));
+                sent += static_cast<size_t>(n);
+            }
+        }
+
+        // Reads more bytes into the input buffer, throws if the peer closed the connection.
+        void fill()
+        {
+            char chunk[16384];
+            ssize_t n;
+            do
+            {
+                n = ::recv(fd, chunk, sizeof(chunk), 0);
+            } while (n < 0 && errno == EINTR);
+            if (n <= 0)
+                throw std::runtime_error(n == 0 ? "connection closed by server" : std::string("recv: ") + strerror(errno));
+            in.append(chunk, static_cast<size_t>(n));
+        }
+
+        // Returns the next CRLF terminated line (without the CRLF), starting at offset.
+        std::string line(size_t &offset)
+        {
+            size_t end;
+            while ((end = in.find("\r\n", offset)) == std::string::npos)
+                fill();
+            std::string result = in.substr(offset, end - offset);
+            offset = end + 2;
+            return result;
+        }
+
+        void need(size_t bytes)
+        {
+            while (in.size() < bytes)
+                fill();
+        }
+
+        void readResponse(Response &response)
+        {
+            size_t offset = 0;
+            std::string status = line(offset);
+            if (status.compare(0, 5, "HTTP/") != 0 || status.size() < 12)
+                throw std::runtime_error("malformed status line: " + status);
+            response.status = std::atoi(status.c_str() + 9);
+
+            long long contentLength = -1;
+            bool chunked = false;
+            serverClosing = false;
+            for (std::string header = line(offset); !header.empty(); header = line(offset))
+            {
+                size_t colon = header.find(':');
+                if (colon == std::string::npos)
+                    continue;
+                std::string name = header.substr(0, colon);
+                std::string value = header.substr(colon + 1);
+                value.erase(0, value.find_first_not_of(' '));
+                for (char &c : name)
+                    c = static_cast<char>(tolower(c));
+                for (char &c : value)
+                    c = static_cast<char>(tolower(c));
+                if (name == "content-length")
+                    contentLength = std::atoll(value.c_str());
+                else if (name == "transfer-encoding" && value.find("chunked") != std::string::npos)
+                    chunked = true;
+                else if (name == "connection" && value == "close")
+                    serverClosing = true;
+            }
+
+            if (chunked)
+            {
+                for (;;)
+                {
+                    size_t size = std::strtoul(line(offset).c_str(), nullptr, 16);
+                    need(offset + size + 2);
+                    response.body.append(in, offset, size);
+                    offset += size + 2;
+                    if (size == 0)
+                        break;
+                }
+            }
+            else if (contentLength >= 0)
+            {
+                need(offset + static_cast<size_t>(contentLength));
+                response.body.assign(in, offset, static_cast<size_t>(contentLength));
+                offset += static_cast<size_t>(contentLength);
+            }
+            else
+            {
+                // No length: the body runs until the server closes the connection.
+                try
+                {
+                    for (;;)
+                        fill();
+                }
+                catch (const std::runtime_error &)
+                {
+                }
+                response.body.assign(in, offset, std::string::npos);
+                offset = in.size();
+                serverClosing = true;
+            }
+            in.erase(0, offset);
+        }
+
+        std::string host;
+        uint16_t port;
+        int fd = -1;
+        bool serverClosing = false;
+        std::string in;
+        std::string out;
+    };
+}
+
+#endif
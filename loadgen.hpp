@@ -0,0 +1,62 @@
+/*
+   Small pieces shared by the load generators (greenhouse_bench, greenhouse_replay).
+*/
+
+#ifndef GREENHOUSE_LOADGEN_HPP
+#define GREENHOUSE_LOADGEN_HPP
+
+#include <algorithm>
+#include <cstdint>
+
+#include "./metrics.hpp"
+
+namespace LoadGen
+{
+    // xorshift64*, good enough to pick routes and values without any shared state.
+    struct Rng
+    {
+        uint64_t state;
+
+        explicit Rng(uint64_t seed)
+            : state(seed * 0x9E3779B97F4A7C15ull + 1)
+        {
+        }
+
+        uint64_t next()
+        {
+            state ^= state >> 12;
+            state ^= state << 25;
+            state ^= state >> 27;
+            return state * 0x2545F4914F6CDD1Dull;
+        }
+
+        unsigned below(unsigned n)
+        {
+            return static_cast<unsigned>(next() % n);
+        }
+
+        double unit()
+        {
+            return (next() >> 11) * (1.0 / 9007199254740992.0);
+        }
+    };
+
+    inline double micros(uint64_t ns)
+    {
+        return ns / 1000.0;
+    }
+
+    // Adds the samples of one snapshot to another, e.g. to print a total line.
+    inline void merge(Metrics::Snapshot &into, const Metrics::Snapshot &from)
+    {
+        if (into.counts.size() < from.counts.size())
+            into.counts.resize(from.counts.size(), 0);
+        for (unsigned i = 0; i < from.counts.size(); i++)
+            into.counts[i] += from.counts[i];
+        into.count += from.count;
+        into.sum += from.sum;
+        into.max = std::max(into.max, from.max);
+    }
+}
+
+#endif
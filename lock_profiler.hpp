@@ -0,0 +1,333 @@
+/*
+   Contention profiler for the endpoint locks.
+   ProfiledMutex is a drop-in replacement for std::mutex (so the Lock/Guard aliases keep working)
+   that records, for every acquisition, how long the caller waited, how long the lock was held
+   and which route was being served. Samples go into per-thread buffers and are only merged
+   when a report is requested.
+*/
+
+#ifndef GREENHOUSE_LOCK_PROFILER_HPP
+#define GREENHOUSE_LOCK_PROFILER_HPP
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "./json.hpp"
+#include "./metrics.hpp"
+
+namespace Contention
+{
+    // Route names are interned so that the hot path only moves pointers around.
+    inline const char *intern(const std::string &name)
+    {
+        static std::mutex internLock;
+        static std::set<std::string> names;
+        std::lock_guard<std::mutex> guard(internLock);
+        return names.insert(name).first->c_str();
+    }
+
+    // Route currently served by the calling thread.
+    inline const char *&currentRoute()
+    {
+        thread_local const char *route = "unknown";
+        return route;
+    }
+
+    // Tags every lock acquisition made while it is alive with the given route.
+    class RouteScope
+    {
+    public:
+        explicit RouteScope(const char *route)
+            : previous(currentRoute())
+        {
+            currentRoute() = route;
+        }
+
+        ~RouteScope()
+        {
+            currentRoute() = previous;
+        }
+
+    private:
+        const char *previous;
+    };
+
+    // Wraps a route handler so that the locks it takes are attributed to the route.
+    template <typename Handler>
+    auto tagged(const std::string &route, Handler handler)
+    {
+        const char *name = intern(route);
+        return [name, handler](auto request, auto response)
+        {
+            RouteScope scope(name);
+            return handler(request, std::move(response));
+        };
+    }
+
+    // Samples of one thread. Only the owning thread writes, the reporter reads with relaxed loads.
+    class ThreadBuffer
+    {
+    public:
+        static const unsigned kSlots = 64;
+        static const unsigned kRecent = 256;
+
+        struct Slot
+        {
+            std::atomic<const char *> lock{nullptr};
+            std::atomic<const char *> route{nullptr};
+            std::atomic<uint64_t> acquisitions{0};
+            std::atomic<uint64_t> contended{0};
+            std::atomic<uint64_t> waitNs{0};
+            std::atomic<uint64_t> maxWaitNs{0};
+            std::atomic<uint64_t> holdNs{0};
+            std::atomic<uint64_t> maxHoldNs{0};
+        };
+
+        struct Sample
+        {
+            std::atomic<const char *> lock{nullptr};
+            std::atomic<const char *> route{nullptr};
+            std::atomic<uint64_t> waitNs{0};
+            std::atomic<uint64_t> holdNs{0};
+        };
+
+        void record(const char *lock, const char *route, uint64_t waitNs, uint64_t holdNs, bool contended)
+        {
+            Slot *slot = find(lock, route);
+            if (slot != nullptr)
+            {
+                add(slot->acquisitions, 1);
+                add(slot->contended, contended ? 1 : 0);
+                add(slot->waitNs, waitNs);
+                add(slot->holdNs, holdNs);
+                raise(slot->maxWaitNs, waitNs);
+                raise(slot->maxHoldNs, holdNs);
+            }
+
+            uint64_t n = next.load(std::memory_order_relaxed);
+            Sample &sample = recent[n % kRecent];
+            sample.lock.store(lock, std::memory_order_relaxed);
+            sample.route.store(route, std::memory_order_relaxed);
+            sample.waitNs.store(waitNs, std::memory_order_relaxed);
+            sample.holdNs.store(holdNs, std::memory_order_relaxed);
+            next.store(n + 1, std::memory_order_release);
+        }
+
+        const std::array<Slot, kSlots> &getSlots() const
+        {
+            return slots;
+        }
+
+        const std::array<Sample, kRecent> &getRecent() const
+        {
+            return recent;
+        }
+
+    private:
+        // Single writer, so plain load + store is enough and cheaper than fetch_add.
+        static void add(std::atomic<uint64_t> &counter, uint64_t value)
+        {
+            counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+        }
+
+        static void raise(std::atomic<uint64_t> &counter, uint64_t value)
+        {
+            if (value > counter.load(std::memory_order_relaxed))
+                counter.store(value, std::memory_order_relaxed);
+        }
+
+        Slot *find(const char *lock, const char *route)
+        {
+            for (Slot &slot : slots)
+            {
+                const char *slotLock = slot.lock.load(std::memory_order_relaxed);
+                if (slotLock == nullptr)
+                {
+                    // Route first, the reader only looks at slots whose lock is set.
+                    slot.route.store(route, std::memory_order_relaxed);
+                    slot.lock.store(lock, std::memory_order_release);
+                    return &slot;
+                }
+                if (slotLock == lock && slot.route.load(std::memory_order_relaxed) == route)
+                    return &slot;
+            }
+            // More (lock, route) pairs than slots: only the recent samples keep them.
+            return nullptr;
+        }
+
+        std::array<Slot, kSlots> slots;
+        std::array<Sample, kRecent> recent;
+        std::atomic<uint64_t> next{0};
+    };
+
+    // All thread buffers ever created. They are kept after their thread exits, so the report
+    // still covers short-lived threads.
+    class Profiler
+    {
+    public:
+        static Profiler &instance()
+        {
+            static Profiler profiler;
+            return profiler;
+        }
+
+        ThreadBuffer &threadBuffer()
+        {
+            thread_local ThreadBuffer *buffer = registerThread();
+            return *buffer;
+        }
+
+        // Merges every thread buffer into a report, handlers sorted by the total time they spent
+        // waiting for locks.
+        nlohmann::json report() const
+        {
+            struct Totals
+            {
+                uint64_t acquisitions = 0, contended = 0, waitNs = 0, maxWaitNs = 0, holdNs = 0, maxHoldNs = 0;
+            };
+            std::map<std::pair<std::string, std::string>, Totals> perRoute;
+            std::map<std::string, Totals> perLock;
+            std::vector<nlohmann::json> slowest;
+
+            std::lock_guard<std::mutex> guard(buffersLock);
+            for (const auto &buffer : buffers)
+            {
+                for (const auto &slot : buffer->getSlots())
+                {
+                    const char *lock = slot.lock.load(std::memory_order_acquire);
+                    if (lock == nullptr)
+                        break;
+                    const char *route = slot.route.load(std::memory_order_relaxed);
+                    Totals &r = perRoute[{lock, route}];
+                    Totals &l = perLock[lock];
+                    for (Totals *t : {&r, &l})
+                    {
+                        t->acquisitions += slot.acquisitions.load(std::memory_order_relaxed);
+                        t->contended += slot.contended.load(std::memory_order_relaxed);
+                        t->waitNs += slot.waitNs.load(std::memory_order_relaxed);
+                        t->holdNs += slot.holdNs.load(std::memory_order_relaxed);
+                        t->maxWaitNs = std::max(t->maxWaitNs, slot.maxWaitNs.load(std::memory_order_relaxed));
+                        t->maxHoldNs = std::max(t->maxHoldNs, slot.maxHoldNs.load(std::memory_order_relaxed));
+                    }
+                }
+                for (const auto &sample : buffer->getRecent())
+                {
+                    const char *lock = sample.lock.load(std::memory_order_relaxed);
+                    if (lock == nullptr)
+                        continue;
+                    slowest.push_back({{"lock", lock},
+                                       {"route", sample.route.load(std::memory_order_relaxed)},
+                                       {"waitNs", sample.waitNs.load(std::memory_order_relaxed)},
+                                       {"holdNs", sample.holdNs.load(std::memory_order_relaxed)}});
+                }
+            }
+
+            auto toJSON = [](const Totals &t)
+            {
+                return nlohmann::json{{"acquisitions", t.acquisitions},
+                                      {"contended", t.contended},
+                                      {"waitNs", t.waitNs},
+                                      {"maxWaitNs", t.maxWaitNs},
+                                      {"holdNs", t.holdNs},
+                                      {"maxHoldNs", t.maxHoldNs}};
+            };
+
+            nlohmann::json locks = nlohmann::json::object();
+            for (const auto &l : perLock)
+                locks[l.first] = toJSON(l.second);
+
+            std::vector<std::pair<std::pair<std::string, std::string>, Totals>> routes(perRoute.begin(), perRoute.end());
+            std::sort(routes.begin(), routes.end(), [](const auto &a, const auto &b)
+                      { return a.second.waitNs > b.second.waitNs; });
+            nlohmann::json handlers = nlohmann::json::array();
+            for (const auto &r : routes)
+            {
+                nlohmann::json entry = toJSON(r.second);
+                entry["lock"] = r.first.first;
+                entry["route"] = r.first.second;
+                uint64_t lockWait = perLock[r.first.first].waitNs;
+                entry["waitShare"] = lockWait == 0 ? 0.0 : static_cast<double>(r.second.waitNs) / lockWait;
+                handlers.push_back(entry);
+            }
+
+            std::sort(slowest.begin(), slowest.end(), [](const nlohmann::json &a, const nlohmann::json &b)
+                      { return a["waitNs"].get<uint64_t>() > b["waitNs"].get<uint64_t>(); });
+            if (slowest.size() > 20)
+                slowest.resize(20);
+
+            return nlohmann::json{{"locks", locks}, {"handlers", handlers}, {"slowestRecent", slowest}};
+        }
+
+    private:
+        ThreadBuffer *registerThread()
+        {
+            std::lock_guard<std::mutex> guard(buffersLock);
+            buffers.emplace_back(new ThreadBuffer());
+            return buffers.back().get();
+        }
+
+        mutable std::mutex buffersLock;
+        std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+    };
+
+    // std::mutex replacement that feeds the profiler. Optionally also records the wait time in a
+    // metrics histogram, so it shows up on GET /metrics.
+    class ProfiledMutex
+    {
+    public:
+        explicit ProfiledMutex(const std::string &name, Metrics::Histogram *waits = nullptr)
+            : name(intern(name)), waits(waits)
+        {
+        }
+
+        void lock()
+        {
+            uint64_t start = Metrics::nowNs();
+            bool contended = !mutex.try_lock();
+            if (contended)
+                mutex.lock();
+            // From here on we own the lock, so the bookkeeping fields are ours.
+            acquiredAt = Metrics::nowNs();
+            waitNs = acquiredAt - start;
+            wasContended = contended;
+            if (waits != nullptr)
+                waits->record(waitNs);
+        }
+
+        bool try_lock()
+        {
+            if (!mutex.try_lock())
+                return false;
+            acquiredAt = Metrics::nowNs();
+            waitNs = 0;
+            wasContended = false;
+            return true;
+        }
+
+        void unlock()
+        {
+            uint64_t holdNs = Metrics::nowNs() - acquiredAt;
+            uint64_t wait = waitNs;
+            bool contended = wasContended;
+            mutex.unlock();
+            Profiler::instance().threadBuffer().record(name, currentRoute(), wait, holdNs, contended);
+        }
+
+    private:
+        std::mutex mutex;
+        const char *name;
+        Metrics::Histogram *waits;
+        uint64_t acquiredAt = 0;
+        uint64_t waitNs = 0;
+        bool wasContended = false;
+    };
+}
+
+#endif
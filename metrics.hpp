@@ -0,0 +1,369 @@
+/*
+   Latency histograms and counters for the greenhouse server.
+   Everything here is recorded with relaxed atomics on per-thread shards
+   and only merged when somebody asks for a snapshot (GET /metrics).
+*/
+
+#ifndef GREENHOUSE_METRICS_HPP
+#define GREENHOUSE_METRICS_HPP
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sys/mman.h>
+
+namespace Metrics
+{
+    // Nanoseconds from a monotonic clock, used for every latency measurement.
+    inline uint64_t nowNs()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+    // Number of shards kept by every histogram. Each thread writes into its own shard,
+    // threads beyond this number share shards (still correct, the counters are atomic).
+    const unsigned kShards = 16;
+
+    // Shard index of the calling thread, assigned once on first use.
+    inline unsigned threadSlot()
+    {
+        static std::atomic<unsigned> nextSlot{0};
+        thread_local unsigned slot = nextSlot.fetch_add(1, std::memory_order_relaxed) % kShards;
+        return slot;
+    }
+
+    // Merged copy of a histogram, safe to inspect without touching the live shards.
+    struct Snapshot
+    {
+        std::vector<uint64_t> counts;
+        uint64_t count = 0;
+        uint64_t sum = 0;
+        uint64_t max = 0;
+
+        // Value (in nanoseconds) below which the given fraction of the samples fall.
+        uint64_t percentile(double q) const;
+    };
+
+    // HDR-style log-linear histogram of nanosecond values. Every power of two is split into
+    // kSubBuckets linear buckets, so any recorded value is off by at most 1/kSubBuckets.
+    class Histogram
+    {
+    public:
+        static const unsigned kSubBucketBits = 4;
+        static const unsigned kSubBuckets = 1u << kSubBucketBits;
+        // Values are clamped to 2^40 ns (about 18 minutes).
+        static const unsigned kMaxBits = 40;
+        static const unsigned kBuckets = (kMaxBits - kSubBucketBits + 1) * kSubBuckets;
+
+        static unsigned bucketOf(uint64_t value)
+        {
+            if (value >= (uint64_t(1) << kMaxBits))
+                value = (uint64_t(1) << kMaxBits) - 1;
+            if (value < kSubBuckets)
+                return static_cast<unsigned>(value);
+            unsigned msb = 63 - __builtin_clzll(value);
+            unsigned shift = msb - kSubBucketBits;
+            return (shift + 1) * kSubBuckets + static_cast<unsigned>((value >> shift) - kSubBuckets);
+        }
+
+        // Largest value that falls into the given bucket.
+        static uint64_t upperBoundOf(unsigned bucket)
+        {
+            if (bucket < kSubBuckets)
+                return bucket;
+            unsigned shift = bucket / kSubBuckets - 1;
+            uint64_t lower = uint64_t(kSubBuckets + bucket % kSubBuckets) << shift;
+            return lower + (uint64_t(1) << shift) - 1;
+        }
+
+        void record(uint64_t ns)
+        {
+            Shard &shard = shards[threadSlot()];
+            shard.counts[bucketOf(ns)].fetch_add(1, std::memory_order_relaxed);
+            shard.sum.fetch_add(ns, std::memory_order_relaxed);
+            uint64_t max = shard.max.load(std::memory_order_relaxed);
+            while (ns > max && !shard.max.compare_exchange_weak(max, ns, std::memory_order_relaxed))
+            {
+            }
+        }
+
+        Snapshot snapshot() const
+        {
+            Snapshot s;
+            s.counts.assign(kBuckets, 0);
+            for (const Shard &shard : shards)
+            {
+                for (unsigned i = 0; i < kBuckets; i++)
+                {
+                    uint64_t c = shard.counts[i].load(std::memory_order_relaxed);
+                    s.counts[i] += c;
+                    s.count += c;
+                }
+                s.sum += shard.sum.load(std::memory_order_relaxed);
+                uint64_t max = shard.max.load(std::memory_order_relaxed);
+                if (max > s.max)
+                    s.max = max;
+            }
+            return s;
+        }
+
+    private:
+        struct alignas(64) Shard
+        {
+            std::array<std::atomic<uint64_t>, kBuckets> counts{};
+            std::atomic<uint64_t> sum{0};
+            std::atomic<uint64_t> max{0};
+        };
+
+        std::array<Shard, kShards> shards;
+    };
+
+    inline uint64_t Snapshot::percentile(double q) const
+    {
+        if (count == 0)
+            return 0;
+        uint64_t rank = static_cast<uint64_t>(q * count);
+        if (rank >= count)
+            rank = count - 1;
+        uint64_t seen = 0;
+        for (unsigned i = 0; i < counts.size(); i++)
+        {
+            seen += counts[i];
+            if (seen > rank)
+            {
+                uint64_t bound = Histogram::upperBoundOf(i);
+                return bound < max ? bound : max;
+            }
+        }
+        return max;
+    }
+
+    // Monotonic counter. It is padded to a cache line so neighbouring counters do not
+    // bounce between cores.
+    struct alignas(64) Counter
+    {
+        std::atomic<uint64_t> value{0};
+
+        void increment(uint64_t by = 1)
+        {
+            value.fetch_add(by, std::memory_order_relaxed);
+        }
+
+        uint64_t get() const
+        {
+            return value.load(std::memory_order_relaxed);
+        }
+    };
+
+    // Value that goes up and down, e.g. a limit or a queue length.
+    struct alignas(64) Gauge
+    {
+        std::atomic<int64_t> value{0};
+
+        void set(int64_t v)
+        {
+            value.store(v, std::memory_order_relaxed);
+        }
+
+        int64_t get() const
+        {
+            return value.load(std::memory_order_relaxed);
+        }
+    };
+
+    // One counter per HTTP status code, rendered with a code="..." label.
+    struct CodeCounters
+    {
+        std::array<Counter, 600> codes;
+
+        void increment(int code)
+        {
+            if (code >= 0 && code < static_cast<int>(codes.size()))
+                codes[code].increment();
+        }
+    };
+
+    // Owner of every metric of a process and renderer of the Prometheus text format.
+    // Metrics are registered once at start-up; recording afterwards never touches the registry.
+    class Registry
+    {
+    public:
+        Histogram &histogram(const std::string &name, const std::string &labels, const std::string &help)
+        {
+            std::lock_guard<std::mutex> guard(registryLock);
+            Family &family = families[name];
+            family.help = help;
+            family.type = "histogram";
+            auto &slot = family.histograms[labels];
+            if (!slot)
+                slot.reset(new Histogram());
+            return *slot;
+        }
+
+        // Counters created with shared = true live in an anonymous shared mapping, so
+        // increments made by a forked child process (the MQTT publisher) are visible here.
+        Counter &counter(const std::string &name, const std::string &labels, const std::string &help, bool shared = false)
+        {
+            std::lock_guard<std::mutex> guard(registryLock);
+            Family &family = families[name];
+            family.help = help;
+            family.type = "counter";
+            auto it = family.counters.find(labels);
+            if (it != family.counters.end())
+                return *it->second;
+
+            Counter *c;
+            if (shared)
+            {
+                void *page = mmap(nullptr, sizeof(Counter), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+                if (page == MAP_FAILED)
+                    throw std::bad_alloc();
+                c = new (page) Counter();
+            }
+            else
+            {
+                ownedCounters.emplace_back(new Counter());
+                c = ownedCounters.back().get();
+            }
+            family.counters[labels] = c;
+            return *c;
+        }
+
+        Gauge &gauge(const std::string &name, const std::string &labels, const std::string &help)
+        {
+            std::lock_guard<std::mutex> guard(registryLock);
+            Family &family = families[name];
+            family.help = help;
+            family.type = "gauge";
+            auto &slot = family.gauges[labels];
+            if (!slot)
+                slot.reset(new Gauge());
+            return *slot;
+        }
+
+        CodeCounters &codeCounters(const std::string &name, const std::string &help)
+        {
+            std::lock_guard<std::mutex> guard(registryLock);
+            Family &family = families[name];
+            family.help = help;
+            family.type = "counter";
+            if (!family.codes)
+                family.codes.reset(new CodeCounters());
+            return *family.codes;
+        }
+
+        // Renders all metrics in the Prometheus text exposition format (version 0.0.4).
+        std::string renderPrometheus() const
+        {
+            std::lock_guard<std::mutex> guard(registryLock);
+            std::ostringstream out;
+            for (const auto &f : families)
+            {
+                const Family &family = f.second;
+                out << "# HELP " << f.first << " " << family.help << "\n";
+                out << "# TYPE " << f.first << " " << family.type << "\n";
+
+                std::vector<std::pair<std::string, Snapshot>> snapshots;
+                for (const auto &h : family.histograms)
+                {
+                    snapshots.emplace_back(h.first, h.second->snapshot());
+                    renderHistogram(out, f.first, h.first, snapshots.back().second);
+                }
+
+                for (const auto &c : family.counters)
+                    out << f.first << braces(c.first) << " " << c.second->get() << "\n";
+
+                for (const auto &g : family.gauges)
+                    out << f.first << braces(g.first) << " " << g.second->get() << "\n";
+
+                if (family.codes)
+                {
+                    for (unsigned code = 0; code < family.codes->codes.size(); code++)
+                    {
+                        uint64_t value = family.codes->codes[code].get();
+                        if (value != 0)
+                            out << f.first << "{code=\"" << code << "\"} " << value << "\n";
+                    }
+                }
+
+                // Precise quantiles straight from the fine-grained buckets, as a separate gauge family.
+                if (!snapshots.empty())
+                {
+                    static const char *quantiles[] = {"0.5", "0.99", "0.999"};
+                    out << "# HELP " << f.first << "_quantile Quantiles of " << f.first << ".\n";
+                    out << "# TYPE " << f.first << "_quantile gauge\n";
+                    for (const auto &s : snapshots)
+                        for (const char *q : quantiles)
+                            out << f.first << "_quantile" << withLabel(s.first, std::string("quantile=\"") + q + "\"") << " "
+                                << formatSeconds(s.second.percentile(std::stod(q)) / 1e9) << "\n";
+                }
+            }
+            return out.str();
+        }
+
+    private:
+        struct Family
+        {
+            std::string help;
+            std::string type;
+            std::map<std::string, std::unique_ptr<Histogram>> histograms;
+            std::map<std::string, Counter *> counters;
+            std::map<std::string, std::unique_ptr<Gauge>> gauges;
+            std::unique_ptr<CodeCounters> codes;
+        };
+
+        static std::string braces(const std::string &labels)
+        {
+            return labels.empty() ? "" : "{" + labels + "}";
+        }
+
+        static std::string withLabel(const std::string &labels, const std::string &extra)
+        {
+            return "{" + (labels.empty() ? extra : labels + "," + extra) + "}";
+        }
+
+        // Exported bucket bounds in seconds. The fine-grained buckets are folded into these.
+        static void renderHistogram(std::ostringstream &out, const std::string &name, const std::string &labels, const Snapshot &s)
+        {
+            static const double bounds[] = {0.00001, 0.000025, 0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025,
+                                            0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+            unsigned bucket = 0;
+            uint64_t cumulative = 0;
+            for (double bound : bounds)
+            {
+                uint64_t boundNs = static_cast<uint64_t>(bound * 1e9);
+                while (bucket < s.counts.size() && Histogram::upperBoundOf(bucket) <= boundNs)
+                    cumulative += s.counts[bucket++];
+                out << name << "_bucket" << withLabel(labels, "le=\"" + formatSeconds(bound) + "\"") << " " << cumulative << "\n";
+            }
+            out << name << "_bucket" << withLabel(labels, "le=\"+Inf\"") << " " << s.count << "\n";
+            out << name << "_sum" << braces(labels) << " " << formatSeconds(s.sum / 1e9) << "\n";
+            out << name << "_count" << braces(labels) << " " << s.count << "\n";
+        }
+
+        static std::string formatSeconds(double seconds)
+        {
+            std::ostringstream out;
+            out.precision(9);
+            out << seconds;
+            return out.str();
+        }
+
+        mutable std::mutex registryLock;
+        std::map<std::string, Family> families;
+        std::vector<std::unique_ptr<Counter>> ownedCounters;
+    };
+}
+
+#endif
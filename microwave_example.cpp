@@ -17,6 +17,8 @@
 
 #include <signal.h>
 
+#include "./lock_profiler.hpp"
+
 using namespace std;
 using namespace Pistache;
 
@@ -74,10 +76,22 @@ private:
         using namespace Rest;
         // Defining various endpoints
         // Generally say that when http://localhost:9080/ready is called, the handleReady function should be called. 
+        // Handlers are tagged with their route, so the lock profiler can tell who holds microwaveLock.
         Routes::Get(router, "/ready", Routes::bind(&Generic::handleReady));
-        Routes::Get(router, "/auth", Routes::bind(&MicrowaveEndpoint::doAuth, this));
-        Routes::Post(router, "/settings/:settingName/:value", Routes::bind(&MicrowaveEndpoint::setSetting, this));
-        Routes::Get(router, "/settings/:settingName/", Routes::bind(&MicrowaveEndpoint::getSetting, this));
+        Routes::Get(router, "/auth", Contention::tagged("GET /auth", Routes::bind(&MicrowaveEndpoint::doAuth, this)));
+        Routes::Post(router, "/settings/:settingName/:value", Contention::tagged("POST /settings/:settingName/:value", Routes::bind(&MicrowaveEndpoint::setSetting, this)));
+        Routes::Get(router, "/settings/:settingName/", Contention::tagged("GET /settings/:settingName/", Routes::bind(&MicrowaveEndpoint::getSetting, this)));
+        Routes::Get(router, "/metrics/locks", Routes::bind(&MicrowaveEndpoint::getLockReport, this));
+    }
+
+    // Contention report for microwaveLock, per handler.
+    void getLockReport(const Rest::Request& request, Http::ResponseWriter response) {
+        using namespace Http;
+        response.headers()
+                    .add<Header::Server>("pistache/0.1")
+                    .add<Header::ContentType>(MIME(Application, Json));
+
+        response.send(Http::Code::Ok, Contention::Profiler::instance().report().dump());
     }
 
     
@@ -182,10 +196,11 @@ private:
         }defrost;
     };
 
-    // Create the lock which prevents concurrent editing of the same variable
-    using Lock = std::mutex;
+    // Create the lock which prevents concurrent editing of the same variable.
+    // Every acquisition is profiled, see GET /metrics/locks.
+    using Lock = Contention::ProfiledMutex;
     using Guard = std::lock_guard<Lock>;
-    Lock microwaveLock;
+    Lock microwaveLock{"microwaveLock"};
 
     // Instance of the microwave model
     Microwave mwv;
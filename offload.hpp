@@ -0,0 +1,217 @@
+/*
+   Work-stealing executor for the slow route handlers.
+   Pistache runs a handler on the reactor thread that read the request, so a slow handler (a
+   rotation suggestion, a history export) delays every other connection of that thread, even
+   GET /ready. The routes listed in the config are handed to this executor instead: the reactor
+   only queues them and goes back to its connections, a worker runs the handler and sends the
+   response from its own thread, which Pistache allows.
+   Every worker has its own queue; the reactors spread the requests over them round robin and an
+   idle worker steals from the others, so one long handler does not hold up the requests queued
+   behind it.
+*/
+
+#ifndef GREENHOUSE_OFFLOAD_HPP
+#define GREENHOUSE_OFFLOAD_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "./json.hpp"
+#include "./metrics.hpp"
+
+namespace Offload
+{
+    struct Config
+    {
+        bool enabled = true;
+        // Worker threads of the executor.
+        int threads = 2;
+        // Routes (as named in GreenhouseEndpoint::setupRoutes) run by the executor.
+        std::vector<std::string> routes = {"GET /plantType", "GET /soilHistory", "GET /soilHistory/yields", "GET /audit"};
+        // Requests queued at most; beyond that they run on the reactor thread as before.
+        int capacity = 4096;
+    };
+
+    inline void from_json(const nlohmann::json &j, Config &c)
+    {
+        c.enabled = j.value("enabled", c.enabled);
+        c.threads = j.value("threads", c.threads);
+        c.routes = j.value("routes", c.routes);
+        c.capacity = j.value("capacity", c.capacity);
+    }
+
+    inline void to_json(nlohmann::json &j, const Config &c)
+    {
+        j = nlohmann::json{
+            {"enabled", c.enabled},
+            {"threads", c.threads},
+            {"routes", c.routes},
+            {"capacity", c.capacity}};
+    }
+
+    class Executor
+    {
+    public:
+        using Task = std::function<void()>;
+
+        Executor(Metrics::Registry &metrics)
+            : queuedGauge(metrics.gauge("greenhouse_offload_queued", "", "Requests waiting for a worker of the executor.")),
+              waitTime(metrics.histogram("greenhouse_offload_wait_seconds", "", "Time requests wait in the executor before a worker runs them.")),
+              steals(metrics.counter("greenhouse_offload_steals_total", "", "Requests a worker took from the queue of another worker.")),
+              overflows(metrics.counter("greenhouse_offload_overflow_total", "", "Requests run on the reactor thread because the executor was full."))
+        {
+        }
+
+        ~Executor()
+        {
+            stop();
+        }
+
+        void start(const Config &config)
+        {
+            stop();
+            if (!config.enabled || config.threads < 1)
+                return;
+            capacity = config.capacity;
+            workers.clear();
+            for (int i = 0; i < config.threads; i++)
+                workers.emplace_back(new Worker());
+            running = true;
+            for (size_t i = 0; i < workers.size(); i++)
+                workers[i]->thread = std::thread(&Executor::run, this, i);
+        }
+
+        // Runs what is queued, then stops the workers.
+        void stop()
+        {
+            {
+                std::lock_guard<std::mutex> guard(sleepLock);
+                running = false;
+            }
+            wake.notify_all();
+            for (auto &worker : workers)
+                if (worker->thread.joinable())
+                    worker->thread.join();
+        }
+
+        bool isRunning() const
+        {
+            return running;
+        }
+
+        // Queues a task. False when the executor is stopped or full: the caller runs it itself.
+        bool submit(Task task)
+        {
+            if (!running)
+                return false;
+            // Counted before it is queued, so the count is never below what the queues hold.
+            int64_t before = queued.fetch_add(1);
+            if (before >= capacity)
+            {
+                queued.fetch_sub(1);
+                overflows.increment();
+                return false;
+            }
+            queuedGauge.set(before + 1);
+            {
+                Worker &worker = *workers[next.fetch_add(1, std::memory_order_relaxed) % workers.size()];
+                std::lock_guard<std::mutex> guard(worker.lock);
+                worker.tasks.push_back({std::move(task), Metrics::nowNs()});
+            }
+            // Pairs with the sleeper count of run(): either the worker sees the task or we see it sleeping.
+            if (sleepers.load() > 0)
+            {
+                {
+                    std::lock_guard<std::mutex> guard(sleepLock);
+                }
+                wake.notify_one();
+            }
+            return true;
+        }
+
+    private:
+        struct Queued
+        {
+            Task task;
+            uint64_t queuedAt;
+        };
+
+        struct Worker
+        {
+            std::mutex lock;
+            std::deque<Queued> tasks;
+            std::thread thread;
+        };
+
+        // Takes the oldest task of a worker's queue.
+        static bool take(Worker &worker, Queued &task)
+        {
+            std::lock_guard<std::mutex> guard(worker.lock);
+            if (worker.tasks.empty())
+                return false;
+            task = std::move(worker.tasks.front());
+            worker.tasks.pop_front();
+            return true;
+        }
+
+        // Own queue first, then the others, starting with the next worker.
+        bool find(size_t self, Queued &task)
+        {
+            if (take(*workers[self], task))
+                return true;
+            for (size_t i = 1; i < workers.size(); i++)
+                if (take(*workers[(self + i) % workers.size()], task))
+                {
+                    steals.increment();
+                    return true;
+                }
+            return false;
+        }
+
+        void run(size_t self)
+        {
+            Queued task;
+            while (true)
+            {
+                if (find(self, task))
+                {
+                    queuedGauge.set(queued.fetch_sub(1) - 1);
+                    waitTime.record(Metrics::nowNs() - task.queuedAt);
+                    task.task();
+                    task.task = nullptr;
+                    continue;
+                }
+                std::unique_lock<std::mutex> guard(sleepLock);
+                sleepers.fetch_add(1);
+                wake.wait(guard, [this]()
+                          { return !running || queued.load() > 0; });
+                sleepers.fetch_sub(1);
+                if (!running && queued.load() == 0)
+                    break;
+            }
+        }
+
+        Metrics::Gauge &queuedGauge;
+        Metrics::Histogram &waitTime;
+        Metrics::Counter &steals;
+        Metrics::Counter &overflows;
+
+        std::vector<std::unique_ptr<Worker>> workers;
+        std::atomic<bool> running{false};
+        int64_t capacity = 0;
+        std::atomic<int64_t> queued{0};
+        std::atomic<size_t> next{0};
+        std::atomic<int> sleepers{0};
+        std::mutex sleepLock;
+        std::condition_variable wake;
+    };
+}
+
+#endif
@@ -0,0 +1,236 @@
+/*
+   Per-client rate limiting.
+   Every (route, client) pair has a token bucket; a client is its peer IP address plus, when it
+   sends one, its session cookie (handed out by GET /auth). The buckets live in a fixed size,
+   sharded open addressing table. A bucket is a single 64-bit word (last refill time and tokens)
+   updated with compare-and-swap, so checking a request takes a hash, a short probe and one CAS,
+   without locks and without allocating.
+*/
+
+#ifndef GREENHOUSE_RATE_LIMIT_HPP
+#define GREENHOUSE_RATE_LIMIT_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+
+#include "./json.hpp"
+#include "./metrics.hpp"
+
+namespace RateLimit
+{
+    // Tokens per second a client gets on a route, and how many it can save up (at least one).
+    // Rate 0 is unlimited.
+    struct Limit
+    {
+        double rate = 0;
+        double burst = 0;
+    };
+
+    struct Config
+    {
+        bool enabled = true;
+        // Name of the cookie that identifies a session, next to the peer address.
+        std::string cookie = "session";
+        // Limit of the routes not listed in routes.
+        Limit defaultLimit;
+        // Limits per route, with the route named as in GreenhouseEndpoint::setupRoutes.
+        std::map<std::string, Limit> routes = {
+            {"POST /settings/:settingName/:value", {20, 40}},
+            {"POST /preconfigurations/select/:value", {5, 10}},
+            {"POST /preconfigurations", {5, 10}},
+            {"POST /soilHistory", {5, 10}}};
+
+        Limit limitOf(const std::string &route) const
+        {
+            auto it = routes.find(route);
+            return it == routes.end() ? defaultLimit : it->second;
+        }
+    };
+
+    inline void from_json(const nlohmann::json &j, Limit &l)
+    {
+        l.rate = j.value("rate", l.rate);
+        l.burst = j.value("burst", l.burst);
+    }
+
+    inline void to_json(nlohmann::json &j, const Limit &l)
+    {
+        j = nlohmann::json{
+            {"rate", l.rate},
+            {"burst", l.burst}};
+    }
+
+    inline void from_json(const nlohmann::json &j, Config &c)
+    {
+        c.enabled = j.value("enabled", c.enabled);
+        c.cookie = j.value("cookie", c.cookie);
+        c.defaultLimit = j.value("default", c.defaultLimit);
+        c.routes = j.value("routes", c.routes);
+    }
+
+    inline void to_json(nlohmann::json &j, const Config &c)
+    {
+        j = nlohmann::json{
+            {"enabled", c.enabled},
+            {"cookie", c.cookie},
+            {"default", c.defaultLimit},
+            {"routes", c.routes}};
+    }
+
+    // 64-bit FNV-1a, mixed into the running hash h.
+    inline uint64_t hash(const char *data, size_t size, uint64_t h = 0xcbf29ce484222325ull)
+    {
+        for (size_t i = 0; i < size; i++)
+        {
+            h ^= static_cast<unsigned char>(data[i]);
+            h *= 0x100000001b3ull;
+        }
+        return h;
+    }
+
+    // Milliseconds on the monotonic clock, truncated to 32 bits. It wraps after 49 days, so
+    // times are only ever compared through since().
+    inline uint32_t nowMs()
+    {
+        return static_cast<uint32_t>(Metrics::nowNs() / 1000000);
+    }
+
+    // Another thread stores a later time than ours at most this long before we use ours.
+    constexpr int32_t kRaceMs = 1000;
+
+    // Milliseconds from then to now. Slightly negative when another thread already stored a later
+    // time. A gap over 2^31 ms (24.8 days) looks negative too, beyond kRaceMs: it counts as idle
+    // for as long as can be told, so the bucket refills and its slot can be reused.
+    inline int32_t since(uint32_t now, uint32_t then)
+    {
+        int32_t elapsed = static_cast<int32_t>(now - then);
+        return elapsed < -kRaceMs ? INT32_MAX : elapsed;
+    }
+
+    class Table
+    {
+    public:
+        static constexpr unsigned kShardBits = 6;
+        static constexpr unsigned kShards = 1u << kShardBits;
+        static constexpr unsigned kSlotsPerShard = 1024;
+        static constexpr unsigned kProbe = 8;
+        // Tokens are stored in fixed point with this many fractions per token.
+        static constexpr uint64_t kScale = 1024;
+        // A bucket that was not used for this long is full again and its slot may be reused.
+        static constexpr int32_t kIdleMs = 60000;
+
+        // overflows counts the requests of clients that found no slot and had to share a bucket.
+        explicit Table(Metrics::Counter &overflows)
+            : shards(new Shard[kShards]), overflows(overflows)
+        {
+        }
+
+        // Takes one token from the bucket of key. Returns 0 when the request may go on, otherwise
+        // the milliseconds until the bucket has a token again.
+        uint32_t take(uint64_t key, const Limit &limit)
+        {
+            key |= 1; // 0 marks a free slot
+            uint32_t now = nowMs();
+            std::atomic<uint64_t> &state = bucket(key, now, limit);
+            uint64_t burst = burstOf(limit);
+            double perMs = limit.rate * kScale / 1000.0;
+
+            uint64_t current = state.load(std::memory_order_relaxed);
+            for (;;)
+            {
+                uint32_t last = static_cast<uint32_t>(current >> 32);
+                uint64_t tokens = current & 0xffffffffull;
+                int32_t elapsed = since(now, last);
+                uint32_t stamp = now;
+                if (elapsed < 0)
+                {
+                    elapsed = 0;
+                    stamp = last;
+                }
+                // Clamp first, so that a long idle time cannot overflow the refill.
+                double refill = std::min<double>(elapsed * perMs, static_cast<double>(burst));
+                tokens = std::min<uint64_t>(burst, tokens + static_cast<uint64_t>(refill));
+                if (tokens < kScale)
+                    return static_cast<uint32_t>(std::ceil((kScale - tokens) / perMs));
+                uint64_t next = (static_cast<uint64_t>(stamp) << 32) | (tokens - kScale);
+                if (state.compare_exchange_weak(current, next, std::memory_order_relaxed))
+                    return 0;
+            }
+        }
+
+    private:
+        struct Slot
+        {
+            std::atomic<uint64_t> key{0};
+            std::atomic<uint64_t> state{0};
+        };
+
+        struct alignas(64) Shard
+        {
+            Slot slots[kSlotsPerShard];
+            Slot overflow;
+        };
+
+        static uint64_t burstOf(const Limit &limit)
+        {
+            return static_cast<uint64_t>(std::max(1.0, limit.burst) * kScale);
+        }
+
+        static uint64_t fullBucket(uint32_t now, const Limit &limit)
+        {
+            return (static_cast<uint64_t>(now) << 32) | burstOf(limit);
+        }
+
+        // Finds the slot of key within kProbe slots of its home slot. A new key takes a free slot,
+        // or else one whose bucket has been idle for kIdleMs. When neither exists the shard's
+        // overflow bucket is used, so a full table still limits, just less precisely.
+        std::atomic<uint64_t> &bucket(uint64_t key, uint32_t now, const Limit &limit)
+        {
+            Shard &shard = shards[key >> (64 - kShardBits)];
+            unsigned home = static_cast<unsigned>(key) % kSlotsPerShard;
+            for (unsigned i = 0; i < kProbe; i++)
+            {
+                Slot &slot = shard.slots[(home + i) % kSlotsPerShard];
+                uint64_t owner = slot.key.load(std::memory_order_acquire);
+                if (owner == key)
+                    return slot.state;
+                if (owner == 0)
+                {
+                    // The state is written before the key is published.
+                    uint64_t expected = 0;
+                    uint64_t previous = slot.state.load(std::memory_order_relaxed);
+                    if (previous == 0 || since(now, static_cast<uint32_t>(previous >> 32)) >= kIdleMs)
+                        slot.state.compare_exchange_strong(previous, fullBucket(now, limit), std::memory_order_relaxed);
+                    if (slot.key.compare_exchange_strong(expected, key, std::memory_order_acq_rel) || expected == key)
+                        return slot.state;
+                    continue;
+                }
+            }
+            for (unsigned i = 0; i < kProbe; i++)
+            {
+                Slot &slot = shard.slots[(home + i) % kSlotsPerShard];
+                uint64_t previous = slot.state.load(std::memory_order_relaxed);
+                if (since(now, static_cast<uint32_t>(previous >> 32)) < kIdleMs)
+                    continue;
+                uint64_t owner = slot.key.load(std::memory_order_acquire);
+                if (slot.state.compare_exchange_strong(previous, fullBucket(now, limit), std::memory_order_relaxed) &&
+                    slot.key.compare_exchange_strong(owner, key, std::memory_order_acq_rel))
+                    return slot.state;
+            }
+            overflows.increment();
+            if (shard.overflow.key.exchange(1, std::memory_order_relaxed) == 0)
+                shard.overflow.state.store(fullBucket(now, limit), std::memory_order_relaxed);
+            return shard.overflow.state;
+        }
+
+        std::unique_ptr<Shard[]> shards;
+        Metrics::Counter &overflows;
+    };
+}
+
+#endif
@@ -0,0 +1,572 @@
+/*
+   Leader/follower replication of the greenhouse between greenhouse_app processes.
+   The leader accepts followers on a TCP port. A new follower first gets a snapshot of the whole
+   state (settings, preconfigurations and soil history), then every change the leader commits, in
+   commit order. The changes are encoded like the events of the audit log and kept in a bounded
+   backlog; every batchInterval the sender thread sends each follower all the changes after its
+   cursor as one frame, without waiting for the previous frames to be acknowledged. A follower
+   applies a frame under one lock, acknowledges it and serves the read routes; the routes that
+   change the greenhouse are refused until POST /replication/promote makes it a leader.
+
+   Frames: uint32 size of the rest, uint8 type, then
+       Snapshot: uint64 sequence of the last change it includes, uint32 events, the events
+       Events:   uint64 sequence of the first event, uint32 events, the events
+       Ack:      uint64 sequence of the last change applied (from the follower)
+*/
+
+#ifndef GREENHOUSE_REPLICATION_HPP
+#define GREENHOUSE_REPLICATION_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "./json.hpp"
+#include "./metrics.hpp"
+#include "./response_builder.hpp"
+#include "./greenhouse.hpp"
+#include "./audit_log.hpp"
+
+namespace Replication
+{
+    struct Config
+    {
+        // Port the leader accepts followers on, 0 for none.
+        int port = 0;
+        // host:port of the leader. When set the server starts as its read-only follower.
+        std::string leader;
+        // Seconds between two frames to the followers.
+        double batchInterval = 0.005;
+        // Changes kept for the followers; a follower further behind gets a new snapshot.
+        size_t backlog = 65536;
+    };
+
+    inline void from_json(const nlohmann::json &j, Config &c)
+    {
+        c.port = j.value("port", c.port);
+        c.leader = j.value("leader", c.leader);
+        c.batchInterval = j.value("batchInterval", c.batchInterval);
+        c.backlog = j.value("backlog", c.backlog);
+    }
+
+    inline void to_json(nlohmann::json &j, const Config &c)
+    {
+        j = nlohmann::json{
+            {"port", c.port},
+            {"leader", c.leader},
+            {"batchInterval", c.batchInterval},
+            {"backlog", c.backlog}};
+    }
+
+    enum class Frame : uint8_t
+    {
+        Snapshot = 1,
+        Events,
+        Ack
+    };
+
+    constexpr size_t kFrameHeader = 5;
+    // Larger frames are taken for a broken stream.
+    constexpr uint32_t kMaxFrame = 1u << 30;
+
+    // Starts a frame in out, returns where it starts for endFrame.
+    inline size_t beginFrame(std::string &out, Frame type)
+    {
+        size_t start = out.size();
+        out.append(4, '\0');
+        out.push_back(static_cast<char>(type));
+        return start;
+    }
+
+    inline void endFrame(std::string &out, size_t start)
+    {
+        uint32_t size = static_cast<uint32_t>(out.size() - start - 4);
+        std::memcpy(&out[start], &size, sizeof(size));
+    }
+
+    inline bool sendAll(int fd, const char *data, size_t size)
+    {
+        while (size > 0)
+        {
+            ssize_t sent = ::send(fd, data, size, MSG_NOSIGNAL);
+            if (sent <= 0)
+                return false;
+            data += sent;
+            size -= static_cast<size_t>(sent);
+        }
+        return true;
+    }
+
+    inline bool receiveAll(int fd, char *data, size_t size)
+    {
+        while (size > 0)
+        {
+            ssize_t received = ::recv(fd, data, size, 0);
+            if (received <= 0)
+                return false;
+            data += received;
+            size -= static_cast<size_t>(received);
+        }
+        return true;
+    }
+
+    // Connects to host:port, returns the socket or -1.
+    inline int connectTo(const std::string &address)
+    {
+        size_t colon = address.rfind(':');
+        if (colon == std::string::npos)
+            return -1;
+        addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo *found = nullptr;
+        if (getaddrinfo(address.substr(0, colon).c_str(), address.substr(colon + 1).c_str(), &hints, &found) != 0)
+            return -1;
+        int fd = -1;
+        for (addrinfo *candidate = found; candidate && fd < 0; candidate = candidate->ai_next)
+        {
+            fd = ::socket(candidate->ai_family, candidate->ai_socktype, candidate->ai_protocol);
+            if (fd >= 0 && ::connect(fd, candidate->ai_addr, candidate->ai_addrlen) != 0)
+            {
+                ::close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(found);
+        if (fd >= 0)
+        {
+            int on = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        }
+        return fd;
+    }
+
+    // Applies a replicated change to a follower's greenhouse. The leader checked it already.
+    inline void applyChange(const Audit::Event &event, Greenhouse &gh)
+    {
+        Season season;
+        switch (event.kind)
+        {
+        case Audit::Kind::Set:
+            gh.set(event.setting, event.value);
+            break;
+        case Audit::Kind::SelectPreconfiguration:
+            gh.applyPreconfiguration(event.preconfiguration);
+            break;
+        case Audit::Kind::AddPreconfiguration:
+            gh.addPreconfiguration(event.preconfiguration);
+            break;
+        case Audit::Kind::AddPlant:
+            season = event.season;
+            gh.addSeason(season);
+            break;
+        case Audit::Kind::Checkpoint:
+            gh.restoreSettings(event.settings);
+            break;
+        }
+    }
+
+    // The whole state of a greenhouse as changes that rebuild it on an empty one.
+    inline void snapshot(const Greenhouse &gh, std::vector<Audit::Event> &state)
+    {
+        for (size_t i = 0; i < gh.preconfigurationCount(); i++)
+            state.push_back(Audit::preconfigurationAdded("", gh.getPreconfiguration(static_cast<int>(i))));
+        for (size_t i = 0; i < gh.soilHistorySize(); i++)
+            state.push_back(Audit::plantAdded("", gh.getSeason(i)));
+        state.push_back(Audit::checkpoint(gh.getSettings()));
+    }
+
+    class Leader
+    {
+    public:
+        // Fills in the whole state and returns the sequence of the last change it includes.
+        // No change may be published while it runs (the endpoint holds greenhouseLock).
+        using Snapshot = std::function<uint64_t(std::vector<Audit::Event> &state)>;
+
+        Leader(Metrics::Registry &metrics)
+            : followerCount(metrics.gauge("greenhouse_replication_followers", "", "Followers connected to this leader.")),
+              lag(metrics.gauge("greenhouse_replication_lag", "", "Changes the slowest follower has not acknowledged yet.")),
+              snapshots(metrics.counter("greenhouse_replication_snapshots_total", "", "Full snapshots sent to followers."))
+        {
+        }
+
+        ~Leader()
+        {
+            stop();
+        }
+
+        // Listens on config.port and starts the sender thread. Throws if the port cannot be used.
+        void start(const Config &replicationConfig, Snapshot takeSnapshot)
+        {
+            stop();
+            config = replicationConfig;
+            snapshot = std::move(takeSnapshot);
+            listenFd = ::socket(AF_INET6, SOCK_STREAM, 0);
+            int on = 1, off = 0;
+            sockaddr_in6 address = {};
+            address.sin6_family = AF_INET6;
+            address.sin6_addr = in6addr_any;
+            address.sin6_port = htons(static_cast<uint16_t>(config.port));
+            if (listenFd < 0 || setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+                setsockopt(listenFd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)) != 0 ||
+                ::bind(listenFd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || ::listen(listenFd, 16) != 0)
+            {
+                if (listenFd >= 0)
+                    ::close(listenFd);
+                listenFd = -1;
+                throw std::runtime_error("cannot accept followers on port " + std::to_string(config.port) + ": " + strerror(errno));
+            }
+            running = true;
+            thread = std::thread(&Leader::run, this);
+        }
+
+        void stop()
+        {
+            running = false;
+            if (thread.joinable())
+                thread.join();
+            for (Follower &follower : followers)
+                ::close(follower.fd);
+            followers.clear();
+            if (listenFd >= 0)
+                ::close(listenFd);
+            listenFd = -1;
+            followerCount.set(0);
+        }
+
+        bool active() const
+        {
+            return running;
+        }
+
+        // Queues a committed change for the followers. Call it in commit order.
+        void publish(const Audit::Event &event)
+        {
+            std::string encoded;
+            Audit::Codec::putEvent(encoded, event, 0);
+            std::lock_guard<std::mutex> guard(backlogLock);
+            backlog.push_back(std::move(encoded));
+            if (backlog.size() > config.backlog)
+            {
+                backlog.pop_front();
+                firstSequence++;
+            }
+        }
+
+        // Sequence of the last change published, 0 before the first one.
+        uint64_t sequence()
+        {
+            std::lock_guard<std::mutex> guard(backlogLock);
+            return firstSequence + backlog.size() - 1;
+        }
+
+        // {"role":"leader","sequence":..,"followers":..,"lag":..}
+        void writeStatus(Reply::Builder &out)
+        {
+            out.append('{').appendKey("role", true).append("\"leader\"");
+            out.appendKey("sequence").append(static_cast<long long>(sequence()));
+            out.appendKey("followers").append(static_cast<long long>(followerCount.get()));
+            out.appendKey("lag").append(static_cast<long long>(lag.get())).append('}');
+        }
+
+    private:
+        struct Follower
+        {
+            int fd;
+            // Next change to send, last one acknowledged.
+            uint64_t cursor;
+            uint64_t acknowledged;
+            // Acks received in part.
+            std::string received;
+        };
+
+        void run()
+        {
+            int interval = std::max(1, static_cast<int>(config.batchInterval * 1000));
+            std::vector<pollfd> polled;
+            std::string frame;
+            while (running)
+            {
+                polled.assign(1, pollfd{listenFd, POLLIN, 0});
+                for (const Follower &follower : followers)
+                    polled.push_back(pollfd{follower.fd, POLLIN, 0});
+                if (::poll(polled.data(), polled.size(), interval) < 0 && errno != EINTR)
+                    break;
+
+                for (size_t i = followers.size(); i-- > 0;)
+                    if ((polled[i + 1].revents & (POLLIN | POLLERR | POLLHUP)) && !readAcks(followers[i]))
+                        drop(i);
+                if (polled[0].revents & POLLIN)
+                    attach(::accept(listenFd, nullptr, nullptr));
+
+                uint64_t last = sequence(), slowest = last;
+                for (size_t i = followers.size(); i-- > 0;)
+                {
+                    if (!sendChanges(followers[i], frame))
+                        drop(i);
+                    else
+                        slowest = std::min(slowest, followers[i].acknowledged);
+                }
+                followerCount.set(static_cast<int64_t>(followers.size()));
+                lag.set(static_cast<int64_t>(last - slowest));
+            }
+        }
+
+        // Sends the snapshot to a new follower.
+        void attach(int fd)
+        {
+            if (fd < 0)
+                return;
+            int on = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            // A follower that does not read for that long is dropped rather than stalling the others.
+            timeval timeout = {2, 0};
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            Follower follower = {fd, 0, 0, std::string()};
+            if (!sendSnapshot(follower))
+            {
+                ::close(fd);
+                return;
+            }
+            followers.push_back(std::move(follower));
+        }
+
+        bool sendSnapshot(Follower &follower)
+        {
+            std::vector<Audit::Event> state;
+            uint64_t at = snapshot(state);
+            std::string frame;
+            size_t start = beginFrame(frame, Frame::Snapshot);
+            Audit::Codec::putRaw(frame, at);
+            Audit::Codec::putRaw(frame, static_cast<uint32_t>(state.size()));
+            for (const Audit::Event &event : state)
+                Audit::Codec::putEvent(frame, event, 0);
+            endFrame(frame, start);
+            snapshots.increment();
+            follower.cursor = at + 1;
+            follower.acknowledged = at;
+            return sendAll(follower.fd, frame.data(), frame.size());
+        }
+
+        // Sends the changes after the follower's cursor as one frame; a follower the backlog
+        // no longer covers gets a snapshot instead.
+        bool sendChanges(Follower &follower, std::string &frame)
+        {
+            frame.clear();
+            {
+                std::lock_guard<std::mutex> guard(backlogLock);
+                uint64_t end = firstSequence + backlog.size();
+                if (follower.cursor >= end)
+                    return true;
+                if (follower.cursor >= firstSequence)
+                {
+                    size_t start = beginFrame(frame, Frame::Events);
+                    Audit::Codec::putRaw(frame, follower.cursor);
+                    Audit::Codec::putRaw(frame, static_cast<uint32_t>(end - follower.cursor));
+                    for (uint64_t s = follower.cursor; s < end; s++)
+                        frame.append(backlog[s - firstSequence]);
+                    endFrame(frame, start);
+                    follower.cursor = end;
+                }
+            }
+            if (frame.empty())
+                return sendSnapshot(follower);
+            return sendAll(follower.fd, frame.data(), frame.size());
+        }
+
+        bool readAcks(Follower &follower)
+        {
+            char buffer[512];
+            ssize_t received = ::recv(follower.fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+            if (received <= 0)
+                return received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+            follower.received.append(buffer, static_cast<size_t>(received));
+            size_t ack = kFrameHeader + sizeof(uint64_t), used = 0;
+            for (; follower.received.size() - used >= ack; used += ack)
+            {
+                if (follower.received[used + 4] != static_cast<char>(Frame::Ack))
+                    return false;
+                std::memcpy(&follower.acknowledged, &follower.received[used + kFrameHeader], sizeof(uint64_t));
+            }
+            follower.received.erase(0, used);
+            return true;
+        }
+
+        void drop(size_t i)
+        {
+            ::close(followers[i].fd);
+            followers.erase(followers.begin() + static_cast<std::ptrdiff_t>(i));
+        }
+
+        Config config;
+        Snapshot snapshot;
+
+        Metrics::Gauge &followerCount;
+        Metrics::Gauge &lag;
+        Metrics::Counter &snapshots;
+
+        // Encoded changes, the first one being change firstSequence.
+        std::mutex backlogLock;
+        std::deque<std::string> backlog;
+        uint64_t firstSequence = 1;
+
+        // Owned by the sender thread.
+        int listenFd = -1;
+        std::vector<Follower> followers;
+
+        std::atomic<bool> running{false};
+        std::thread thread;
+    };
+
+    class Follower
+    {
+    public:
+        // Applies a batch of changes, or with reset a snapshot that replaces the whole state.
+        using Apply = std::function<void(const std::vector<Audit::Event> &changes, bool reset)>;
+
+        Follower(Metrics::Registry &metrics)
+            : applied(metrics.counter("greenhouse_replication_applied_total", "", "Changes applied from the leader.")),
+              connected(metrics.gauge("greenhouse_replication_connected", "", "1 while this follower is connected to its leader."))
+        {
+        }
+
+        ~Follower()
+        {
+            stop();
+        }
+
+        // Follows config.leader, reconnecting whenever the connection is lost.
+        void start(const Config &replicationConfig, Apply applyChanges)
+        {
+            stop();
+            config = replicationConfig;
+            apply = std::move(applyChanges);
+            running = true;
+            thread = std::thread(&Follower::run, this);
+        }
+
+        void stop()
+        {
+            {
+                std::lock_guard<std::mutex> guard(wakeLock);
+                running = false;
+                if (fd >= 0)
+                    ::shutdown(fd, SHUT_RDWR);
+            }
+            wake.notify_all();
+            if (thread.joinable())
+                thread.join();
+        }
+
+        bool active() const
+        {
+            return running;
+        }
+
+        // {"role":"follower","leader":..,"connected":..,"sequence":..}
+        void writeStatus(Reply::Builder &out)
+        {
+            out.append('{').appendKey("role", true).append("\"follower\"");
+            out.appendKey("leader").appendJSON(config.leader);
+            out.appendKey("connected").append(connected.get() != 0 ? "true" : "false");
+            out.appendKey("sequence").append(static_cast<long long>(sequence.load())).append('}');
+        }
+
+    private:
+        void run()
+        {
+            std::string frame;
+            std::vector<Audit::Event> changes;
+            while (running)
+            {
+                int socket = connectTo(config.leader);
+                {
+                    std::lock_guard<std::mutex> guard(wakeLock);
+                    fd = socket;
+                    if (!running && fd >= 0)
+                        ::shutdown(fd, SHUT_RDWR);
+                }
+                if (socket >= 0)
+                {
+                    connected.set(1);
+                    while (receive(socket, frame, changes))
+                        ;
+                    connected.set(0);
+                    std::lock_guard<std::mutex> guard(wakeLock);
+                    ::close(fd);
+                    fd = -1;
+                }
+                std::unique_lock<std::mutex> guard(wakeLock);
+                wake.wait_for(guard, std::chrono::seconds(1), [this]()
+                              { return !running; });
+            }
+        }
+
+        // Receives, applies and acknowledges one frame. Returns false when the stream ends.
+        bool receive(int socket, std::string &frame, std::vector<Audit::Event> &changes)
+        {
+            char header[kFrameHeader];
+            uint32_t size;
+            if (!receiveAll(socket, header, sizeof(header)))
+                return false;
+            std::memcpy(&size, header, sizeof(size));
+            if (size < 1 || size > kMaxFrame)
+                return false;
+            frame.resize(size - 1);
+            if (!receiveAll(socket, &frame[0], frame.size()))
+                return false;
+
+            Frame type = static_cast<Frame>(header[4]);
+            Audit::Codec::Reader reader{frame.data(), frame.data() + frame.size()};
+            uint64_t first;
+            uint32_t count;
+            if ((type != Frame::Snapshot && type != Frame::Events) || !reader.getRaw(first) || !reader.getRaw(count))
+                return false;
+            changes.resize(count);
+            for (Audit::Event &change : changes)
+                if (!Audit::Codec::getEvent(reader, 0, change))
+                    return false;
+            apply(changes, type == Frame::Snapshot);
+            applied.increment(count);
+
+            uint64_t last = type == Frame::Snapshot ? first : first + count - 1;
+            sequence = last;
+            std::string ack;
+            size_t start = beginFrame(ack, Frame::Ack);
+            Audit::Codec::putRaw(ack, last);
+            endFrame(ack, start);
+            return sendAll(socket, ack.data(), ack.size());
+        }
+
+        Config config;
+        Apply apply;
+
+        Metrics::Counter &applied;
+        Metrics::Gauge &connected;
+        std::atomic<uint64_t> sequence{0};
+
+        std::mutex wakeLock;
+        std::condition_variable wake;
+        int fd = -1;
+        std::atomic<bool> running{false};
+        std::thread thread;
+    };
+}
+
+#endif
@@ -0,0 +1,184 @@
+/*
+   Allocation free response bodies.
+   A Reply::Builder formats text and numbers straight into a buffer that belongs to the calling
+   worker thread and is reused by every response that thread builds. The buffer only grows, so
+   once it reached the size of the largest response no request allocates for its body anymore.
+*/
+
+#ifndef GREENHOUSE_RESPONSE_BUILDER_HPP
+#define GREENHOUSE_RESPONSE_BUILDER_HPP
+
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+#include "./json.hpp"
+
+namespace Reply
+{
+    // Body buffer of the calling thread. Only one Builder may use it at a time.
+    inline std::string &threadArena()
+    {
+        thread_local std::string arena;
+        return arena;
+    }
+
+    class Builder
+    {
+    public:
+        // Builds into the calling thread's arena.
+        Builder()
+            : buffer(threadArena())
+        {
+            buffer.clear();
+        }
+
+        // Builds into a caller provided string, e.g. to keep a std::string returning API.
+        explicit Builder(std::string &buffer)
+            : buffer(buffer)
+        {
+            buffer.clear();
+        }
+
+        Builder(const Builder &) = delete;
+        Builder &operator=(const Builder &) = delete;
+
+        Builder &append(const char *text, size_t length)
+        {
+            buffer.append(text, length);
+            return *this;
+        }
+
+        Builder &append(const std::string &text)
+        {
+            buffer.append(text);
+            return *this;
+        }
+
+        template <size_t N>
+        Builder &append(const char (&literal)[N])
+        {
+            buffer.append(literal, N - 1);
+            return *this;
+        }
+
+        Builder &append(char c)
+        {
+            buffer.push_back(c);
+            return *this;
+        }
+
+        Builder &append(long long value)
+        {
+            char digits[24];
+            auto result = std::to_chars(digits, digits + sizeof(digits), value);
+            return append(digits, static_cast<size_t>(result.ptr - digits));
+        }
+
+        Builder &append(int value)
+        {
+            return append(static_cast<long long>(value));
+        }
+
+        // Same text as std::to_string(double), i.e. printf("%f").
+        Builder &appendFixed(double value)
+        {
+            char digits[400];
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+            auto result = std::to_chars(digits, digits + sizeof(digits), value, std::chars_format::fixed, 6);
+            return append(digits, static_cast<size_t>(result.ptr - digits));
+#else
+            // Older standard libraries have no floating point to_chars; snprintf does not allocate either.
+            int length = snprintf(digits, sizeof(digits), "%f", value);
+            return append(digits, static_cast<size_t>(length));
+#endif
+        }
+
+        // Same text as json::dump() for a number, so hand written JSON is byte for byte identical.
+        Builder &appendJSON(double value)
+        {
+            if (!std::isfinite(value))
+                return append("null");
+            char digits[64];
+            char *end = nlohmann::detail::to_chars(digits, digits + sizeof(digits), value);
+            return append(digits, static_cast<size_t>(end - digits));
+        }
+
+        // Quoted and escaped the way json::dump() does it.
+        Builder &appendJSON(const std::string &text)
+        {
+            static const char hex[] = "0123456789abcdef";
+            buffer.push_back('"');
+            for (unsigned char c : text)
+            {
+                switch (c)
+                {
+                case '"':
+                    append("\\\"");
+                    break;
+                case '\\':
+                    append("\\\\");
+                    break;
+                case '\b':
+                    append("\\b");
+                    break;
+                case '\f':
+                    append("\\f");
+                    break;
+                case '\n':
+                    append("\\n");
+                    break;
+                case '\r':
+                    append("\\r");
+                    break;
+                case '\t':
+                    append("\\t");
+                    break;
+                default:
+                    if (c < 0x20)
+                    {
+                        char escaped[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf]};
+                        append(escaped, sizeof(escaped));
+                    }
+                    else
+                        buffer.push_back(static_cast<char>(c));
+                }
+            }
+            buffer.push_back('"');
+            return *this;
+        }
+
+        // "key": prefix of a JSON member, with the separating comma when it is not the first one.
+        Builder &appendKey(const char *key, bool first = false)
+        {
+            if (!first)
+                buffer.push_back(',');
+            buffer.push_back('"');
+            buffer.append(key);
+            buffer.append("\":");
+            return *this;
+        }
+
+        const char *data() const
+        {
+            return buffer.data();
+        }
+
+        size_t size() const
+        {
+            return buffer.size();
+        }
+
+        const std::string &str() const
+        {
+            return buffer;
+        }
+
+    private:
+        std::string &buffer;
+    };
+}
+
+#endif
@@ -0,0 +1,99 @@
+/*
+   RotationModel: a first order Markov model of crop rotation.
+   It counts how often plant B was grown right after plant A on the same soil (the same zone) and
+   keeps, for every plant A, the kTopK most frequent successors in order. Both are updated
+   incrementally for every new season, so ranking the suggestions for a plant is a lookup of one
+   row, independent of the length of the history.
+*/
+
+#ifndef GREENHOUSE_ROTATION_MODEL_HPP
+#define GREENHOUSE_ROTATION_MODEL_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class RotationModel
+{
+public:
+    using PlantId = uint32_t;
+    static constexpr size_t kTopK = 8;
+
+    struct Suggestion
+    {
+        PlantId plant;
+        uint32_t count;
+    };
+
+    // Records that `next` was grown after `previous` on the same soil.
+    void observe(PlantId previous, PlantId next)
+    {
+        Row &row = rowOf(previous);
+        uint32_t count = ++row.counts[next];
+        row.total++;
+        transitions++;
+
+        // Counts only grow, so a plant can only enter the top list when its own count grows.
+        // Ties keep the plant that got there first.
+        auto &top = row.top;
+        auto it = std::find_if(top.begin(), top.end(), [next](const Suggestion &s)
+                               { return s.plant == next; });
+        if (it != top.end())
+            it->count = count;
+        else if (top.size() < kTopK)
+            it = top.insert(top.end(), Suggestion{next, count});
+        else if (count > top.back().count)
+        {
+            top.back() = Suggestion{next, count};
+            it = top.end() - 1;
+        }
+        else
+            return;
+        while (it != top.begin() && (it - 1)->count < it->count)
+        {
+            std::iter_swap(it - 1, it);
+            --it;
+        }
+    }
+
+    // The most frequent successors of a plant, best first (at most kTopK), and how many
+    // transitions from that plant were seen in total.
+    const std::vector<Suggestion> &successors(PlantId previous, uint32_t &total) const
+    {
+        static const std::vector<Suggestion> none;
+        if (previous >= rows.size())
+        {
+            total = 0;
+            return none;
+        }
+        total = rows[previous].total;
+        return rows[previous].top;
+    }
+
+    uint64_t transitionCount() const
+    {
+        return transitions;
+    }
+
+private:
+    struct Row
+    {
+        std::unordered_map<PlantId, uint32_t> counts;
+        std::vector<Suggestion> top;
+        uint32_t total = 0;
+    };
+
+    Row &rowOf(PlantId plant)
+    {
+        if (plant >= rows.size())
+            rows.resize(plant + 1);
+        return rows[plant];
+    }
+
+    std::vector<Row> rows;
+    uint64_t transitions = 0;
+};
+
+#endif
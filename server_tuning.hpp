@@ -0,0 +1,305 @@
+/*
+   Tuning of the Pistache endpoint: worker threads, request limits, TCP flags, listen backlog,
+   SO_REUSEPORT listener shards and pinning of the reactor threads to cores.
+   Values come from a JSON file (server_tuning.json by default) and can be overridden from
+   the command line with --name value pairs.
+*/
+
+#ifndef GREENHOUSE_SERVER_TUNING_HPP
+#define GREENHOUSE_SERVER_TUNING_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "./json.hpp"
+#include "./admission.hpp"
+#include "./rate_limit.hpp"
+#include "./compression.hpp"
+#include "./climate_control.hpp"
+#include "./alerts.hpp"
+#include "./audit_log.hpp"
+#include "./replication.hpp"
+#include "./offload.hpp"
+
+namespace Tuning
+{
+    struct ServerTuning
+    {
+        // Reactor (worker) threads of every shard.
+        int threads = 2;
+        // Number of listeners bound to the same port. More than one needs SO_REUSEPORT,
+        // the kernel then spreads new connections over the shards.
+        int shards = 1;
+        size_t maxRequestSize = 4096;
+        int backlog = 128;
+        bool noDelay = false;
+        bool reuseAddr = true;
+        bool reusePort = false;
+        // Pin every reactor thread to its own core, round robin over cpus (all usable cores when empty).
+        bool pinThreads = false;
+        std::vector<int> cpus;
+        // Name of the reactor threads. The shard number is appended to it and Linux keeps 15 characters.
+        std::string threadsName = "greenhouse";
+        // Load shedding of the write routes, see admission.hpp.
+        Admission::Config admission;
+        // Per client rate limits, see rate_limit.hpp.
+        RateLimit::Config rateLimit;
+        // Compression of large responses, see compression.hpp.
+        Compression::Config compression;
+        // Control loop of the climate, see climate_control.hpp.
+        Climate::Config climate;
+        // Alert rules on the telemetry, see alerts.hpp.
+        Alerts::Config alerts;
+        // Log of the changes to the greenhouse, see audit_log.hpp.
+        Audit::Config audit;
+        // Leader/follower replication, see replication.hpp.
+        Replication::Config replication;
+        // POSIX shared memory segment the settings are published in (shared_settings.hpp), empty for none.
+        // Servers on the same machine need different names.
+        std::string sharedSettings = "/greenhouse-settings";
+        // Routes whose handlers run on a work-stealing executor, see offload.hpp.
+        Offload::Config offload;
+
+        void validate() const
+        {
+            if (threads < 1)
+                throw std::invalid_argument("threads must be at least 1");
+            if (shards < 1)
+                throw std::invalid_argument("shards must be at least 1");
+            if (shards > 1 && !reusePort)
+                throw std::invalid_argument("shards > 1 needs reusePort");
+            if (threadsName.empty() || threadsName.size() > 12)
+                throw std::invalid_argument("threadsName must have 1 to 12 characters");
+            if (climate.enabled && (climate.rate <= 0 || climate.rate > 1000))
+                throw std::invalid_argument("climate.rate must be above 0 and at most 1000 ticks per second");
+            if (climate.maxZones < 1 || climate.maxZones > 65536 || climate.zonesPerTick < 1)
+                throw std::invalid_argument("climate.maxZones must be from 1 to 65536 and climate.zonesPerTick at least 1");
+            if (audit.enabled && (audit.capacity < 1 || audit.capacity > (1u << 24) || audit.flushInterval <= 0 || audit.checkpointEvery < 1))
+                throw std::invalid_argument("audit.capacity must be from 1 to 16777216, audit.flushInterval above 0 and audit.checkpointEvery at least 1");
+            if (replication.port < 0 || replication.port > 65535 || replication.batchInterval <= 0 || replication.backlog < 1)
+                throw std::invalid_argument("replication.port must be from 0 to 65535, replication.batchInterval above 0 and replication.backlog at least 1");
+            if (offload.enabled && (offload.threads < 1 || offload.threads > 256 || offload.capacity < 1))
+                throw std::invalid_argument("offload.threads must be from 1 to 256 and offload.capacity at least 1");
+        }
+
+        std::string shardThreadsName(int shard) const
+        {
+            return threadsName + "-" + std::to_string(shard);
+        }
+    };
+
+    inline std::vector<int> parseCpus(const std::string &list)
+    {
+        std::vector<int> cpus;
+        std::stringstream in(list);
+        std::string item;
+        while (std::getline(in, item, ','))
+        {
+            if (item.empty())
+                continue;
+            size_t dash = item.find('-');
+            if (dash == std::string::npos)
+                cpus.push_back(std::stoi(item));
+            else
+                for (int cpu = std::stoi(item.substr(0, dash)); cpu <= std::stoi(item.substr(dash + 1)); cpu++)
+                    cpus.push_back(cpu);
+        }
+        return cpus;
+    }
+
+    inline void from_json(const nlohmann::json &j, ServerTuning &t)
+    {
+        t.threads = j.value("threads", t.threads);
+        t.shards = j.value("shards", t.shards);
+        t.maxRequestSize = j.value("maxRequestSize", t.maxRequestSize);
+        t.backlog = j.value("backlog", t.backlog);
+        t.noDelay = j.value("noDelay", t.noDelay);
+        t.reuseAddr = j.value("reuseAddr", t.reuseAddr);
+        t.reusePort = j.value("reusePort", t.reusePort);
+        t.pinThreads = j.value("pinThreads", t.pinThreads);
+        t.cpus = j.value("cpus", t.cpus);
+        t.threadsName = j.value("threadsName", t.threadsName);
+        t.admission = j.value("admission", t.admission);
+        t.rateLimit = j.value("rateLimit", t.rateLimit);
+        t.compression = j.value("compression", t.compression);
+        t.climate = j.value("climate", t.climate);
+        t.alerts = j.value("alerts", t.alerts);
+        t.audit = j.value("audit", t.audit);
+        t.replication = j.value("replication", t.replication);
+        t.sharedSettings = j.value("sharedSettings", t.sharedSettings);
+        t.offload = j.value("offload", t.offload);
+    }
+
+    inline void to_json(nlohmann::json &j, const ServerTuning &t)
+    {
+        j = nlohmann::json{
+            {"threads", t.threads},
+            {"shards", t.shards},
+            {"maxRequestSize", t.maxRequestSize},
+            {"backlog", t.backlog},
+            {"noDelay", t.noDelay},
+            {"reuseAddr", t.reuseAddr},
+            {"reusePort", t.reusePort},
+            {"pinThreads", t.pinThreads},
+            {"cpus", t.cpus},
+            {"threadsName", t.threadsName},
+            {"admission", t.admission},
+            {"rateLimit", t.rateLimit},
+            {"compression", t.compression},
+            {"climate", t.climate},
+            {"alerts", t.alerts},
+            {"audit", t.audit},
+            {"replication", t.replication},
+            {"sharedSettings", t.sharedSettings},
+            {"offload", t.offload}};
+    }
+
+    // Reads the tuning file. A missing file keeps the defaults, a malformed one throws.
+    inline void loadFile(const std::string &file, ServerTuning &t)
+    {
+        std::ifstream in(file);
+        if (!in)
+            return;
+        from_json(nlohmann::json::parse(in), t);
+    }
+
+    // Applies one --name value pair, returns false when the name is not a tuning option.
+    inline bool applyOption(const std::string &name, const std::string &value, ServerTuning &t)
+    {
+        if (name == "--threads")
+            t.threads = std::stoi(value);
+        else if (name == "--shards")
+            t.shards = std::stoi(value);
+        else if (name == "--max-request-size")
+            t.maxRequestSize = std::stoull(value);
+        else if (name == "--backlog")
+            t.backlog = std::stoi(value);
+        else if (name == "--no-delay")
+            t.noDelay = value != "0";
+        else if (name == "--reuse-addr")
+            t.reuseAddr = value != "0";
+        else if (name == "--reuse-port")
+            t.reusePort = value != "0";
+        else if (name == "--pin")
+            t.pinThreads = value != "0";
+        else if (name == "--cpus")
+            t.cpus = parseCpus(value);
+        else if (name == "--threads-name")
+            t.threadsName = value;
+        else if (name == "--admission")
+            t.admission.enabled = value != "0";
+        else if (name == "--rate-limit")
+            t.rateLimit.enabled = value != "0";
+        else if (name == "--compression")
+            t.compression.enabled = value != "0";
+        else if (name == "--climate")
+            t.climate.enabled = value != "0";
+        else if (name == "--control-rate")
+            t.climate.rate = std::stod(value);
+        else if (name == "--alerts")
+            t.alerts.enabled = value != "0";
+        else if (name == "--audit")
+            t.audit.enabled = value != "0";
+        else if (name == "--audit-file")
+            t.audit.file = value;
+        else if (name == "--replication-port")
+            t.replication.port = std::stoi(value);
+        else if (name == "--follow")
+            t.replication.leader = value;
+        else if (name == "--shared-settings")
+            t.sharedSettings = value == "0" ? "" : value;
+        else if (name == "--offload")
+            t.offload.enabled = value != "0";
+        else if (name == "--offload-threads")
+            t.offload.threads = std::stoi(value);
+        else
+            return false;
+        return true;
+    }
+
+    // Cores the process may run on, in ascending order.
+    inline std::vector<int> usableCpus()
+    {
+        std::vector<int> cpus;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        {
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+                if (CPU_ISSET(cpu, &set))
+                    cpus.push_back(cpu);
+        }
+        if (cpus.empty())
+            for (unsigned cpu = 0; cpu < std::thread::hardware_concurrency(); cpu++)
+                cpus.push_back(static_cast<int>(cpu));
+        return cpus;
+    }
+
+    // Thread ids of this process whose name is exactly the given one, in creation order.
+    inline std::vector<pid_t> threadsNamed(const std::string &name)
+    {
+        std::vector<pid_t> tids;
+        DIR *dir = opendir("/proc/self/task");
+        if (dir == nullptr)
+            return tids;
+        while (dirent *entry = readdir(dir))
+        {
+            if (entry->d_name[0] == '.')
+                continue;
+            std::ifstream comm(std::string("/proc/self/task/") + entry->d_name + "/comm");
+            std::string threadName;
+            if (std::getline(comm, threadName) && threadName == name)
+                tids.push_back(static_cast<pid_t>(std::atoi(entry->d_name)));
+        }
+        closedir(dir);
+        std::sort(tids.begin(), tids.end());
+        return tids;
+    }
+
+    // Pins the reactor threads of every shard, one core each, round robin over the configured cores.
+    // The reactors start their threads asynchronously, so this waits (up to a second) until all of
+    // them are named. Returns the number of threads pinned.
+    inline int pinReactorThreads(const ServerTuning &t)
+    {
+        std::vector<int> cpus = t.cpus.empty() ? usableCpus() : t.cpus;
+        if (cpus.empty())
+            return 0;
+
+        int pinned = 0;
+        size_t next = 0;
+        for (int shard = 0; shard < t.shards; shard++)
+        {
+            std::vector<pid_t> tids;
+            for (int attempt = 0; attempt < 100; attempt++)
+            {
+                tids = threadsNamed(t.shardThreadsName(shard));
+                if (static_cast<int>(tids.size()) >= t.threads)
+                    break;
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            for (pid_t tid : tids)
+            {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(cpus[next++ % cpus.size()], &set);
+                if (sched_setaffinity(tid, sizeof(set), &set) == 0)
+                    pinned++;
+            }
+        }
+        return pinned;
+    }
+}
+
+#endif
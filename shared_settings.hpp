@@ -0,0 +1,212 @@
+/*
+   The current settings of greenhouse_app in POSIX shared memory, for the processes on the same
+   machine (control loops, HMIs) that would otherwise poll GET /settings/getAll. The server
+   rewrites one fixed layout block whenever a setting changes; readers map the segment read-only
+   and copy the block under a seqlock: no syscall and no lock, and the server never waits for them.
+
+   Readers only need this header (the standard library and POSIX):
+       SharedSettings::Reader reader;
+       SharedSettings::Block settings;
+       if (reader.open() && reader.read(settings))
+           use(settings.temperature);
+   greenhouse_settings_reader.cpp is an example.
+*/
+
+#ifndef GREENHOUSE_SHARED_SETTINGS_HPP
+#define GREENHOUSE_SHARED_SETTINGS_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace SharedSettings
+{
+    constexpr const char *kDefaultName = "/greenhouse-settings";
+    constexpr uint32_t kMagic = 0x53484753; // "SGHS"
+    // Changes whenever Block does, so old readers refuse a new layout.
+    constexpr uint32_t kLayout = 1;
+
+    // The settings, in a fixed layout: numbers, and NUL terminated strings cut to fit.
+    struct Block
+    {
+        double area;
+        double carbonDioxide;
+        double humidity;
+        double luminosity;
+        double temperature;
+        double waterAmount;
+        char irigationTime[32];
+        char plantType[64];
+        // When the block was last written (microseconds since the epoch) and how many times.
+        int64_t updated;
+        uint64_t version;
+    };
+
+    // The mapped segment. sequence is odd while the block is being written.
+    struct Segment
+    {
+        uint32_t magic;
+        uint32_t layout;
+        alignas(64) std::atomic<uint64_t> sequence;
+        Block block;
+    };
+
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "the sequence is shared between processes");
+
+    template <size_t N>
+    void copyString(char (&to)[N], const std::string &from)
+    {
+        size_t size = std::min(from.size(), N - 1);
+        std::memcpy(to, from.data(), size);
+        std::memset(to + size, 0, N - size);
+    }
+
+    // Seqlock writer: one writer at a time (the server writes with settingsLock held).
+    inline void write(std::atomic<uint64_t> &sequence, Block &target, const Block &source)
+    {
+        uint64_t start = sequence.load(std::memory_order_relaxed);
+        sequence.store(start + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        std::memcpy(&target, &source, sizeof(Block));
+        sequence.store(start + 2, std::memory_order_release);
+    }
+
+    // Seqlock reader: false when a write overlapped the copy, which must then be retried.
+    inline bool tryRead(const std::atomic<uint64_t> &sequence, const Block &source, Block &target)
+    {
+        uint64_t start = sequence.load(std::memory_order_acquire);
+        if (start & 1)
+            return false;
+        std::memcpy(&target, &source, sizeof(Block));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return sequence.load(std::memory_order_relaxed) == start;
+    }
+
+    inline void read(const std::atomic<uint64_t> &sequence, const Block &source, Block &target)
+    {
+        while (!tryRead(sequence, source, target))
+        {
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#endif
+        }
+    }
+
+    // The server's side: creates the segment and writes the block.
+    class Publisher
+    {
+    public:
+        ~Publisher()
+        {
+            close();
+        }
+
+        // Creates the segment, or reuses the one a previous run left. Returns false (errno set)
+        // when it cannot.
+        bool open(const std::string &name = kDefaultName)
+        {
+            close();
+            int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0644);
+            if (fd < 0)
+                return false;
+            void *mapped = MAP_FAILED;
+            if (ftruncate(fd, sizeof(Segment)) == 0)
+                mapped = mmap(nullptr, sizeof(Segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if (mapped == MAP_FAILED)
+                return false;
+            segment = static_cast<Segment *>(mapped);
+            // A new segment is all zeros: sequence 0, an empty block.
+            new (&segment->sequence) std::atomic<uint64_t>(segment->sequence.load(std::memory_order_relaxed) & ~uint64_t(1));
+            segment->layout = kLayout;
+            segment->magic = kMagic;
+            this->name = name;
+            return true;
+        }
+
+        // Unmaps the segment and removes its name, so readers opened afterwards do not take the
+        // settings of a stopped server for current ones.
+        void close()
+        {
+            if (segment)
+            {
+                munmap(segment, sizeof(Segment));
+                shm_unlink(name.c_str());
+            }
+            segment = nullptr;
+        }
+
+        bool isOpen() const
+        {
+            return segment != nullptr;
+        }
+
+        void publish(const Block &block)
+        {
+            if (segment)
+                write(segment->sequence, segment->block, block);
+        }
+
+    private:
+        Segment *segment = nullptr;
+        std::string name;
+    };
+
+    // A reader's side: maps the segment read-only.
+    class Reader
+    {
+    public:
+        ~Reader()
+        {
+            close();
+        }
+
+        // False when the server has not created the segment (yet) or it has another layout.
+        bool open(const std::string &name = kDefaultName)
+        {
+            close();
+            int fd = shm_open(name.c_str(), O_RDONLY, 0);
+            if (fd < 0)
+                return false;
+            void *mapped = mmap(nullptr, sizeof(Segment), PROT_READ, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if (mapped == MAP_FAILED)
+                return false;
+            segment = static_cast<const Segment *>(mapped);
+            if (segment->magic != kMagic || segment->layout != kLayout)
+            {
+                close();
+                return false;
+            }
+            return true;
+        }
+
+        void close()
+        {
+            if (segment)
+                munmap(const_cast<Segment *>(segment), sizeof(Segment));
+            segment = nullptr;
+        }
+
+        // A consistent copy of the settings. False until the server has written them once.
+        bool read(Block &block) const
+        {
+            if (!segment)
+                return false;
+            SharedSettings::read(segment->sequence, segment->block, block);
+            return block.version != 0;
+        }
+
+    private:
+        const Segment *segment = nullptr;
+    };
+}
+
+#endif
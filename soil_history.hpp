@@ -0,0 +1,230 @@
+/*
+   SoilHistory: one record per season of the greenhouse soil (plant, year, season start and end,
+   zone, yield), stored column by column. Every column is a vector of a fixed width type and plant
+   names are replaced by ids into a dictionary, so code that only needs some fields (the rotation
+   suggestion only reads plants, the yield statistics plants and yields) scans just those columns.
+*/
+
+#ifndef GREENHOUSE_SOIL_HISTORY_HPP
+#define GREENHOUSE_SOIL_HISTORY_HPP
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <time.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "./response_builder.hpp"
+
+// One season, as read from the file or a request. Unknown fields keep their defaults.
+struct Season
+{
+    std::string plantType;
+    int year = 0;
+    // Days since 1970-01-01 (UTC), 0 when unknown.
+    int32_t seasonStart = 0;
+    int32_t seasonEnd = 0;
+    uint16_t zone = 0;
+    // Harvest in kg per square meter, NaN when unknown.
+    double yield = NAN;
+};
+
+class SoilHistory
+{
+public:
+    using PlantId = uint32_t;
+    static constexpr PlantId kNoPlant = UINT32_MAX;
+    // Yields are kept in grams per square meter.
+    static constexpr int32_t kNoYield = INT32_MIN;
+
+    // Parses a YYYY-MM-DD date into days since 1970-01-01. Returns false if it is not a date.
+    static bool parseDate(const std::string &text, int32_t &days)
+    {
+        struct tm date = {0};
+        const char *end = strptime(text.c_str(), "%Y-%m-%d", &date);
+        if (end == nullptr || *end != '\0')
+            return false;
+        days = static_cast<int32_t>(timegm(&date) / 86400);
+        return true;
+    }
+
+    static void writeDate(int32_t days, Reply::Builder &out)
+    {
+        time_t seconds = static_cast<time_t>(days) * 86400;
+        struct tm date;
+        gmtime_r(&seconds, &date);
+        char text[16];
+        size_t length = strftime(text, sizeof(text), "%Y-%m-%d", &date);
+        out.append('"').append(text, length).append('"');
+    }
+
+    size_t size() const
+    {
+        return plants.size();
+    }
+
+    int lastYear() const
+    {
+        return years.back();
+    }
+
+    bool empty() const
+    {
+        return plants.empty();
+    }
+
+    // Appends a season. Years never go back, so the year column stays sorted.
+    // Returns false, and adds nothing, if the season is before the last one, ends before it starts
+    // or has an impossible yield.
+    bool append(const Season &season)
+    {
+        if (!years.empty() && season.year < years.back())
+            return false;
+        if (season.seasonStart != 0 && season.seasonEnd != 0 && season.seasonEnd < season.seasonStart)
+            return false;
+        if (!std::isnan(season.yield) && (season.yield < 0 || season.yield > 1e6))
+            return false;
+        plants.push_back(intern(season.plantType));
+        years.push_back(season.year);
+        starts.push_back(season.seasonStart);
+        ends.push_back(season.seasonEnd);
+        zones.push_back(season.zone);
+        yields.push_back(std::isnan(season.yield) ? kNoYield : static_cast<int32_t>(std::lround(season.yield * 1000)));
+        return true;
+    }
+
+    // The season at position i, rebuilt from the columns.
+    Season season(size_t i) const
+    {
+        Season season;
+        season.plantType = plantNames[plants[i]];
+        season.year = years[i];
+        season.seasonStart = starts[i];
+        season.seasonEnd = ends[i];
+        season.zone = zones[i];
+        season.yield = yields[i] == kNoYield ? NAN : yields[i] / 1000.0;
+        return season;
+    }
+
+    // The columns, all of size(), in season order.
+    const std::vector<PlantId> &plantColumn() const
+    {
+        return plants;
+    }
+
+    const std::vector<int> &yearColumn() const
+    {
+        return years;
+    }
+
+    const std::vector<uint16_t> &zoneColumn() const
+    {
+        return zones;
+    }
+
+    const std::vector<int32_t> &yieldColumn() const
+    {
+        return yields;
+    }
+
+    // Plant dictionary: ids are given in order of first appearance.
+    size_t plantCount() const
+    {
+        return plantNames.size();
+    }
+
+    const std::string &plantName(PlantId id) const
+    {
+        return plantNames[id];
+    }
+
+    PlantId plantId(const std::string &name) const
+    {
+        auto it = plantIds.find(name);
+        return it == plantIds.end() ? kNoPlant : it->second;
+    }
+
+    // Positions [first, last) of the seasons from fromYear to toYear, both included, in O(log n).
+    std::pair<size_t, size_t> rangeOfYears(int fromYear, int toYear) const
+    {
+        auto first = std::lower_bound(years.begin(), years.end(), fromYear);
+        auto last = std::upper_bound(first, years.end(), toYear);
+        return {static_cast<size_t>(first - years.begin()), static_cast<size_t>(last - years.begin())};
+    }
+
+    // Writes the seasons at positions [first, last) as comma separated JSON objects.
+    void writeSeasons(size_t first, size_t last, Reply::Builder &out) const
+    {
+        last = std::min(last, size());
+        for (size_t i = first; i < last; i++)
+        {
+            if (i != first)
+                out.append(',');
+            out.append('{').appendKey("index", true).append(static_cast<long long>(i));
+            out.appendKey("plantType").appendJSON(plantNames[plants[i]]);
+            out.appendKey("seasonEnd");
+            writeOptionalDate(ends[i], out);
+            out.appendKey("seasonStart");
+            writeOptionalDate(starts[i], out);
+            out.appendKey("year").append(years[i]);
+            out.appendKey("yield");
+            if (yields[i] == kNoYield)
+                out.append("null");
+            else
+                out.appendJSON(yields[i] / 1000.0);
+            out.appendKey("zone").append(static_cast<int>(zones[i])).append('}');
+        }
+    }
+
+    // The plant names of all seasons as a JSON array, the original view of the history.
+    void writePlantNames(Reply::Builder &out) const
+    {
+        out.append('[');
+        for (size_t i = 0; i < plants.size(); i++)
+        {
+            if (i != 0)
+                out.append(',');
+            out.appendJSON(plantNames[plants[i]]);
+        }
+        out.append(']');
+    }
+
+private:
+    static void writeOptionalDate(int32_t days, Reply::Builder &out)
+    {
+        if (days == 0)
+            out.append("null");
+        else
+            writeDate(days, out);
+    }
+
+    PlantId intern(const std::string &name)
+    {
+        auto it = plantIds.find(name);
+        if (it != plantIds.end())
+            return it->second;
+        PlantId id = static_cast<PlantId>(plantNames.size());
+        plantNames.push_back(name);
+        plantIds.emplace(name, id);
+        return id;
+    }
+
+    // Columns
+    std::vector<PlantId> plants;
+    std::vector<int> years;
+    std::vector<int32_t> starts;
+    std::vector<int32_t> ends;
+    std::vector<uint16_t> zones;
+    std::vector<int32_t> yields;
+
+    // Plant dictionary
+    std::vector<std::string> plantNames;
+    std::unordered_map<std::string, PlantId> plantIds;
+};
+
+#endif